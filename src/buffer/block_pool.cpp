@@ -0,0 +1,158 @@
+// by zxg
+//
+#include "block_pool.h"
+
+#include <sys/mman.h>  // mmap()
+
+#include <new>  // std::bad_alloc
+
+BlockPool::ThreadCache::~ThreadCache() {
+  if (count > 0) BlockPool::Instance()->Drain(this, count);
+}
+
+BlockPool::BlockPool()
+    : free_(nullptr),
+      num_free_(0),
+      released_(nullptr),
+      num_released_(0),
+      num_slabs_(0),
+      in_use_(0),
+      oversized_(0) {}
+
+BlockPool* BlockPool::Instance() {
+  static BlockPool pool;
+  return &pool;
+}
+
+BlockPool::ThreadCache& BlockPool::LocalCache() {
+  thread_local ThreadCache cache;
+  return cache;
+}
+
+BufferBlock* BlockPool::Alloc(size_t capacity) {
+  BufferBlock* block;
+  if (capacity > BLOCK_SIZE) {
+    block = new BufferBlock;
+    block->data = new char[capacity];
+    block->capacity = capacity;
+    ++oversized_;
+  } else {
+    ThreadCache& cache = LocalCache();
+    if (cache.head == nullptr) Refill(&cache);
+    block = cache.head;
+    cache.head = block->next;
+    --cache.count;
+    ++in_use_;
+  }
+  block->read_pos = block->write_pos = 0;
+  block->next = nullptr;
+  return block;
+}
+
+void BlockPool::Free(BufferBlock* block) {
+  if (block->capacity != BLOCK_SIZE) {
+    delete[] block->data;
+    delete block;
+    --oversized_;
+    return;
+  }
+  --in_use_;
+  ThreadCache& cache = LocalCache();
+  block->next = cache.head;
+  cache.head = block;
+  // 一个线程释放的块可能比它分配的多(别的线程读到的数据在这里发送完)，
+  // 缓存太多时还给全局链表，其他线程可以使用
+  if (++cache.count >= 2 * CACHE_BATCH) Drain(&cache, CACHE_BATCH);
+}
+
+size_t BlockPool::get_num_slabs() {
+  std::lock_guard<std::mutex> locker(mtx_);
+  return num_slabs_;
+}
+
+size_t BlockPool::get_num_released() {
+  std::lock_guard<std::mutex> locker(mtx_);
+  return num_released_;
+}
+
+size_t BlockPool::Trim(size_t keep) {
+  // 在锁内摘下多出来的一段，madvise在锁外做，不挡住其他线程分配
+  BufferBlock* first;
+  size_t count;
+  {
+    std::lock_guard<std::mutex> locker(mtx_);
+    if (num_free_ <= keep) return 0;
+    count = num_free_ - keep;
+    if (keep == 0) {
+      first = free_;
+      free_ = nullptr;
+    } else {
+      BufferBlock* last = free_;
+      for (size_t i = 1; i < keep; ++i) last = last->next;
+      first = last->next;
+      last->next = nullptr;
+    }
+    num_free_ = keep;
+  }
+  BufferBlock* last = first;
+  for (BufferBlock* block = first; block; block = block->next) {
+    madvise(block->data, BLOCK_SIZE, MADV_DONTNEED);
+    last = block;
+  }
+  std::lock_guard<std::mutex> locker(mtx_);
+  last->next = released_;
+  released_ = first;
+  num_released_ += count;
+  return count;
+}
+
+void BlockPool::Refill(ThreadCache* cache) {
+  std::lock_guard<std::mutex> locker(mtx_);
+  for (size_t i = 0; i < CACHE_BATCH; ++i) {
+    // 优先使用物理内存还在的块
+    BufferBlock* block;
+    if (free_ == nullptr && released_ != nullptr) {
+      block = released_;
+      released_ = block->next;
+      --num_released_;
+    } else {
+      if (free_ == nullptr) NewSlab();
+      block = free_;
+      free_ = block->next;
+      --num_free_;
+    }
+    block->next = cache->head;
+    cache->head = block;
+    ++cache->count;
+  }
+}
+
+void BlockPool::Drain(ThreadCache* cache, size_t count) {
+  // 先在锁外摘下要还的一段，加锁后整段接到全局链表上
+  BufferBlock* first = cache->head;
+  BufferBlock* last = first;
+  for (size_t i = 1; i < count; ++i) last = last->next;
+  cache->head = last->next;
+  cache->count -= count;
+  std::lock_guard<std::mutex> locker(mtx_);
+  last->next = free_;
+  free_ = first;
+  num_free_ += count;
+}
+
+void BlockPool::NewSlab() {
+  // 数据区用mmap申请，按页对齐，不和其他内存混在一起
+  void* addr = mmap(nullptr, SLAB_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) throw std::bad_alloc();
+  BufferBlock* headers = new BufferBlock[SLAB_BLOCKS];
+  char* data = static_cast<char*>(addr);
+  for (size_t i = 0; i < SLAB_BLOCKS; ++i) {
+    headers[i].data = data + i * BLOCK_SIZE;
+    headers[i].capacity = BLOCK_SIZE;
+    headers[i].next = free_;
+    free_ = &headers[i];
+  }
+  num_free_ += SLAB_BLOCKS;
+  ++num_slabs_;
+}
@@ -0,0 +1,82 @@
+// Slab allocator of fixed-size buffer blocks with per-thread caches.
+// by zxg
+//
+#ifndef WEBSERVER_BUFFER_BLOCK_POOL_H_
+#define WEBSERVER_BUFFER_BLOCK_POOL_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <mutex>
+
+// 缓冲链中的一个块。块头和数据分开存放，数据按页对齐
+struct BufferBlock {
+  char* data;
+  size_t capacity;   // 数据区的大小，池中的块都是BlockPool::BLOCK_SIZE
+  size_t read_pos;   // [read_pos, write_pos)是可读的数据
+  size_t write_pos;
+  BufferBlock* next;  // 在缓冲链或者空闲链表中的下一块
+
+  inline size_t ReadableBytes() const { return write_pos - read_pos; }
+  inline size_t WriteableBytes() const { return capacity - write_pos; }
+  inline const char* Peek() const { return data + read_pos; }
+};
+
+// 所有连接共用的块池。块按SLAB_BLOCKS个一组向系统申请(一次mmap)，
+// 释放后回到空闲链表，地址空间不还给系统，但可以用Trim交还物理内存。
+// 每个线程有自己的缓存，分配和释放通常不用加锁，
+// 缓存空了从全局链表取一批，太多了还回去一批
+class BlockPool {
+ public:
+  static const size_t BLOCK_SIZE = 4096;   // 一页，大多数请求和响应头放得下
+  static const size_t SLAB_BLOCKS = 64;    // 每次向系统申请的块数
+  static const size_t CACHE_BATCH = 32;    // 线程缓存和全局链表之间一次移动的块数
+
+  static BlockPool* Instance();  // 单例模式
+  BlockPool(const BlockPool&) = delete;
+  BlockPool& operator=(const BlockPool&) = delete;
+
+  // 分配一个容量至少为capacity的空块。超过BLOCK_SIZE的块单独申请，
+  // 只用于需要连续内存的大请求体
+  BufferBlock* Alloc(size_t capacity = BLOCK_SIZE);
+  void Free(BufferBlock* block);
+  // 全局空闲链表中超过keep的块用madvise把物理内存还给系统，
+  // 块还留在池中，下次使用时由缺页重新分配。返回这次交还的块数
+  size_t Trim(size_t keep);
+
+  // 统计信息，用于日志
+  size_t get_num_slabs();
+  inline size_t get_in_use() const { return in_use_; }  // 正在使用的池中块数
+  inline size_t get_oversized() const { return oversized_; }
+  size_t get_num_released();  // 物理内存已经交还的空闲块数
+
+ private:
+  // 线程的本地缓存，线程退出时把块还给全局链表
+  struct ThreadCache {
+    ~ThreadCache();
+    BufferBlock* head = nullptr;
+    size_t count = 0;
+  };
+
+  BlockPool();
+  ~BlockPool() = default;  // 块可能还被其他静态对象引用，不释放
+
+  static ThreadCache& LocalCache();
+  // 从全局链表取一批块放入cache，不够时申请新的slab
+  void Refill(ThreadCache* cache);
+  // 从cache还count块给全局链表
+  void Drain(ThreadCache* cache, size_t count);
+  // 申请一个slab，块放入空闲链表，要求持有mtx_
+  void NewSlab();
+
+  std::mutex mtx_;
+  BufferBlock* free_;      // 全局的空闲块
+  size_t num_free_;
+  BufferBlock* released_;  // 物理内存已经交还的空闲块，free_用完后才使用
+  size_t num_released_;
+  size_t num_slabs_;
+  std::atomic<size_t> in_use_;
+  std::atomic<size_t> oversized_;  // 正在使用的超大块数
+};
+
+#endif  // WEBSERVER_BUFFER_BLOCK_POOL_H_
@@ -1,13 +1,10 @@
 #include "buffer.h"
 
+// vector构造时已经清零，不需要再bzero
 Buffer::Buffer(int buffer_size) 
-    : buffer_(buffer_size), read_pos_(0), write_pos_(0) {
-  bzero(&(*buffer_.begin()), buffer_.size());
-}
+    : buffer_(buffer_size), read_pos_(0), write_pos_(0) {}
 
-Buffer::Buffer() : buffer_(1024), read_pos_(0), write_pos_(0) {
-  bzero(&(*buffer_.begin()), buffer_.size());
-}
+Buffer::Buffer() : buffer_(1024), read_pos_(0), write_pos_(0) {}
 
 void Buffer::RetrieveUntil(const char* end) {
   auto start = Peek();
@@ -16,7 +13,7 @@ void Buffer::RetrieveUntil(const char* end) {
 }
 
 void Buffer::RetrieveAll() {
-  bzero(&(*buffer_.begin()), buffer_.size());
+  // 只移动读写指针，旧数据不用清零，之后总是先写再读
   read_pos_ = 0;  // 读写指针偏移量归零, buffer was empty
   write_pos_ = 0;  
 }
@@ -0,0 +1,182 @@
+// by zxg
+//
+#include "buffer_chain.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>      // memcpy()
+#include <sys/socket.h>  // sendmsg()
+#include <sys/uio.h>     // readv()
+
+#include <algorithm>
+
+BufferChain::BufferChain()
+    : head_(nullptr), tail_(nullptr), num_blocks_(0), readable_(0) {}
+
+BufferChain::~BufferChain() { RetrieveAll(); }
+
+size_t BufferChain::get_allocated() const {
+  size_t total = 0;
+  for (const BufferBlock* block = head_; block; block = block->next) {
+    total += block->capacity;
+  }
+  return total;
+}
+
+size_t BufferChain::PeekCopy(char* out, size_t len) const {
+  size_t copied = 0;
+  for (const BufferBlock* block = head_; block && copied < len;
+       block = block->next) {
+    const size_t n = std::min(len - copied, block->ReadableBytes());
+    memcpy(out + copied, block->Peek(), n);
+    copied += n;
+  }
+  return copied;
+}
+
+void BufferChain::Pullup(size_t len) {
+  len = std::min(len, readable_);
+  if (len == 0 || head_->ReadableBytes() >= len) return;
+  BlockPool* pool = BlockPool::Instance();
+  if (head_->capacity - head_->read_pos < len) {
+    // 第一块剩下的空间放不下，换成一个足够大的新块
+    BufferBlock* block = pool->Alloc(len);
+    const size_t n = head_->ReadableBytes();
+    memcpy(block->data, head_->Peek(), n);
+    block->write_pos = n;
+    block->next = head_->next;
+    pool->Free(head_);
+    head_ = block;
+  }
+  // 把后面块中的数据移到第一块的末尾，只拷贝需要的部分
+  while (head_->ReadableBytes() < len) {
+    BufferBlock* next = head_->next;
+    const size_t n =
+        std::min(len - head_->ReadableBytes(), next->ReadableBytes());
+    memcpy(head_->data + head_->write_pos, next->Peek(), n);
+    head_->write_pos += n;
+    next->read_pos += n;
+    if (next->ReadableBytes() == 0) {
+      head_->next = next->next;
+      if (tail_ == next) tail_ = head_;
+      --num_blocks_;
+      pool->Free(next);
+    }
+  }
+}
+
+void BufferChain::Retrieve(size_t len) {
+  assert(len <= readable_);
+  readable_ -= len;
+  while (len > 0) {
+    const size_t n = std::min(len, head_->ReadableBytes());
+    head_->read_pos += n;
+    len -= n;
+    if (head_->ReadableBytes() == 0) PopBlock();
+  }
+}
+
+void BufferChain::RetrieveAll() {
+  while (head_) PopBlock();
+  readable_ = 0;
+}
+
+std::string BufferChain::RetrieveAllToStr() {
+  std::string str;
+  str.reserve(readable_);
+  for (const BufferBlock* block = head_; block; block = block->next) {
+    str.append(block->Peek(), block->ReadableBytes());
+  }
+  RetrieveAll();
+  return str;
+}
+
+void BufferChain::Append(const char* str, size_t len) {
+  readable_ += len;
+  while (len > 0) {
+    if (tail_ == nullptr || tail_->WriteableBytes() == 0) {
+      PushBlock(BlockPool::Instance()->Alloc());
+    }
+    const size_t n = std::min(len, tail_->WriteableBytes());
+    memcpy(tail_->data + tail_->write_pos, str, n);
+    tail_->write_pos += n;
+    str += n;
+    len -= n;
+  }
+}
+
+void BufferChain::Append(const std::string& str) {
+  Append(str.data(), str.size());
+}
+
+ssize_t BufferChain::ReadFd(int fd, int* save_errno) {
+  BlockPool* pool = BlockPool::Instance();
+  struct iovec iov[READ_BLOCKS + 1];
+  BufferBlock* fresh[READ_BLOCKS];
+  int num_iov = 0;
+  const size_t tail_space = tail_ ? tail_->WriteableBytes() : 0;
+  if (tail_space > 0) {
+    iov[num_iov++] = {tail_->data + tail_->write_pos, tail_space};
+  }
+  // 从线程缓存中取块很便宜，没有用上的马上还回去
+  for (size_t i = 0; i < READ_BLOCKS; ++i) {
+    fresh[i] = pool->Alloc();
+    iov[num_iov++] = {fresh[i]->data, fresh[i]->capacity};
+  }
+  const ssize_t n = readv(fd, iov, num_iov);
+  if (n < 0) *save_errno = errno;
+  size_t left = n > 0 ? n : 0;
+  readable_ += left;
+  const size_t in_tail = std::min(left, tail_space);
+  if (in_tail > 0) tail_->write_pos += in_tail;
+  left -= in_tail;
+  for (size_t i = 0; i < READ_BLOCKS; ++i) {
+    if (left == 0) {
+      pool->Free(fresh[i]);
+      continue;
+    }
+    fresh[i]->write_pos = std::min(left, fresh[i]->capacity);
+    left -= fresh[i]->write_pos;
+    PushBlock(fresh[i]);
+  }
+  return n;
+}
+
+ssize_t BufferChain::WriteFd(int fd, int* save_errno) {
+  struct iovec iov[64];
+  size_t num_iov = 0;
+  for (const BufferBlock* block = head_; block && num_iov < 64;
+       block = block->next) {
+    iov[num_iov++] = {const_cast<char*>(block->Peek()),
+                      block->ReadableBytes()};
+  }
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = num_iov;
+  const ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  if (n < 0) {
+    *save_errno = errno;
+    return n;
+  }
+  Retrieve(n);
+  return n;
+}
+
+void BufferChain::PushBlock(BufferBlock* block) {
+  block->next = nullptr;
+  if (tail_) {
+    tail_->next = block;
+  } else {
+    head_ = block;
+  }
+  tail_ = block;
+  ++num_blocks_;
+}
+
+void BufferChain::PopBlock() {
+  BufferBlock* block = head_;
+  head_ = block->next;
+  if (head_ == nullptr) tail_ = nullptr;
+  --num_blocks_;
+  BlockPool::Instance()->Free(block);
+}
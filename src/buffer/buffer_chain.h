@@ -0,0 +1,71 @@
+// Segmented socket buffer built from pooled fixed-size blocks.
+// by zxg
+//
+#ifndef WEBSERVER_BUFFER_BUFFER_CHAIN_H_
+#define WEBSERVER_BUFFER_BUFFER_CHAIN_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+#include "block_pool.h"
+
+// 连接的读写缓冲区，由BlockPool中的块连成一条链。
+// 和Buffer相比：追加数据时只在末尾接新块，不会扩容拷贝，也不用搬移数据来腾出空间；
+// 读socket时直接readv到空闲块中，不需要栈上的临时数组；
+// 数据被取走后块马上还给池，占用的内存只和还没处理的数据量有关。
+// 数据只在块内连续，需要连续内存的地方(解析跨块的请求)用Pullup
+class BufferChain {
+ public:
+  static const size_t READ_BLOCKS = 8;  // 每次readv最多读入的新块数
+
+  BufferChain();
+  ~BufferChain();
+  BufferChain(const BufferChain&) = delete;
+  BufferChain& operator=(const BufferChain&) = delete;
+
+  // 可读字节数
+  inline size_t ReadableBytes() const { return readable_; }
+  // 第一块中可读数据的起始地址和长度，没有数据时长度为0
+  inline const char* Peek() const { return head_ ? head_->Peek() : nullptr; }
+  inline size_t PeekBytes() const {
+    return head_ ? head_->ReadableBytes() : 0;
+  }
+  // 第一块，用来按块遍历数据
+  inline const BufferBlock* FirstBlock() const { return head_; }
+  // 占用的块的总容量，即这个缓冲区实际使用的内存
+  size_t get_allocated() const;
+  // 拷贝开头的至多len字节到out，不取走，返回拷贝的字节数
+  size_t PeekCopy(char* out, size_t len) const;
+
+  // 保证前len(超过可读字节数时按可读字节数)个字节在Peek()处连续
+  void Pullup(size_t len);
+  // 取走len字节，读完的块还给池
+  void Retrieve(size_t len);
+  // 取走所有数据，所有块还给池
+  void RetrieveAll();
+  // 数据转为字符串，并回收所有块
+  std::string RetrieveAllToStr();
+
+  // 追加数据，放不下时接上新块
+  void Append(const char* str, size_t len);
+  void Append(const std::string& str);
+
+  // 从fd读数据，readv到末尾块的剩余空间和至多READ_BLOCKS个新块中
+  ssize_t ReadFd(int fd, int* save_errno);
+  // 把所有数据写到socket，一次sendmsg发送所有块
+  ssize_t WriteFd(int fd, int* save_errno);
+
+ private:
+  // 在末尾接上一块
+  void PushBlock(BufferBlock* block);
+  // 摘下并释放第一块
+  void PopBlock();
+
+  BufferBlock* head_;  // 第一块，读取从这里开始
+  BufferBlock* tail_;  // 最后一块，追加写在这里
+  size_t num_blocks_;
+  size_t readable_;
+};
+
+#endif  // WEBSERVER_BUFFER_BUFFER_CHAIN_H_
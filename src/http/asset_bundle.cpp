@@ -0,0 +1,167 @@
+// by zxg
+//
+#include "asset_bundle.h"
+
+#include <fcntl.h>     // open()
+#include <sys/mman.h>  // mmap(), munmap()
+#include <unistd.h>    // close()
+#include <string.h>    // memcmp()
+
+using namespace std;
+
+AssetBundle::Mapping::~Mapping() {
+  if (base) munmap(base, size);
+}
+
+AssetBundle* AssetBundle::Instance() {
+  static AssetBundle bundle;
+  return &bundle;
+}
+
+bool AssetBundle::Open(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(BundleHeader)) {
+    close(fd);
+    return false;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // 映射建立后就不再需要fd
+  if (addr == MAP_FAILED) return false;
+  // 资源包通常不大，启动时就读入页缓存，第一批请求不会因为缺页变慢
+  madvise(addr, st.st_size, MADV_WILLNEED);
+  shared_ptr<Mapping> mapping = make_shared<Mapping>();
+  mapping->base = static_cast<char*>(addr);
+  mapping->size = st.st_size;
+
+  shared_ptr<Image> image = make_shared<Image>();
+  image->base = mapping->base;
+  image->size = mapping->size;
+  image->mapping = std::move(mapping);
+  if (!Build(image.get())) return false;  // image释放时解除映射
+  atomic_store(&image_, shared_ptr<const Image>(std::move(image)));
+  open_.store(true, memory_order_release);
+  return true;
+}
+
+bool AssetBundle::IsOpen() const {
+  return open_.load(memory_order_acquire);
+}
+
+FileCache::Status AssetBundle::Find(string_view path,
+                                    shared_ptr<const CachedFile>* file) const {
+  shared_ptr<const Image> image = atomic_load(&image_);
+  if (!image) return FileCache::NOT_FOUND;
+  const uint64_t hash = BundleHash(path);
+  const uint32_t mask = image->header->num_slots - 1;
+  // 线性探测，表至少有一半是空位，很快就会碰到空位
+  for (uint32_t i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+    const uint32_t slot = image->slots[i];
+    if (slot == 0) break;
+    if (image->entries[slot - 1].hash == hash &&
+        image->files[slot - 1]->path == path) {
+      *file = image->files[slot - 1];
+      return FileCache::FOUND;
+    }
+  }
+  return FileCache::NOT_FOUND;
+}
+
+size_t AssetBundle::get_num_entries() const {
+  shared_ptr<const Image> image = atomic_load(&image_);
+  return image ? image->files.size() : 0;
+}
+
+bool AssetBundle::Build(Image* image) {
+  // 文件可能被截断或者不是资源包，所有偏移都要先检查再使用
+  const BundleHeader* header =
+      reinterpret_cast<const BundleHeader*>(image->base);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion || header->file_size != image->size) {
+    return false;
+  }
+  const uint32_t num_slots = header->num_slots;
+  if (num_slots == 0 || (num_slots & (num_slots - 1)) != 0 ||
+      num_slots <= header->num_entries) {
+    return false;
+  }
+  if (header->entries_off % alignof(BundleEntry) != 0 ||
+      header->slots_off % alignof(uint32_t) != 0 ||
+      header->entries_off > image->size ||
+      (image->size - header->entries_off) / sizeof(BundleEntry) <
+          header->num_entries ||
+      header->slots_off > image->size ||
+      (image->size - header->slots_off) / sizeof(uint32_t) < num_slots) {
+    return false;
+  }
+  image->header = header;
+  image->entries =
+      reinterpret_cast<const BundleEntry*>(image->base + header->entries_off);
+  image->slots =
+      reinterpret_cast<const uint32_t*>(image->base + header->slots_off);
+  for (uint32_t i = 0; i < num_slots; ++i) {
+    if (image->slots[i] > header->num_entries) return false;
+  }
+
+  image->files.reserve(header->num_entries);
+  for (uint32_t i = 0; i < header->num_entries; ++i) {
+    const BundleEntry& entry = image->entries[i];
+    string_view path, data, gzip, br;
+    if (!Slice(*image, entry.path, &path) || !Slice(*image, entry.data, &data) ||
+        !Slice(*image, entry.gzip, &gzip) || !Slice(*image, entry.br, &br) ||
+        path.empty() || path[0] != '/') {
+      return false;
+    }
+    shared_ptr<CachedFile> file = MakeFile(*image, entry, data, "");
+    if (!file) return false;
+    if (!gzip.empty()) file->packed_gzip = MakeFile(*image, entry, gzip, "gzip");
+    if (!br.empty()) file->packed_br = MakeFile(*image, entry, br, "br");
+    image->files.push_back(std::move(file));
+  }
+  return true;
+}
+
+bool AssetBundle::Slice(const Image& image, const BundleRef& ref,
+                        string_view* out) {
+  if (ref.off > image.size || ref.len > image.size - ref.off) return false;
+  *out = string_view(image.base + ref.off, ref.len);
+  return true;
+}
+
+shared_ptr<CachedFile> AssetBundle::MakeFile(const Image& image,
+                                             const BundleEntry& entry,
+                                             string_view data,
+                                             const char* encoding) {
+  string_view path, content_type, etag, last_modified, cache_control;
+  if (!Slice(image, entry.path, &path) ||
+      !Slice(image, entry.content_type, &content_type) ||
+      !Slice(image, entry.etag, &etag) ||
+      !Slice(image, entry.last_modified, &last_modified) ||
+      !Slice(image, entry.cache_control, &cache_control) || etag.size() < 2) {
+    return nullptr;
+  }
+  shared_ptr<CachedFile> file = make_shared<CachedFile>();
+  // 内容直接指向映射，映射由owner保持，CachedFile释放时不解除映射
+  file->owner = image.mapping;
+  file->data = data.empty() ? nullptr : const_cast<char*>(data.data());
+  file->size = data.size();
+  file->path.assign(path);
+  // 没有真实的文件，只填写用到的字段。inode用下标，使各资源互不相同
+  file->st.st_mode = S_IFREG | 0444;
+  file->st.st_ino = &entry - image.entries + 1;
+  file->st.st_size = entry.data.len;
+  file->st.st_mtim.tv_sec = entry.mtime;
+  file->content_type.assign(content_type);
+  file->etag.assign(etag);
+  file->last_modified.assign(last_modified);
+  file->cache_control.assign(cache_control);
+  file->content_encoding = encoding;
+  if (encoding[0] != '\0') {
+    // 和EncodedCache中的规则一样，压缩版本的ETag加上编码区分
+    file->etag.insert(file->etag.size() - 1, string("-") + encoding);
+  }
+  file->packed = true;
+  return file;
+}
@@ -0,0 +1,123 @@
+// Packed asset bundle: all static resources in one memory-mapped file.
+// by zxg
+//
+#ifndef WEBSERVER_HTTP_ASSET_BUNDLE_H_
+#define WEBSERVER_HTTP_ASSET_BUNDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "file_cache.h"
+
+// 资源包的文件格式，由src/tools/pack_bundle.cpp生成。
+// 整数都是本机字节序，打包和运行要在同一类机器上：
+//   [BundleHeader][BundleEntry * num_entries][uint32_t * num_slots][字符串和内容]
+// slots是开放寻址的哈希表，值为entry下标+1，0表示空位
+struct BundleHeader {
+  char magic[8];         // "TWSPACK1"
+  uint32_t version;
+  uint32_t num_entries;
+  uint32_t num_slots;    // 2的幂，至少是num_entries的两倍
+  uint32_t reserved;
+  uint64_t entries_off;
+  uint64_t slots_off;
+  uint64_t file_size;    // 整个文件的长度，用来检查文件是否完整
+};
+
+// 包内的一段数据，len为0表示没有
+struct BundleRef {
+  uint64_t off;
+  uint64_t len;
+};
+
+// 一个资源，响应头要用到的字段都在打包时生成好
+struct BundleEntry {
+  uint64_t hash;           // 路径的BundleHash
+  int64_t mtime;           // 源文件的修改时间
+  BundleRef path;          // URL路径，eg: /css/style.css
+  BundleRef data;          // 原始内容
+  BundleRef gzip;          // gzip压缩的内容(.gz文件或者打包时压缩)
+  BundleRef br;            // 打包时找到的.br文件
+  BundleRef content_type;
+  BundleRef etag;          // 按内容计算的强ETag，换机器部署也不会变
+  BundleRef last_modified;
+  BundleRef cache_control;
+};
+
+// FNV-1a，打包和查找使用同一个哈希函数
+inline uint64_t BundleHash(std::string_view str) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// 运行时的资源包。启动时映射整个文件，每个资源对应一个CachedFile，
+// 内容直接指向映射，不占用fd。查找只是在只读的哈希表中探测几次。
+// 部署时用rename替换文件，FileWatcher收到通知后重新Open，正在发送的响应
+// 仍持有旧的映射。错误页面在启动时读入，不随资源包更新
+class AssetBundle {
+ public:
+  static constexpr char kMagic[8] = {'T', 'W', 'S', 'P', 'A', 'C', 'K', '1'};
+  static const uint32_t kVersion = 1;
+
+  static AssetBundle* Instance();  // 单例模式
+  AssetBundle(const AssetBundle&) = delete;
+  AssetBundle& operator=(const AssetBundle&) = delete;
+
+  // 映射资源包，成功后替换当前的资源包。失败时返回false，原来的资源包不变
+  bool Open(const std::string& path);
+  // 是否在使用资源包
+  bool IsOpen() const;
+  // 按URL路径查找资源，FOUND时file指向资源
+  FileCache::Status Find(std::string_view path,
+                         std::shared_ptr<const CachedFile>* file) const;
+  // 资源数，没有资源包时为0
+  size_t get_num_entries() const;
+
+ private:
+  // 资源包文件的映射，由各个资源共同持有，最后一个引用释放时解除映射
+  struct Mapping {
+    ~Mapping();
+    char* base = nullptr;
+    size_t size = 0;
+  };
+
+  // 一次打开的资源包和从中生成的资源
+  struct Image {
+    std::shared_ptr<const Mapping> mapping;
+    const char* base = nullptr;
+    size_t size = 0;
+    const BundleHeader* header = nullptr;
+    const BundleEntry* entries = nullptr;
+    const uint32_t* slots = nullptr;
+    std::vector<std::shared_ptr<const CachedFile>> files;
+  };
+
+  AssetBundle() = default;
+  ~AssetBundle() = default;
+
+  // 检查格式并生成资源
+  static bool Build(Image* image);
+  // 包内的一段数据，越界时返回false
+  static bool Slice(const Image& image, const BundleRef& ref,
+                    std::string_view* out);
+  // 为一个资源(或它的压缩版本)生成CachedFile
+  static std::shared_ptr<CachedFile> MakeFile(const Image& image,
+                                              const BundleEntry& entry,
+                                              std::string_view data,
+                                              const char* encoding);
+
+  std::shared_ptr<const Image> image_;  // 用atomic_load/atomic_store访问
+  std::atomic<bool> open_{false};       // 每个请求都要判断，不用取image_
+};
+
+#endif  // WEBSERVER_HTTP_ASSET_BUNDLE_H_
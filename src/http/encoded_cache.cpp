@@ -0,0 +1,248 @@
+// by zxg
+//
+#include "encoded_cache.h"
+
+#include <unistd.h>  // pread()
+#include <string.h>  // memcpy()
+#include <zlib.h>
+
+#include "../log/log.h"
+#include "../pool/threadpool.h"
+
+using namespace std;
+
+EncodedCache::EncodedCache()
+    : budget_(0), used_(0), compressed_(0), invalidations_(0),
+      pool_(nullptr) {}
+
+EncodedCache* EncodedCache::Instance() {
+  static EncodedCache cache;
+  return &cache;
+}
+
+void EncodedCache::Init(size_t budget) {
+  lock_guard<mutex> locker(mtx_);
+  budget_ = budget;
+}
+
+void EncodedCache::SetPool(Threadpool* pool) {
+  lock_guard<mutex> locker(mtx_);
+  pool_ = pool;
+}
+
+bool EncodedCache::Get(const shared_ptr<const CachedFile>& file, int accept,
+                       shared_ptr<const CachedFile>* variant) {
+  variant->reset();
+  if (file->packed) {
+    if ((accept & ENCODING_BR) && file->packed_br) {
+      *variant = file->packed_br;
+    } else if ((accept & ENCODING_GZIP) && file->packed_gzip) {
+      *variant = file->packed_gzip;
+    }
+    return file->packed_br || file->packed_gzip;
+  }
+  if (budget_ == 0 || file->size == 0) return false;
+  const FileId id = MakeId(*file);
+  shared_ptr<const CachedFile> br, gzip;
+  unique_lock<mutex> locker(mtx_);
+  auto it = entries_.find(id);
+  if (it == entries_.end()) {
+    // 第一次请求这个文件，放一个占位项，查找和压缩都交给线程池，
+    // 这次先发送原文件
+    entries_[id].building = true;
+    const unsigned long long invalidations = invalidations_;
+    Threadpool* pool = pool_;
+    locker.unlock();
+    if (pool) {
+      pool->AddTask([this, file, invalidations] {
+        BuildAndInsert(file, invalidations);
+      });
+    } else {
+      BuildAndInsert(file, invalidations);
+    }
+    return true;
+  }
+  // 正在生成时不知道会有哪些版本，Vary总是可以带上的
+  if (it->second.building) return true;
+  lru_.splice(lru_.begin(), lru_, it->second.lru);  // 移到最前面
+  br = it->second.br;
+  gzip = it->second.gzip;
+  locker.unlock();
+  // 两种都可以接受时br压缩率更高
+  if ((accept & ENCODING_BR) && br) {
+    *variant = br;
+  } else if ((accept & ENCODING_GZIP) && gzip) {
+    *variant = gzip;
+  }
+  return br || gzip;
+}
+
+void EncodedCache::Invalidate(const string& path) {
+  lock_guard<mutex> locker(mtx_);
+  EraseByPath(path, false);
+}
+
+void EncodedCache::InvalidateDir(const string& dir) {
+  lock_guard<mutex> locker(mtx_);
+  EraseByPath(dir, true);
+}
+
+void EncodedCache::Clear() {
+  lock_guard<mutex> locker(mtx_);
+  EraseByPath("", true);
+}
+
+size_t EncodedCache::get_num_entries() {
+  lock_guard<mutex> locker(mtx_);
+  return lru_.size();
+}
+
+size_t EncodedCache::get_used() {
+  lock_guard<mutex> locker(mtx_);
+  return used_;
+}
+
+EncodedCache::FileId EncodedCache::MakeId(const CachedFile& file) {
+  return {file.st.st_dev, file.st.st_ino, file.st.st_size,
+          static_cast<long long>(file.st.st_mtim.tv_sec) * 1000000000LL +
+              file.st.st_mtim.tv_nsec};
+}
+
+void EncodedCache::BuildAndInsert(const shared_ptr<const CachedFile>& file,
+                                  unsigned long long invalidations) {
+  const FileId id = MakeId(*file);
+  Entry entry;
+  Build(*file, &entry);
+  lock_guard<mutex> locker(mtx_);
+  entries_.erase(id);
+  // 生成期间有文件失效时，读到的可能是旧内容，不放入缓存
+  if (invalidations == invalidations_) Insert(id, entry);
+}
+
+void EncodedCache::Build(const CachedFile& file, Entry* entry) {
+  entry->path = file.path;
+  entry->br = LoadSibling(file, ".br");
+  entry->gzip = LoadSibling(file, ".gz");
+  if (!entry->gzip && FileCache::IsCompressible(file.content_type) &&
+      file.size >= MIN_COMPRESS_SIZE && file.size <= MAX_COMPRESS_SIZE) {
+    entry->gzip = Compress(file);
+    ++compressed_;
+  }
+  // 没有任何版本的文件也要记下来，下次不用再查找
+  entry->size = sizeof(Entry) + entry->path.size() +
+                (entry->br ? entry->br->size : 0) +
+                (entry->gzip ? entry->gzip->size : 0);
+}
+
+shared_ptr<CachedFile> EncodedCache::LoadSibling(const CachedFile& file,
+                                                 const char* suffix) {
+  shared_ptr<CachedFile> sibling;
+  if (FileCache::Instance()->Load(file.path + suffix, &sibling) !=
+      FileCache::FOUND) {
+    return nullptr;
+  }
+  // 原文件改过而压缩文件没有重新生成，内容已经不一致
+  if (sibling->size == 0 ||
+      sibling->st.st_mtim.tv_sec < file.st.st_mtim.tv_sec) {
+    return nullptr;
+  }
+  SetVariantInfo(file, suffix[1] == 'b' ? "br" : "gzip", sibling.get());
+  return sibling;
+}
+
+shared_ptr<CachedFile> EncodedCache::Compress(const CachedFile& file) {
+  // sendfile模式的文件没有映射，先读到内存中
+  unique_ptr<char[]> content;
+  const char* in = file.data;
+  if (in == nullptr) {
+    content.reset(new char[file.size]);
+    size_t done = 0;
+    while (done < file.size) {
+      ssize_t len =
+          pread(file.fd, content.get() + done, file.size - done, done);
+      if (len <= 0) return nullptr;
+      done += len;
+    }
+    in = content.get();
+  }
+
+  z_stream zs = {};
+  // windowBits加16输出gzip格式；只压缩一次，用最高压缩级别
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return nullptr;
+  }
+  const size_t bound = deflateBound(&zs, file.size);
+  unique_ptr<char[]> out(new char[bound]);
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+  zs.avail_in = file.size;
+  zs.next_out = reinterpret_cast<Bytef*>(out.get());
+  zs.avail_out = bound;
+  int ret = deflate(&zs, Z_FINISH);
+  const size_t out_len = zs.total_out;
+  deflateEnd(&zs);
+  if (ret != Z_STREAM_END || out_len >= file.size) return nullptr;
+
+  shared_ptr<CachedFile> compressed = make_shared<CachedFile>();
+  // 按实际长度保存，缓存占用的内存和统计的一致
+  compressed->buffer.reset(new char[out_len]);
+  memcpy(compressed->buffer.get(), out.get(), out_len);
+  compressed->data = compressed->buffer.get();
+  compressed->size = out_len;
+  compressed->path = file.path;
+  compressed->st = file.st;
+  SetVariantInfo(file, "gzip", compressed.get());
+  LOG_DEBUG("Compressed %s: %zu -> %zu", file.path.c_str(), file.size,
+            out_len);
+  return compressed;
+}
+
+void EncodedCache::SetVariantInfo(const CachedFile& file, const char* encoding,
+                                  CachedFile* variant) {
+  // 验证和Range都按原文件的身份进行，修改时间也用原文件的
+  variant->st = file.st;
+  variant->content_type = file.content_type;
+  variant->content_encoding = encoding;
+  variant->etag = file.etag;
+  variant->etag.insert(variant->etag.size() - 1, string("-") + encoding);
+  variant->last_modified = file.last_modified;
+  variant->cache_control = file.cache_control;
+}
+
+void EncodedCache::EraseByPath(const string& path, bool prefix) {
+  // 文件变化很少发生，直接遍历所有缓存项
+  ++invalidations_;
+  for (auto it = entries_.begin(); it != entries_.end(); ) {
+    auto next = std::next(it);
+    const string& entry_path = it->second.path;
+    if (!it->second.building &&
+        (prefix ? entry_path.compare(0, path.size(), path) == 0
+                : entry_path == path)) {
+      Erase(it);
+    }
+    it = next;
+  }
+}
+
+void EncodedCache::Insert(const FileId& id, const Entry& entry) {
+  Entry& inserted = entries_[id];
+  if (entry.size > budget_) {
+    // 比整个缓存还大，压缩版本只给这一次请求使用。记下这个文件没有可用的
+    // 版本，之后的请求直接发送原文件，不用每次都重新压缩
+    inserted.path = entry.path;
+    inserted.size = sizeof(Entry) + entry.path.size();
+  } else {
+    inserted = entry;
+  }
+  lru_.push_front(id);
+  inserted.lru = lru_.begin();
+  used_ += inserted.size;
+  while (used_ > budget_) Erase(entries_.find(lru_.back()));
+}
+
+void EncodedCache::Erase(
+    unordered_map<FileId, Entry, FileIdHash>::iterator it) {
+  used_ -= it->second.size;
+  lru_.erase(it->second.lru);
+  entries_.erase(it);
+}
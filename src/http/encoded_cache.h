@@ -0,0 +1,130 @@
+// Cache of precompressed and on-the-fly compressed file variants.
+// by zxg
+//
+#ifndef WEBSERVER_HTTP_ENCODED_CACHE_H_
+#define WEBSERVER_HTTP_ENCODED_CACHE_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "file_cache.h"
+
+class Threadpool;
+
+// 客户端可以接受的内容编码，按位组合
+enum ContentEncoding {
+  ENCODING_GZIP = 1 << 0,
+  ENCODING_BR = 1 << 1,
+};
+
+// 文件压缩版本的缓存，以文件的身份(设备号、inode、长度、修改时间)为键，
+// 文件被修改后键随之改变，旧的版本按LRU淘汰。
+// 每个文件第一次被请求时确定一次它有哪些版本：优先使用同目录下的.br/.gz文件，
+// 没有.gz文件时对可压缩的类型用zlib压缩一次。查找和压缩交给线程池在后台
+// 进行，完成前的请求(包括第一个)直接发送原文件，不会在事件循环线程上等待。
+// 之后的请求只查一次哈希表，不会再压缩或者查找文件。
+// 资源包中的文件在打包时已经压缩好，不经过缓存
+class EncodedCache {
+ public:
+  static EncodedCache* Instance();  // 单例模式
+  EncodedCache(const EncodedCache&) = delete;
+  EncodedCache& operator=(const EncodedCache&) = delete;
+
+  // 设置缓存的总大小上限，0表示不提供压缩版本
+  void Init(size_t budget);
+  // 设置生成压缩版本的线程池，线程池销毁前要设回nullptr。
+  // 没有线程池时由第一个未命中的请求在自己的线程上生成
+  void SetPool(Threadpool* pool);
+  // 为file选择客户端可以接受(accept为ContentEncoding的组合)的压缩版本，
+  // 没有合适的版本或者压缩版本还在生成时variant为空。
+  // 返回这个文件是否有(或者可能有)压缩版本，有时响应要带上
+  // Vary: Accept-Encoding
+  bool Get(const std::shared_ptr<const CachedFile>& file, int accept,
+           std::shared_ptr<const CachedFile>* variant);
+  // 由FileWatcher在文件变化后调用。原文件为path或者在dir(以'/'结尾)下的
+  // 缓存项失效，新增或修改了.gz/.br文件时下次请求会重新确定压缩版本
+  void Invalidate(const std::string& path);
+  void InvalidateDir(const std::string& dir);
+  void Clear();
+
+  // 统计信息，用于日志
+  size_t get_num_entries();
+  size_t get_used();
+  inline size_t get_budget() const { return budget_; }
+  inline unsigned long long get_compressed() const { return compressed_; }
+
+  static const size_t MIN_COMPRESS_SIZE = 256;      // 太小的文件压缩没有意义
+  static const size_t MAX_COMPRESS_SIZE = 8 << 20;  // 太大的文件压缩太久
+
+ private:
+  // 文件的身份，内容变化时至少有一项会改变
+  struct FileId {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    long long mtime_ns;
+    bool operator==(const FileId& other) const {
+      return dev == other.dev && ino == other.ino && size == other.size &&
+             mtime_ns == other.mtime_ns;
+    }
+  };
+  struct FileIdHash {
+    size_t operator()(const FileId& id) const {
+      return std::hash<long long>()(id.mtime_ns) ^
+             (std::hash<ino_t>()(id.ino) << 1) ^ id.dev;
+    }
+  };
+
+  // 一个文件的所有压缩版本，没有对应版本时为空
+  struct Entry {
+    std::string path;                 // 原文件的完整路径
+    std::shared_ptr<const CachedFile> br;
+    std::shared_ptr<const CachedFile> gzip;
+    size_t size;                      // 计入上限的大小
+    std::list<FileId>::iterator lru;  // 在lru_中的位置
+    // 占位项，压缩版本正在生成。占位项不在lru_中，失效时也不删除，
+    // 只由生成它的任务删除
+    bool building = false;
+  };
+
+  EncodedCache();
+  ~EncodedCache() = default;
+
+  static FileId MakeId(const CachedFile& file);
+  // 生成file的压缩版本并放入缓存，invalidations是放占位项时的失效次数
+  void BuildAndInsert(const std::shared_ptr<const CachedFile>& file,
+                      unsigned long long invalidations);
+  // 确定文件的各个压缩版本，不需要持有锁
+  void Build(const CachedFile& file, Entry* entry);
+  // 加载同目录下的压缩文件，eg: style.css.gz，比原文件旧时不使用
+  static std::shared_ptr<CachedFile> LoadSibling(const CachedFile& file,
+                                                 const char* suffix);
+  // 用zlib压缩为gzip格式，压缩后没有变小时返回空
+  static std::shared_ptr<CachedFile> Compress(const CachedFile& file);
+  // 压缩版本沿用原文件的类型和缓存策略，ETag加上编码区分
+  static void SetVariantInfo(const CachedFile& file, const char* encoding,
+                             CachedFile* variant);
+  // 以下函数要求持有mtx_
+  // 删除原文件为path的缓存项，prefix为true时删除path开头的所有缓存项
+  void EraseByPath(const std::string& path, bool prefix);
+  // 放入新生成的缓存项，生成期间的占位项保证了id不在缓存中
+  void Insert(const FileId& id, const Entry& entry);
+  void Erase(std::unordered_map<FileId, Entry, FileIdHash>::iterator it);
+
+  size_t budget_;
+  size_t used_;  // 所有压缩版本的总大小
+  std::atomic<unsigned long long> compressed_;  // 用zlib压缩过的文件数
+  unsigned long long invalidations_;  // 失效的次数，用法和FileCache的一样
+  std::unordered_map<FileId, Entry, FileIdHash> entries_;
+  std::list<FileId> lru_;  // 最近使用的在前
+  Threadpool* pool_;  // 生成压缩版本的线程池
+  std::mutex mtx_;
+};
+
+#endif  // WEBSERVER_HTTP_ENCODED_CACHE_H_
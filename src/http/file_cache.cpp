@@ -0,0 +1,353 @@
+// by zxg
+//
+#include "file_cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <stdio.h>  // snprintf()
+#include <time.h>
+
+using namespace std;
+
+namespace {
+
+// 当前线程遇到正在加载的文件时是否可以等待，事件循环线程上为false
+thread_local bool may_wait = true;
+
+}  // namespace
+
+const unordered_map<string, string> FileCache::suffix_type_ = {
+    { ".html",  "text/html" },
+    { ".xml",   "text/xml" },
+    { ".xhtml", "application/xhtml+xml" },
+    { ".txt",   "text/plain" },
+    { ".rtf",   "application/rtf" },
+    { ".pdf",   "application/pdf" },
+    { ".word",  "application/nsword" },
+    { ".png",   "image/png" },
+    { ".gif",   "image/gif" },
+    { ".jpg",   "image/jpeg" },
+    { ".jpeg",  "image/jpeg" },
+    { ".au",    "audio/basic" },
+    { ".mpeg",  "video/mpeg" },
+    { ".mpg",   "video/mpeg" },
+    { ".avi",   "video/x-msvideo" },
+    { ".mp4",   "video/mp4" },
+    { ".webm",  "video/webm" },
+    { ".mp3",   "audio/mpeg" },
+    { ".gz",    "application/x-gzip" },
+    { ".tar",   "application/x-tar" },
+    { ".css",   "text/css" },
+    { ".js",    "text/javascript" },
+    { ".svg",   "image/svg+xml" },
+    { ".ico",   "image/x-icon" },
+    { ".woff",  "font/woff" },
+    { ".woff2", "font/woff2" },
+    { ".ttf",   "font/ttf" },
+    { ".otf",   "font/otf" },
+    { ".eot",   "application/vnd.ms-fontobject" },
+};
+
+// 页面每次都验证，改了马上生效；样式和脚本缓存一天；
+// 图片、字体和音视频基本不会改，缓存一周。过期后用ETag验证，没变只回304
+const unordered_map<string, int> FileCache::suffix_max_age_ = {
+    { ".html",  0 },
+    { ".xhtml", 0 },
+    { ".css",   86400 },
+    { ".js",    86400 },
+    { ".png",   604800 },
+    { ".gif",   604800 },
+    { ".jpg",   604800 },
+    { ".jpeg",  604800 },
+    { ".svg",   604800 },
+    { ".ico",   604800 },
+    { ".woff",  604800 },
+    { ".woff2", 604800 },
+    { ".ttf",   604800 },
+    { ".otf",   604800 },
+    { ".eot",   604800 },
+    { ".mp4",   604800 },
+    { ".webm",  604800 },
+    { ".mp3",   604800 },
+};
+
+CachedFile::~CachedFile() {
+  // 最后一个引用释放时才解除映射、关闭文件。buffer和owner中的内容会自动释放
+  if (data && !buffer && !owner) munmap(data, size);
+  for (auto& header : headers) delete header.load();
+  if (fd >= 0) close(fd);
+}
+
+FileCache::FileCache()
+    : budget_(0), collapse_misses_(false), sendfile_min_(SIZE_MAX), used_(0),
+      hits_(0), misses_(0), evictions_(0), watched_(false),
+      invalidations_(0) {}
+
+FileCache* FileCache::Instance() {
+  static FileCache cache;
+  return &cache;
+}
+
+void FileCache::Init(const FileCacheOptions& options) {
+  lock_guard<mutex> locker(mtx_);
+  budget_ = options.budget;
+  collapse_misses_ = options.collapse_misses;
+  sendfile_min_ = options.sendfile_min;
+}
+
+FileCache::Status FileCache::Get(const string& path,
+                                 shared_ptr<const CachedFile>* file) {
+  if (budget_ == 0) {  // 不缓存，每次都重新加载
+    ++misses_;
+    shared_ptr<CachedFile> loaded;
+    Status status = Load(path, &loaded);
+    *file = std::move(loaded);
+    return status;
+  }
+  unique_lock<mutex> locker(mtx_);
+  auto it = entries_.find(path);
+  while (it != entries_.end()) {
+    Entry& entry = it->second;
+    if (entry.loading) {
+      // 其他线程正在加载这个文件。不能等待的线程自己再加载一份
+      if (!may_wait) break;
+      // 等它加载完再查一次
+      loaded_.wait(locker);
+      it = entries_.find(path);
+      continue;
+    }
+    if (!watched_) {
+      // 没有inotify通知，距离上次检查超过有效期就stat一次。
+      // stat在锁外进行，先更新检查时间，其他线程在这期间不再重复检查
+      Clock::time_point now = Clock::now();
+      if (now - entry.checked >= chrono::milliseconds(VALIDATE_INTERVAL_MS)) {
+        entry.checked = now;
+        shared_ptr<const CachedFile> cached = entry.file;
+        locker.unlock();
+        const bool fresh = IsFresh(*cached);
+        locker.lock();
+        // 解锁期间缓存项可能已经被替换或删除，重新查找
+        it = entries_.find(path);
+        if (!fresh && it != entries_.end() && it->second.file == cached) {
+          Erase(it);  // 文件被修改过，重新加载
+          it = entries_.end();
+        }
+        continue;
+      }
+    }
+    lru_.splice(lru_.begin(), lru_, entry.lru);  // 移到最前面
+    ++hits_;
+    *file = entry.file;
+    return FOUND;
+  }
+
+  ++misses_;
+  // 找到的是别人的占位项时不再放占位项，加载的结果由Insert决定是否放入
+  const bool placeholder = collapse_misses_ && it == entries_.end();
+  if (placeholder) {
+    // 放一个占位项，之后未命中的线程会等这次加载的结果
+    Entry& entry = entries_[path];
+    entry.lru = lru_.end();
+    entry.loading = true;
+  }
+  const unsigned long long invalidations = invalidations_;
+  locker.unlock();
+  shared_ptr<CachedFile> loaded;
+  Status status = Load(path, &loaded);
+  locker.lock();
+  if (placeholder) {
+    it = entries_.find(path);
+    if (it != entries_.end() && it->second.loading) entries_.erase(it);
+  }
+  // 比整个缓存还大的文件不缓存，只给这一次请求使用。
+  // 加载期间有文件失效时，读到的可能是旧内容或者写了一半的内容，也不缓存
+  if (status == FOUND && loaded->size <= budget_ &&
+      invalidations == invalidations_) {
+    Insert(path, loaded);
+  }
+  if (placeholder) loaded_.notify_all();
+  *file = std::move(loaded);
+  return status;
+}
+
+void FileCache::SetMayWait(bool wait) { may_wait = wait; }
+
+void FileCache::Clear() {
+  lock_guard<mutex> locker(mtx_);
+  ++invalidations_;
+  for (auto it = entries_.begin(); it != entries_.end(); ) {
+    auto next = std::next(it);
+    if (!it->second.loading) Erase(it);
+    it = next;
+  }
+}
+
+void FileCache::Invalidate(const string& path) {
+  lock_guard<mutex> locker(mtx_);
+  ++invalidations_;
+  auto it = entries_.find(path);
+  if (it != entries_.end() && !it->second.loading) Erase(it);
+}
+
+void FileCache::InvalidateDir(const string& dir) {
+  lock_guard<mutex> locker(mtx_);
+  ++invalidations_;
+  for (auto it = entries_.begin(); it != entries_.end(); ) {
+    auto next = std::next(it);
+    if (!it->second.loading && it->first.compare(0, dir.size(), dir) == 0) {
+      Erase(it);
+    }
+    it = next;
+  }
+}
+
+const char* FileCache::ContentType(const string& path) {
+  string::size_type dot = path.find_last_of('.');
+  string::size_type slash = path.find_last_of('/');
+  // 没有后缀名(点在目录名中也不算)
+  if (dot == string::npos || (slash != string::npos && dot < slash)) {
+    return "text/plain";
+  }
+  auto it = suffix_type_.find(path.substr(dot));  // ".xxx"
+  if (it == suffix_type_.end()) return "text/plain";  // 后缀名不是已知的类型
+  return it->second.c_str();
+}
+
+string FileCache::CacheControl(const string& path) {
+  string::size_type dot = path.find_last_of('.');
+  string::size_type slash = path.find_last_of('/');
+  if (dot == string::npos || (slash != string::npos && dot < slash)) {
+    return "";
+  }
+  auto it = suffix_max_age_.find(path.substr(dot));
+  if (it == suffix_max_age_.end()) return "";
+  if (it->second == 0) return "no-cache";
+  return "max-age=" + to_string(it->second);
+}
+
+string FileCache::HttpDate(time_t t) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char buf[32];
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buf;
+}
+
+bool FileCache::IsCompressible(const string& type) {
+  return type.compare(0, 5, "text/") == 0 ||
+         type == "application/javascript" || type == "application/json" ||
+         type == "application/xml" || type == "application/xhtml+xml" ||
+         type == "application/rtf" || type == "image/svg+xml" ||
+         type == "font/ttf" || type == "font/otf" ||
+         type == "application/vnd.ms-fontobject";
+}
+
+size_t FileCache::get_num_entries() {
+  lock_guard<mutex> locker(mtx_);
+  return lru_.size();
+}
+
+size_t FileCache::get_used() {
+  lock_guard<mutex> locker(mtx_);
+  return used_;
+}
+
+FileCache::Status FileCache::Load(const string& path,
+                                  shared_ptr<CachedFile>* file) const {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == EACCES) return FORBIDDEN;
+    if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG ||
+        errno == ELOOP) {
+      return NOT_FOUND;
+    }
+    return LOAD_FAILED;
+  }
+  shared_ptr<CachedFile> loaded = make_shared<CachedFile>();
+  // 只提供普通文件，目录等一律当作不存在
+  if (fstat(fd, &loaded->st) < 0) {
+    close(fd);
+    return LOAD_FAILED;
+  }
+  if (!S_ISREG(loaded->st.st_mode)) {
+    close(fd);
+    return NOT_FOUND;
+  }
+  if (!(loaded->st.st_mode & S_IROTH)) {  // IR: 读权限, OTH: 其他用户
+    close(fd);
+    return FORBIDDEN;
+  }
+  loaded->size = loaded->st.st_size;
+  if (loaded->size > 0 && loaded->size >= sendfile_min_) {
+    // 大文件保留fd，由内核直接从页缓存发送到socket，
+    // 工作线程不会因为访问映射产生缺页，文件被截断也不会SIGBUS
+    loaded->fd = fd;
+  } else {
+    if (loaded->size > 0) {  // 长度为0的文件不能mmap
+      void* addr = mmap(nullptr, loaded->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        return LOAD_FAILED;
+      }
+      loaded->data = static_cast<char*>(addr);
+    }
+    close(fd);  // 映射建立后就不再需要fd
+  }
+  loaded->path = path;
+  loaded->content_type = ContentType(path);
+  // 修改时间精确到纳秒，同一秒内的修改也会得到不同的ETag
+  const struct stat& st = loaded->st;
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%lx-%lx-%llx\"",
+           static_cast<unsigned long>(st.st_ino),
+           static_cast<unsigned long>(st.st_size),
+           static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ULL +
+               st.st_mtim.tv_nsec);
+  loaded->etag = etag;
+  loaded->last_modified = HttpDate(st.st_mtime);
+  loaded->cache_control = CacheControl(path);
+  *file = std::move(loaded);
+  return FOUND;
+}
+
+bool FileCache::IsFresh(const CachedFile& file) {
+  struct stat st;
+  if (stat(file.path.c_str(), &st) < 0) return false;
+  return st.st_ino == file.st.st_ino && st.st_dev == file.st.st_dev &&
+         st.st_size == file.st.st_size && st.st_mode == file.st.st_mode &&
+         st.st_mtim.tv_sec == file.st.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == file.st.st_mtim.tv_nsec;
+}
+
+void FileCache::Insert(const string& path,
+                       const shared_ptr<const CachedFile>& file) {
+  // 不合并未命中时，别的线程可能已经放入了同一个文件
+  auto it = entries_.find(path);
+  if (it != entries_.end()) {
+    if (it->second.loading) return;
+    Erase(it);
+  }
+  lru_.push_front(path);
+  Entry& entry = entries_[path];
+  entry.file = file;
+  entry.lru = lru_.begin();
+  entry.checked = Clock::now();
+  entry.loading = false;
+  used_ += file->size;
+  // 超过上限，从最久没有使用的开始淘汰。正在发送的响应持有引用，映射不会马上释放
+  while (used_ > budget_) {
+    Erase(entries_.find(lru_.back()));
+    ++evictions_;
+  }
+}
+
+void FileCache::Erase(unordered_map<string, Entry>::iterator it) {
+  Entry& entry = it->second;
+  if (entry.file) {
+    used_ -= entry.file->size;
+    lru_.erase(entry.lru);
+  }
+  entries_.erase(it);
+}
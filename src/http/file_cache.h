@@ -0,0 +1,176 @@
+// Shared cache of opened and mapped static files.
+// by zxg
+//
+#ifndef WEBSERVER_HTTP_FILE_CACHE_H_
+#define WEBSERVER_HTTP_FILE_CACHE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// 文件缓存的配置
+struct FileCacheOptions {
+  size_t budget = 64 << 20;     // 缓存的文件总大小上限，0表示不缓存
+  // 多个线程同时未命中同一文件时只加载一次，事件循环线程不等，自己加载
+  bool collapse_misses = true;
+  // 不小于这个长度的文件不做映射，只保留打开的fd，由连接用sendfile发送。
+  // 默认SIZE_MAX，所有文件都映射后用writev发送
+  size_t sendfile_min = SIZE_MAX;
+  // 压缩版本(.gz/.br文件或者用zlib压缩的结果)缓存的总大小上限，0表示不压缩
+  size_t encoded_budget = 16 << 20;
+  // 资源包文件(由bin/pack_bundle生成)，不为空时从资源包而不是资源目录提供文件
+  std::string bundle_path;
+  // 用inotify监视资源目录，命中时不再stat检查文件。关闭或inotify不可用时
+  // 退回按VALIDATE_INTERVAL_MS定期检查
+  bool watch = true;
+};
+
+// 预先序列化好的一组响应头，发送前只需要把Date的值改成当前时间
+struct SerializedHeader {
+  std::string text;
+  size_t date_pos;  // Date的值在text中的位置
+};
+
+// 缓存中的一个文件，内容为只读的内存映射，或者一个打开的fd(sendfile模式)。
+// 通过shared_ptr共享，被淘汰后正在发送它的响应仍然可以继续使用
+struct CachedFile {
+  CachedFile() : data(nullptr), fd(-1), size(0), st() {
+    for (auto& header : headers) header.store(nullptr);
+  }
+  ~CachedFile();
+  CachedFile(const CachedFile&) = delete;
+  CachedFile& operator=(const CachedFile&) = delete;
+
+  std::string path;          // 完整路径
+  // 内容，指向文件的映射或者buffer，空文件或sendfile模式为nullptr
+  char* data;
+  std::unique_ptr<char[]> buffer;  // 在内存中生成的内容(压缩结果)，没有时为空
+  std::shared_ptr<const void> owner;  // data属于别的对象(资源包的映射)时持有它
+  int fd;                    // sendfile模式下打开的文件，否则为-1
+  size_t size;               // 文件长度
+  struct stat st;            // 加载时的文件信息(inode, mtime等)
+  std::string content_type;  // 根据后缀名确定的Content-Type
+  // 以下响应头的值在加载时生成一次，每个请求直接使用
+  std::string etag;           // 强ETag，由inode、长度和修改时间生成
+  std::string last_modified;  // 修改时间，HTTP日期格式
+  std::string cache_control;  // 根据后缀名确定的缓存策略，没有时为空
+  // 内容编码(gzip, br)，原始文件为空
+  std::string content_encoding;
+  // 来自资源包时为true，压缩版本也已打包好，EncodedCache直接使用下面两个
+  bool packed = false;
+  std::shared_ptr<const CachedFile> packed_gzip;
+  std::shared_ptr<const CachedFile> packed_br;
+  // 这个文件的200/304响应头，由HttpResponse在第一次用到时生成，之后只读。
+  // 下标由状态码、是否长连接、是否有Vary组合而成，见HttpResponse::HeaderSlot
+  static const int NUM_HEADER_SLOTS = 8;
+  mutable std::atomic<const SerializedHeader*> headers[NUM_HEADER_SLOTS];
+};
+
+// 静态文件缓存，以完整路径为键，所有线程共享。
+// 原来每个请求都要stat+open+mmap+munmap，同一批文件被反复映射和解除映射，
+// 现在命中时只需要查一次哈希表。超过内存上限时按LRU淘汰
+class FileCache {
+ public:
+  // 查找结果
+  enum Status {
+    FOUND,      // 文件存在且可读
+    NOT_FOUND,  // 文件不存在或是目录
+    FORBIDDEN,  // 没有读权限
+    LOAD_FAILED,  // 打开或映射失败(fd用完、内存不足等)
+  };
+
+  static FileCache* Instance();  // 单例模式
+  FileCache(const FileCache&) = delete;
+  FileCache& operator=(const FileCache&) = delete;
+
+  void Init(const FileCacheOptions& options);
+  // 取得文件，FOUND时file指向文件内容
+  Status Get(const std::string& path, std::shared_ptr<const CachedFile>* file);
+  // 清空缓存
+  void Clear();
+  // 由FileWatcher在文件变化后调用，让path或者dir(以'/'结尾)下的所有缓存项失效。
+  // 正在加载的文件加载完成后也不会放入缓存
+  void Invalidate(const std::string& path);
+  void InvalidateDir(const std::string& dir);
+  // 设置当前线程在其他线程正在加载同一个文件时是否等它的结果。
+  // 事件循环线程设为false，不在条件变量上休眠，自己再加载一份
+  static void SetMayWait(bool wait);
+  // 文件的变化由FileWatcher通知，命中时不再检查文件
+  inline void SetWatched(bool watched) { watched_ = watched; }
+  inline bool IsWatched() const { return watched_; }
+  // 打开并映射文件，不经过缓存，不需要持有锁
+  Status Load(const std::string& path, std::shared_ptr<CachedFile>* file) const;
+  // 根据后缀名确定Content-Type，未知类型为text/plain
+  static const char* ContentType(const std::string& path);
+  // 根据后缀名确定Cache-Control，没有对应策略时返回空串
+  static std::string CacheControl(const std::string& path);
+  // 把时间格式化为HTTP日期，eg: Sun, 06 Nov 1994 08:49:37 GMT
+  static std::string HttpDate(time_t t);
+  // 这种类型的内容是否值得压缩，图片、woff字体等已经是压缩格式
+  static bool IsCompressible(const std::string& content_type);
+
+  // 统计信息，用于日志
+  size_t get_num_entries();
+  size_t get_used();
+  inline size_t get_budget() const { return budget_; }
+  inline unsigned long long get_hits() const { return hits_; }
+  inline unsigned long long get_misses() const { return misses_; }
+  inline unsigned long long get_evictions() const { return evictions_; }
+  inline unsigned long long get_invalidations() const {
+    return invalidations_;
+  }
+
+  // 没有FileWatcher时缓存项的有效期，过期后stat一次检查文件有没有被修改
+  static constexpr int VALIDATE_INTERVAL_MS = 1000;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Entry {
+    std::shared_ptr<const CachedFile> file;  // 正在加载时为空
+    std::list<std::string>::iterator lru;    // 在lru_中的位置
+    Clock::time_point checked;               // 上一次stat确认文件没有变化的时间
+    bool loading;                            // 是否有线程正在加载
+  };
+
+  FileCache();
+  ~FileCache() = default;
+
+  // 文件和缓存时相比是否没有变化
+  static bool IsFresh(const CachedFile& file);
+  // 以下函数要求持有mtx_
+  void Insert(const std::string& path,
+              const std::shared_ptr<const CachedFile>& file);
+  void Erase(std::unordered_map<std::string, Entry>::iterator it);
+
+  size_t budget_;
+  bool collapse_misses_;
+  size_t sendfile_min_;
+  size_t used_;  // 缓存的文件总大小
+  std::atomic<unsigned long long> hits_;
+  std::atomic<unsigned long long> misses_;
+  std::atomic<unsigned long long> evictions_;
+  std::atomic<bool> watched_;
+  // 失效的次数，加载前后不一致说明加载期间文件可能变了，结果不放入缓存
+  std::atomic<unsigned long long> invalidations_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::list<std::string> lru_;  // 已加载的文件，最近使用的在前
+  std::mutex mtx_;
+  std::condition_variable loaded_;  // 有文件加载完成
+  // 不同文件后缀对应的返回类型
+  static const std::unordered_map<std::string, std::string> suffix_type_;
+  // 不同文件后缀允许浏览器缓存的秒数，0表示每次使用前都要验证
+  static const std::unordered_map<std::string, int> suffix_max_age_;
+};
+
+#endif  // WEBSERVER_HTTP_FILE_CACHE_H_
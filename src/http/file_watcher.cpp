@@ -0,0 +1,171 @@
+// by zxg
+//
+#include "file_watcher.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>  // strerror()
+#include <sys/stat.h>
+#include <unistd.h>  // read(), close()
+
+#include "../log/log.h"
+#include "asset_bundle.h"
+#include "encoded_cache.h"
+#include "file_cache.h"
+
+using namespace std;
+
+FileWatcher::FileWatcher() : fd_(-1), num_events_(0) {}
+
+FileWatcher::~FileWatcher() {
+  if (fd_ >= 0) close(fd_);
+}
+
+bool FileWatcher::Init(const string& root) {
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0) return false;
+  if (!AddWatch(root)) {
+    close(fd_);
+    fd_ = -1;
+    dirs_.clear();
+    return false;
+  }
+  return true;
+}
+
+bool FileWatcher::InitBundle(const string& bundle_path) {
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0) return false;
+  // 监视目录而不是文件本身，rename替换后文件的inode变了，对文件的监视会失效
+  const size_t slash = bundle_path.find_last_of('/');
+  const string dir =
+      slash == string::npos ? "./" : bundle_path.substr(0, slash + 1);
+  int wd = inotify_add_watch(fd_, dir.c_str(),
+                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+  if (wd < 0) {
+    LOG_WARN("inotify_add_watch %s: %s", dir.c_str(), strerror(errno));
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  dirs_[wd] = dir;
+  bundle_path_ = bundle_path;
+  bundle_name_ = bundle_path.substr(slash == string::npos ? 0 : slash + 1);
+  return true;
+}
+
+void FileWatcher::HandleEvents() {
+  alignas(struct inotify_event) char buf[16384];
+  while (true) {
+    ssize_t len = read(fd_, buf, sizeof(buf));
+    if (len <= 0) break;  // EAGAIN: 已经读完
+    for (char* p = buf; p < buf + len;) {
+      const struct inotify_event* event =
+          reinterpret_cast<const struct inotify_event*>(p);
+      OnEvent(*event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+bool FileWatcher::AddWatch(const string& dir) {
+  int wd = inotify_add_watch(fd_, dir.c_str(), kMask | IN_ONLYDIR);
+  if (wd < 0) {
+    LOG_WARN("inotify_add_watch %s: %s", dir.c_str(), strerror(errno));
+    return false;
+  }
+  dirs_[wd] = dir;
+  // 先建立监视再列出子目录，之后新建的子目录会收到IN_CREATE，不会漏掉
+  DIR* handle = opendir(dir.c_str());
+  if (handle == nullptr) return true;
+  bool ok = true;
+  while (struct dirent* ent = readdir(handle)) {
+    const string name = ent->d_name;
+    if (name == "." || name == "..") continue;
+    bool is_dir = ent->d_type == DT_DIR;
+    if (ent->d_type == DT_UNKNOWN) {  // 有的文件系统不提供类型
+      struct stat st;
+      is_dir = lstat((dir + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    if (is_dir && !AddWatch(dir + name + "/")) {
+      ok = false;
+      break;
+    }
+  }
+  closedir(handle);
+  return ok;
+}
+
+void FileWatcher::RemoveWatch(const string& dir) {
+  for (auto it = dirs_.begin(); it != dirs_.end();) {
+    if (it->second.compare(0, dir.size(), dir) == 0) {
+      inotify_rm_watch(fd_, it->first);  // 之后到达的IN_IGNORED会被忽略
+      it = dirs_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void FileWatcher::OnEvent(const struct inotify_event& event) {
+  ++num_events_;
+  if (!bundle_path_.empty()) {
+    // 目录下其他文件的变化不用管，丢了事件时不知道资源包是否变了，也重新打开
+    if ((event.mask & IN_Q_OVERFLOW) ||
+        (event.len > 0 && bundle_name_ == event.name)) {
+      ReloadBundle();
+    }
+    return;
+  }
+  if (event.mask & IN_Q_OVERFLOW) {
+    // 队列溢出丢了事件，不知道哪些文件变了，全部重新加载
+    LOG_WARN("inotify queue overflow, clear file caches");
+    FileCache::Instance()->Clear();
+    EncodedCache::Instance()->Clear();
+    return;
+  }
+  auto it = dirs_.find(event.wd);
+  if (it == dirs_.end()) return;
+  if (event.mask & IN_IGNORED) {  // 目录已经被删除
+    dirs_.erase(it);
+    return;
+  }
+  // 目录自身的事件没有名字，它的变化在父目录的事件中处理
+  if (event.len == 0) return;
+  const string path = it->second + event.name;
+  if (event.mask & IN_ISDIR) {
+    // 整个目录被移走、删除或者被别的目录替换，下面的文件全部失效
+    const string dir = path + "/";
+    if (event.mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+      RemoveWatch(dir);
+      FileCache::Instance()->InvalidateDir(dir);
+      EncodedCache::Instance()->InvalidateDir(dir);
+    }
+    if (event.mask & (IN_CREATE | IN_MOVED_TO)) AddWatch(dir);
+    return;
+  }
+  Invalidate(path);
+}
+
+void FileWatcher::Invalidate(const string& path) {
+  FileCache::Instance()->Invalidate(path);
+  // style.css.gz变了，style.css的压缩版本要重新确定
+  const size_t dot = path.find_last_of('.');
+  if (dot != string::npos && (path.compare(dot, string::npos, ".gz") == 0 ||
+                              path.compare(dot, string::npos, ".br") == 0)) {
+    EncodedCache::Instance()->Invalidate(path.substr(0, dot));
+  } else {
+    EncodedCache::Instance()->Invalidate(path);
+  }
+}
+
+void FileWatcher::ReloadBundle() {
+  AssetBundle* bundle = AssetBundle::Instance();
+  if (bundle->Open(bundle_path_)) {
+    LOG_INFO("Reload bundle %s, %zu files", bundle_path_.c_str(),
+             bundle->get_num_entries());
+  } else {
+    LOG_ERROR("Reload bundle %s failed, keep the old one",
+              bundle_path_.c_str());
+  }
+}
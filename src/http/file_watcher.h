@@ -0,0 +1,59 @@
+// Watches the resource directory with inotify and invalidates cached files.
+// by zxg
+//
+#ifndef WEBSERVER_HTTP_FILE_WATCHER_H_
+#define WEBSERVER_HTTP_FILE_WATCHER_H_
+
+#include <sys/inotify.h>
+
+#include <string>
+#include <unordered_map>
+
+// 用inotify递归监视资源目录，文件被修改、移动或删除时只让受影响的缓存项失效。
+// 有了它文件缓存命中时不再需要stat检查文件，改动在下一轮事件循环就能生效。
+// 使用资源包时只监视资源包文件，它被替换后重新打开资源包。
+// fd由一个事件循环监听，可读时调用HandleEvents，所有函数都只在这个线程上调用
+class FileWatcher {
+ public:
+  FileWatcher();
+  ~FileWatcher();
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  // 监视root及其下所有子目录。root要和文件缓存的键使用同样的写法，
+  // 即root加上请求路径(去掉开头的'/')就是缓存中的键。
+  // 目录太多超出fs.inotify.max_user_watches等情况下返回false
+  bool Init(const std::string& root);
+  // 监视资源包文件所在的目录，新的资源包rename到bundle_path或者在原处写完后
+  // 重新打开它。新的资源包不完整时继续使用原来的
+  bool InitBundle(const std::string& bundle_path);
+  // 处理所有已经到达的事件，fd可读时调用
+  void HandleEvents();
+
+  inline int get_fd() const { return fd_; }
+  inline size_t get_num_dirs() const { return dirs_.size(); }
+  inline unsigned long long get_num_events() const { return num_events_; }
+
+ private:
+  // 关心的事件：内容或属性改变、文件被创建、删除或移入移出
+  static const uint32_t kMask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                IN_MOVED_TO;
+
+  // 监视dir(以'/'结尾)和它下面所有的子目录
+  bool AddWatch(const std::string& dir);
+  // 不再监视dir(以'/'结尾)和它下面所有的子目录
+  void RemoveWatch(const std::string& dir);
+  void OnEvent(const struct inotify_event& event);
+  // path对应的文件变了，让它本身以及以它为原文件的压缩版本失效
+  static void Invalidate(const std::string& path);
+  void ReloadBundle();
+
+  int fd_;
+  std::unordered_map<int, std::string> dirs_;  // watch描述符 -> 目录(以'/'结尾)
+  unsigned long long num_events_;
+  std::string bundle_path_;  // 监视的资源包，为空时监视资源目录
+  std::string bundle_name_;  // 资源包的文件名，不含目录
+};
+
+#endif  // WEBSERVER_HTTP_FILE_WATCHER_H_
@@ -5,9 +5,14 @@ using namespace std;
 // 静态成员变量
 const char* HttpConnect::src_dir;
 std::atomic<int> HttpConnect::user_count;
+std::atomic<unsigned long long> HttpConnect::idle_releases;
 bool HttpConnect::is_ET;
+ObjectPool<HttpConnect::Exchange> HttpConnect::exchange_pool_(
+    MAX_FREE_EXCHANGES);
 
-HttpConnect::HttpConnect() : fd_(-1), addr_({0}), is_close_(true) {}
+HttpConnect::HttpConnect()
+    : fd_(-1), addr_({0}), is_close_(true), keep_alive_(false), busy_(false),
+      seg_idx_(0), to_write_bytes_(0) {}
 
 HttpConnect::~HttpConnect() {
   Close();
@@ -19,16 +24,21 @@ void HttpConnect::Init(int fd, const sockaddr_in& addr) {
   addr_ = addr;
   fd_ = fd;
   // iov_cnt_ = 2;  // iov缓冲池数
-  // 初始化缓冲池读写位置
-  // write_buff_.RetrieveAll();
-  // read_buff_->RetrieveAll();
+  // 初始化缓冲池读写位置，连接对象会被同一个fd上的下一个连接复用，
+  // 不能留下上一个连接没处理完的数据
+  // 处理状态在上一个连接关闭时已经还给池，有数据到达时再取
+  ReleaseExchange();
+  read_buff_.RetrieveAll();
   is_close_ = false;
+  keep_alive_ = false;
+  busy_ = false;
   LOG_INFO("Client[%d](%s:%d) in, userCount:%d", fd_, GetIP(), 
            GetPort(), (int)user_count);
 }
 
 void HttpConnect::Close() {
-  response_.UnmapFile();
+  ReleaseExchange();  // 释放文件的引用和处理状态
+  read_buff_.RetrieveAll();
   if (is_close_ == false){
     is_close_ = true; 
     user_count--;
@@ -39,29 +49,216 @@ void HttpConnect::Close() {
 }
 
 bool HttpConnect::Process() {
-    request_.Init();
-    if (read_buff_.ReadableBytes() <= 0) return false;  // 是否存在可读数据
-    else if (request_.Parse(&read_buff_)) {
-      LOG_DEBUG("%s", request_.get_path().c_str());
-      response_.Init(src_dir, request_.get_path(), request_.IsKeepAlive(), 200);
-    } else {
-      response_.Init(src_dir, request_.get_path(), false, 400);
+  // 请求的解析进度保存在请求对象中，数据不完整时下次读到数据后继续。
+  // 缓冲池中所有完整的请求在这里一次处理完，响应按请求的顺序排队，
+  // 最后一起发送(内存部分合成一次writev)，不用每个请求都等一轮epoll
+  if (read_buff_.ReadableBytes() == 0) return false;
+  AcquireExchange();
+  HttpRequest& request = exchange_->request;
+  size_t num_responses = 0;
+  while (num_responses < MAX_PIPELINE && read_buff_.ReadableBytes() > 0) {
+    // 可能阻塞的请求单独成一批，内联模式下才能交给线程池处理
+    if (num_responses > 0 && MayBlock()) break;
+    HttpRequest::HttpCode ret = request.Parse(&read_buff_);
+    if (ret == HttpRequest::NO_REQUEST) break;  // 请求还不完整，继续等待数据
+    Respond(ret);
+    ++num_responses;
+    // 发完这个响应就要关闭连接，后面的请求不用再处理
+    if (!keep_alive_) break;
+  }
+  return FinishBatch(num_responses);
+}
+
+Async<bool> HttpConnect::ProcessAsync(AsyncContext ctx) {
+  if (read_buff_.ReadableBytes() == 0) co_return false;
+  AcquireExchange();
+  HttpRequest& request = exchange_->request;
+  size_t num_responses = 0;
+  while (num_responses < MAX_PIPELINE && read_buff_.ReadableBytes() > 0) {
+    HttpRequest::HttpCode ret = request.Parse(&read_buff_, true);
+    if (ret == HttpRequest::NO_REQUEST) break;
+    if (ret == HttpRequest::GET_REQUEST && request.IsVerifyPending()) {
+      co_await request.VerifyAsync(ctx);
     }
+    Respond(ret);
+    ++num_responses;
+    if (!keep_alive_) break;
+  }
+  co_return FinishBatch(num_responses);
+}
+
+void HttpConnect::Respond(HttpRequest::HttpCode ret) {
+  HttpRequest& request = exchange_->request;
+  HttpResponse& response = exchange_->response;
+  if (ret == HttpRequest::GET_REQUEST) {
+    LOG_DEBUG("%s", request.get_path().c_str());
+    response.Init(src_dir, request.get_path(), request.IsKeepAlive(), 200);
+    response.SetRanges(request.get_ranges(), request.get_if_range());
+    response.SetValidators(request.get_if_none_match(),
+                           request.get_if_modified_since());
+    response.SetHeadOnly(request.IsHead());
+    response.SetAcceptEncoding(request.get_accept_encoding());
+  } else {
+    response.Init(src_dir, request.get_path(), false,
+                  request.get_error_code());
+  }
+
+  // 组建响应报文放入写缓冲池，文件的引用交给pending，发送完再释放
+  response.MakeResponse(&write_buff_);
+  shared_ptr<const CachedFile> file = response.ReleaseFile();
+  for (const HttpResponse::BodyPart& part : response.get_parts()) {
+    exchange_->pending.push_back({part.head_len, part.len > 0 ? file : nullptr,
+                                  static_cast<off_t>(part.offset), part.len});
+  }
+  keep_alive_ = ret == HttpRequest::GET_REQUEST && request.IsKeepAlive();
+}
+
+bool HttpConnect::FinishBatch(size_t num_responses) {
+  if (exchange_->pending.empty()) return false;
+  BuildSegments();
+  LOG_DEBUG("responses:%d, segments:%d, to write %d", (int)num_responses,
+            (int)exchange_->segments.size(), (int)ToWriteBytes());
+  return true;
+}
+
+bool HttpConnect::Reject(int code) {
+  read_buff_.RetrieveAll();  // 已经收到的请求都不处理了
+  AcquireExchange();
+  exchange_->request.Init();  // 丢弃解析了一半的请求
+  // 用启动时生成好的错误页面，和其他响应一样通过发送列表发出
+  const size_t before = write_buff_.ReadableBytes();
+  HttpResponse::AppendErrorPage(&write_buff_, code, false, false);
+  exchange_->pending.push_back(
+      {write_buff_.ReadableBytes() - before, nullptr, 0, 0});
+  keep_alive_ = false;
+  BuildSegments();
+  return true;
+}
+
+void HttpConnect::BuildSegments() {
+  // 响应头依次放在write_buff_的各个块中，按顺序切给每个部分，
+  // 同一块中相邻的响应头会在AddSegment中合并成一段
+  exchange_->segments.clear();
+  seg_idx_ = 0;
+  to_write_bytes_ = 0;
+  const BufferBlock* block = write_buff_.FirstBlock();
+  size_t block_pos = block ? block->read_pos : 0;
+  for (const PendingPart& pending : exchange_->pending) {
+    size_t head_len = pending.head_len;
+    while (head_len > 0) {
+      if (block_pos == block->write_pos) {
+        block = block->next;
+        block_pos = block->read_pos;
+      }
+      const size_t len = std::min(head_len, block->write_pos - block_pos);
+      AddSegment(block->data + block_pos, len);
+      block_pos += len;
+      head_len -= len;
+    }
+    if (pending.file) AddFileSegment(*pending.file, pending.offset, pending.len);
+  }
+}
+
+void HttpConnect::AddSegment(const char* base, size_t len) {
+  if (len == 0) return;
+  to_write_bytes_ += len;
+  std::vector<Segment>& segments = exchange_->segments;
+  if (!segments.empty()) {
+    Segment& last = segments.back();
+    if (last.fd < 0 && last.base + last.len == base) {
+      last.len += len;
+      return;
+    }
+  }
+  segments.push_back({base, -1, 0, len});
+}
+
+void HttpConnect::AddFileSegment(const CachedFile& file, off_t offset,
+                                 size_t len) {
+  if (file.data) {
+    AddSegment(file.data + offset, len);
+    return;
+  }
+  if (len == 0) return;
+  to_write_bytes_ += len;
+  exchange_->segments.push_back({nullptr, file.fd, offset, len});
+}
 
-    response_.MakeResponse(&write_buff_);  // 组建响应报文放入写缓冲池
-    // 响应头
-    iov_[0].iov_base = const_cast<char*>(write_buff_.Peek());
-    iov_[0].iov_len = write_buff_.ReadableBytes();
-    iov_cnt_ = 1;
-
-    // 需要返回服务器资源，则从映射地址上读取
-    if (response_.FileLen() > 0  && response_.get_mm_file()) {
-      iov_[1].iov_base = response_.get_mm_file();
-      iov_[1].iov_len = response_.FileLen();
-      iov_cnt_ = 2;
+void HttpConnect::Advance(size_t len) {
+  to_write_bytes_ -= len;
+  // 跳过已经发送完的段，调整只发送了一部分的段
+  std::vector<Segment>& segments = exchange_->segments;
+  while (len > 0 && len >= segments[seg_idx_].len) {
+    len -= segments[seg_idx_].len;
+    ++seg_idx_;
+  }
+  if (len > 0) {
+    Segment& seg = segments[seg_idx_];
+    if (seg.fd < 0) {
+      seg.base += len;
+    } else {
+      seg.offset += len;
     }
-    LOG_DEBUG("filesize:%d, %d  to %d", response_.FileLen() , iov_cnt_, ToWriteBytes());
-    return true;
+    seg.len -= len;
+  }
+}
+
+void HttpConnect::ReleaseResponses() {
+  if (exchange_) {
+    exchange_->pending.clear();  // 释放文件的引用，保留容量
+    exchange_->segments.clear();
+  }
+  seg_idx_ = 0;
+  to_write_bytes_ = 0;
+  write_buff_.RetrieveAll();
+}
+
+void HttpConnect::AcquireExchange() {
+  if (!exchange_) exchange_ = exchange_pool_.Acquire();
+}
+
+void HttpConnect::ReleaseExchange() {
+  ReleaseResponses();
+  if (!exchange_) return;
+  exchange_->request.Init();  // 丢弃没有解析完的请求
+  exchange_->response.ResetFile();
+  exchange_pool_.Release(std::move(exchange_));
+}
+
+bool HttpConnect::ReleaseIdle() {
+  // 读缓冲中还有半个请求，或者客户端不收数据、响应还没发完，都不能释放
+  if (is_close_ || !exchange_ || read_buff_.ReadableBytes() > 0 ||
+      to_write_bytes_ > 0) {
+    return false;
+  }
+  LOG_DEBUG("Client[%d] idle, release %zu bytes", fd_, get_memory());
+  ReleaseExchange();
+  ++idle_releases;
+  return true;
+}
+
+size_t HttpConnect::get_memory() const {
+  size_t total = sizeof(*this) + read_buff_.get_allocated() +
+                 write_buff_.get_allocated();
+  if (exchange_) {
+    total += sizeof(Exchange) +
+             exchange_->pending.capacity() * sizeof(PendingPart) +
+             exchange_->segments.capacity() * sizeof(Segment) +
+             exchange_->iov.capacity() * sizeof(struct iovec);
+  }
+  return total;
+}
+
+size_t HttpConnect::get_num_exchanges() { return exchange_pool_.get_in_use(); }
+
+size_t HttpConnect::get_exchange_size() { return sizeof(Exchange); }
+
+bool HttpConnect::MayBlock() const {
+  static const char kPost[] = "POST ";
+  const size_t len = sizeof(kPost) - 1;
+  char method[len];
+  return read_buff_.PeekCopy(method, len) == len &&
+         memcmp(method, kPost, len) == 0;
 }
 
 ssize_t HttpConnect::Read(int* save_errno) {
@@ -75,31 +272,45 @@ ssize_t HttpConnect::Read(int* save_errno) {
 }
 
 ssize_t HttpConnect::Write(int* save_errno) {
+  if (to_write_bytes_ == 0) return 0;  // 没有需要发送的数据
+  std::vector<Segment>& segments = exchange_->segments;
+  std::vector<struct iovec>& iov = exchange_->iov;
   ssize_t len = -1;
   do {
-    // If successful, writev() returns the number of bytes written from the buffer.
-    // else return -1
-    len = writev(fd_, iov_, iov_cnt_);
-    if (len <= 0) {  // 如果缓冲池是空的或操作失败
-      *save_errno = errno;
-      break;
-    }
-    if (iov_[0].iov_len + iov_[1].iov_len  == 0) { break; } // 传输结束
-    else if (static_cast<size_t>(len) > iov_[0].iov_len) {
-      // 如果发送的数据长度大于iov_[0].iov_len，第一块区域的数据发送完毕，并且第二块也有部分被发送了
-      iov_[1].iov_base = (uint8_t*) iov_[1].iov_base + (len - iov_[0].iov_len);  // 调整开始位置
-      iov_[1].iov_len -= (len - iov_[0].iov_len);  // 调整第二块剩余长度
-      if (iov_[0].iov_len) {  // 第一块发送完毕，回收空间
-        write_buff_.RetrieveAll();
-        iov_[0].iov_len = 0;
+    if (seg_idx_ == segments.size()) break;
+    const Segment& seg = segments[seg_idx_];
+    if (seg.fd >= 0) {
+      // 文件段由内核直接从页缓存发送，发送位置记录在段中，EAGAIN后从这里继续
+      off_t offset = seg.offset;
+      len = sendfile(fd_, seg.fd, &offset, seg.len);
+    } else {
+      // 连续的内存段合成一次发送
+      iov.clear();
+      size_t i = seg_idx_;
+      for (; i < segments.size() && segments[i].fd < 0 &&
+             iov.size() < IOV_MAX; ++i) {
+        iov.push_back({const_cast<char*>(segments[i].base), segments[i].len});
       }
+      struct msghdr msg = {};
+      msg.msg_iov = iov.data();
+      msg.msg_iovlen = iov.size();
+      // 后面紧跟着文件段时告诉内核还有数据，响应头和文件内容合在一起发出，
+      // 否则小文件要等Nagle算法收到ACK才能发出去。只是iov放满了时不设，
+      // 剩下的内存段下一轮马上就会发。对端已关闭时返回EPIPE，不产生SIGPIPE
+      int flags = MSG_NOSIGNAL;
+      if (i < segments.size() && segments[i].fd >= 0) flags |= MSG_MORE;
+      len = sendmsg(fd_, &msg, flags);
+    }
+    // 返回0说明文件被截断了，发不出声明的长度，只能关闭连接
+    if (len <= 0) {
+      *save_errno = len < 0 ? errno : EIO;
+      break;
     }
-    else {
-      // 第一块还未传输完
-      iov_[0].iov_base = (uint8_t*)iov_[0].iov_base + len; 
-      iov_[0].iov_len -= len; 
-      write_buff_.Retrieve(len);  // 回收已读空间
+    Advance(len);
+    if (to_write_bytes_ == 0) {  // 传输结束，回收空间
+      ReleaseResponses();
+      break;
     }
-  } while(is_ET || ToWriteBytes() > 10240);
+  } while (is_ET || ToWriteBytes() > 10240);
   return len;
-}
\ No newline at end of file
+}
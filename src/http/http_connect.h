@@ -3,13 +3,20 @@
 
 #include <sys/types.h>
 #include <sys/uio.h>     // readv/writev
+#include <sys/sendfile.h>  // sendfile
+#include <sys/socket.h>    // sendmsg
 #include <arpa/inet.h>   // sockaddr_in
 #include <stdlib.h>      // atoi()
+#include <limits.h>      // IOV_MAX
 #include <errno.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "../log/log.h"
 #include "../pool/sql_connect_raii.h"
-#include "../buffer/buffer.h"
+#include "../pool/object_pool.h"
+#include "../buffer/buffer_chain.h"
 #include "http_response.h"
 #include "http_request.h"
 
@@ -26,17 +33,37 @@ public:
   ssize_t Write(int* save_errno);
   // 关闭连接，取消文件映射，释放资源
   void Close();
-  // 解析http请求数据
+  // 解析读缓冲中所有完整的请求(HTTP/1.1流水线)，响应按顺序排队。
+  // 有响应需要发送时返回true
   bool Process();
+  // Process()的协程版本：登录/注册请求在协程中等待数据库，不占用线程，
+  // 所以可能阻塞的请求不用单独成一批。协程完成之前连接不能被关闭
+  Async<bool> ProcessAsync(AsyncContext ctx);
+  // 过载时调用：丢弃读缓冲中的请求，回复code对应的错误页面(503等)，
+  // 发送完关闭连接。和Process()一样，返回true后等待可写再发送
+  bool Reject(int code);
+  // 读缓冲中的请求是否可能阻塞。目前只有POST(登录/注册)会查询数据库，
+  // 其余都是静态资源请求，可以直接在事件循环线程上处理
+  bool MayBlock() const;
+  // 连接空闲时调用：把处理请求用的状态(解析器、请求、响应、发送列表)还给池，
+  // 下次有数据到达时再取。还有没处理完的数据或没发完的响应时不释放，返回false
+  bool ReleaseIdle();
+  // 正在被线程池处理。由事件循环在交出连接前设置，处理完重新注册事件前清除，
+  // 这段时间事件循环不能动连接的状态
+  inline void SetBusy(bool busy) {
+    busy_.store(busy, std::memory_order_release);
+  }
+  inline bool IsBusy() const { return busy_.load(std::memory_order_acquire); }
+  // 连接当前占用的内存(估计值)：连接对象、缓冲区的块和处理请求的状态
+  size_t get_memory() const;
 
   // 还需要写多少字节的数据
-  inline int ToWriteBytes() { 
-    return iov_[0].iov_len + iov_[1].iov_len; 
-  }
-  // 是否为长连接
-  inline bool IsKeepAlive() const {
-    return request_.IsKeepAlive();
-  }
+  inline size_t ToWriteBytes() const { return to_write_bytes_; }
+  // 读缓冲中是否还有没处理的数据(不完整的请求)
+  inline bool HasPendingInput() const { return read_buff_.ReadableBytes() > 0; }
+  // 是否为长连接，看的是最后一个排队的响应。
+  // 不能直接问请求，它可能已经在解析下一个还不完整的请求
+  inline bool IsKeepAlive() const { return keep_alive_; }
   // 获取socket对应的ip地址
   inline const char* GetIP() const { return inet_ntoa(addr_.sin_addr); }
   // 获取socket对应的端口
@@ -50,17 +77,75 @@ public:
   static bool is_ET;
   static const char* src_dir;
   static std::atomic<int> user_count;
+  static std::atomic<unsigned long long> idle_releases;  // 空闲释放的次数
+  // 所有连接正在使用的处理状态数，以及每个状态对象的大小，用于统计内存
+  static size_t get_num_exchanges();
+  static size_t get_exchange_size();
+
+  // 一批最多处理的流水线请求数，剩下的等这一批发送完再处理
+  static const size_t MAX_PIPELINE = 32;
     
 private:
+  // 排队等待发送的响应中的一部分，一个响应由一个或多个部分组成
+  // (Range请求有多个区间时每个区间一部分)
+  struct PendingPart {
+    size_t head_len;  // 这部分响应头(包括错误页的内容)在write_buff_中的长度
+    std::shared_ptr<const CachedFile> file;  // 缓存中的文件，没有时为空
+    off_t offset;     // 要发送的文件区间
+    size_t len;
+  };
+
+  // 一段要发送的数据，内存中的数据用writev发送，文件用sendfile发送
+  struct Segment {
+    const char* base;  // 内存段的起始地址
+    int fd;            // 文件段的fd，内存段为-1
+    off_t offset;      // 文件段下一次发送的位置
+    size_t len;        // 剩余长度
+  };
+
+  // 一轮请求-响应需要的全部状态。只在处理请求时才需要，
+  // 空闲的连接不持有，连接本身只剩下fd、地址和(通常为空的)缓冲区
+  struct Exchange {
+    HttpRequest request;
+    HttpResponse response;
+    std::vector<PendingPart> pending;  // 排队的响应
+    std::vector<Segment> segments;  // 响应头和文件交替组成的发送列表
+    std::vector<struct iovec> iov;  // 连续的内存段，一次writev发送
+  };
+
+  // 保证exchange_可用，空闲释放过时从池中重新取
+  void AcquireExchange();
+  // 恢复成初始状态后还给池
+  void ReleaseExchange();
+  // 为解析的结果组建响应，排到发送队列中
+  void Respond(HttpRequest::HttpCode ret);
+  // 一批请求处理完，有响应需要发送时生成发送列表并返回true
+  bool FinishBatch(size_t num_responses);
+  // 根据排队的响应生成要发送的数据段列表
+  void BuildSegments();
+  // 追加一段内存数据，和上一段相邻时直接合并
+  void AddSegment(const char* base, size_t len);
+  // 追加文件[offset, offset+len)，有映射时按内存段发送
+  void AddFileSegment(const CachedFile& file, off_t offset, size_t len);
+  // 已经发送了len字节，移动发送位置
+  void Advance(size_t len);
+  // 响应全部发送完(或连接关闭)后释放写缓冲和文件的引用
+  void ReleaseResponses();
+
   int fd_;  // socket_fd
   struct  sockaddr_in addr_;
   bool is_close_;
-  int iov_cnt_;
-  struct iovec iov_[2];   
-  Buffer read_buff_; // 读缓冲区
-  Buffer write_buff_; // 写缓冲区
-  HttpRequest request_;
-  HttpResponse response_;
+  bool keep_alive_;  // 最后一个排队的响应发完后是否保持连接
+  std::atomic<bool> busy_;
+  size_t seg_idx_;  // 第一个还没发送完的段
+  size_t to_write_bytes_;
+  BufferChain read_buff_;   // 读缓冲区
+  BufferChain write_buff_;  // 写缓冲区，响应头和错误页
+  std::unique_ptr<Exchange> exchange_;  // 空闲释放后为空
+
+  // 空闲连接还回来的状态，最多保留这么多个
+  static const size_t MAX_FREE_EXCHANGES = 256;
+  static ObjectPool<Exchange> exchange_pool_;
 };
 
 #endif  // WEBSERVER_HTTP_HTTP_CONNECT_H_
\ No newline at end of file
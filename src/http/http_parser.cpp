@@ -0,0 +1,178 @@
+// by zxg
+//
+#include "http_parser.h"
+
+#include <strings.h>  // strncasecmp()
+
+#include "http_scan.h"
+
+namespace {
+
+inline bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+
+}  // namespace
+
+void HttpParser::Reset() {
+  base_ = nullptr;
+  state_ = REQUEST_LINE;
+  line_start_ = 0;
+  scan_pos_ = 0;
+  method_ = path_ = version_ = Span{0, 0};
+  head_len_ = 0;
+  num_headers_ = 0;
+}
+
+HttpParser::Result HttpParser::Parse(const char* data, size_t len) {
+  base_ = data;
+  const char* end = data + len;
+  while (state_ != HEAD_DONE) {
+    // 找当前行的行尾。行内不允许出现除制表符外的控制字符，
+    // 所以第一个控制字符就应该是CR或LF，扫描过的字节不会再扫第二遍
+    const char* p = HttpScan::FindValueEnd(data + scan_pos_, end);
+    if (p == end) {
+      scan_pos_ = len;
+      return PARSE_INCOMPLETE;
+    }
+    const char* line_end = p;
+    if (*p == '\r') {
+      if (p + 1 == end) {
+        scan_pos_ = p - data;  // 停在CR上，等LF到达
+        return PARSE_INCOMPLETE;
+      }
+      ++p;
+    }
+    if (*p != '\n') return PARSE_ERROR;  // 单独的CR或者行内的控制字符
+    ++p;
+    const char* line = data + line_start_;
+    Result ret = state_ == REQUEST_LINE ? ParseRequestLine(line, line_end)
+                                        : ParseHeaderLine(line, line_end);
+    if (ret != PARSE_COMPLETE) return ret;
+    line_start_ = scan_pos_ = p - data;
+  }
+  head_len_ = line_start_;
+  return PARSE_COMPLETE;
+}
+
+HttpParser::Result HttpParser::ParseRequestLine(const char* p,
+                                                const char* end) {
+  // 方法名，eg: GET, POST
+  const char* start = p;
+  p = HttpScan::FindNonToken(p, end);
+  if (p == start || p == end || *p != ' ') return PARSE_ERROR;
+  method_ = MakeSpan(start, p);
+  ++p;
+  // URL
+  start = p;
+  p = HttpScan::FindPathEnd(p, end);
+  if (p == start || p == end || *p != ' ') return PARSE_ERROR;
+  path_ = MakeSpan(start, p);
+  ++p;
+  // 版本号，格式固定为HTTP/x.y，后面就是行尾
+  static const char kPrefix[] = "HTTP/";
+  const size_t prefix_len = sizeof(kPrefix) - 1;
+  if (static_cast<size_t>(end - p) != prefix_len + 3) return PARSE_ERROR;
+  for (size_t i = 0; i < prefix_len; ++i) {
+    if (p[i] != kPrefix[i]) return PARSE_ERROR;
+  }
+  p += prefix_len;
+  if (p[0] < '0' || p[0] > '9' || p[1] != '.' || p[2] < '0' || p[2] > '9') {
+    return PARSE_ERROR;
+  }
+  version_ = MakeSpan(p, end);
+  state_ = HEADER_LINE;
+  return PARSE_COMPLETE;
+}
+
+HttpParser::Result HttpParser::ParseHeaderLine(const char* p,
+                                               const char* end) {
+  // 空行表示请求头结束
+  if (p == end) {
+    state_ = HEAD_DONE;
+    return PARSE_COMPLETE;
+  }
+  if (num_headers_ == MAX_HEADERS) return PARSE_ERROR;
+  // 字段名
+  const char* start = p;
+  p = HttpScan::FindNonToken(p, end);
+  if (p == start || p == end || *p != ':') return PARSE_ERROR;
+  HeaderSpan& header = headers_[num_headers_];
+  header.name = MakeSpan(start, p);
+  ++p;
+  // 字段值，去掉两端的空白。行尾已经找到，值里不会有控制字符
+  while (p != end && IsSpace(*p)) ++p;
+  const char* value_end = end;
+  while (value_end != p && IsSpace(value_end[-1])) --value_end;
+  header.value = MakeSpan(p, value_end);
+  ++num_headers_;
+  return PARSE_COMPLETE;
+}
+
+std::string_view HttpParser::GetHeader(std::string_view name) const {
+  for (size_t i = 0; i < num_headers_; ++i) {
+    if (EqualsIgnoreCase(View(headers_[i].name), name)) {
+      return View(headers_[i].value);
+    }
+  }
+  return std::string_view();
+}
+
+bool HttpParser::EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  return a.size() == b.size() &&
+         strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+bool HttpParser::ParseRange(std::string_view value,
+                            std::vector<ByteRange>* ranges) {
+  ranges->clear();
+  static const char kUnit[] = "bytes=";
+  const size_t unit_len = sizeof(kUnit) - 1;
+  if (value.size() < unit_len ||
+      !EqualsIgnoreCase(value.substr(0, unit_len), kUnit)) {
+    return false;  // 只支持bytes单位
+  }
+  value.remove_prefix(unit_len);
+  while (!value.empty()) {
+    // 每个区间用','分隔，两边可以有空白
+    size_t comma = value.find(',');
+    std::string_view spec = value.substr(0, comma);
+    value.remove_prefix(comma == std::string_view::npos ? value.size()
+                                                        : comma + 1);
+    while (!spec.empty() && IsSpace(spec.front())) spec.remove_prefix(1);
+    while (!spec.empty() && IsSpace(spec.back())) spec.remove_suffix(1);
+    if (spec.empty()) continue;  // 允许空的列表项
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) return false;
+    std::string_view first = spec.substr(0, dash);
+    std::string_view last = spec.substr(dash + 1);
+    size_t num = 0;
+    ByteRange range = {-1, -1};
+    if (first.empty()) {
+      // 后缀形式：-500表示最后500个字节
+      if (!ToSize(last, &num)) return false;
+      range.last = num;
+    } else {
+      if (!ToSize(first, &num)) return false;
+      range.first = num;
+      if (!last.empty()) {
+        if (!ToSize(last, &num) || num < static_cast<size_t>(range.first)) {
+          return false;
+        }
+        range.last = num;
+      }
+    }
+    if (ranges->size() == MAX_RANGES) return false;
+    ranges->push_back(range);
+  }
+  return !ranges->empty();
+}
+
+bool HttpParser::ToSize(std::string_view str, size_t* value) {
+  if (str.empty() || str.size() > 18) return false;  // 18位以内不会溢出
+  size_t result = 0;
+  for (char c : str) {
+    if (c < '0' || c > '9') return false;
+    result = result * 10 + (c - '0');
+  }
+  *value = result;
+  return true;
+}
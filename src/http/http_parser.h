@@ -0,0 +1,119 @@
+// Hand-written HTTP/1.x request parser working in place on buffer memory.
+// by zxg
+//
+#ifndef WEBSERVER_HTTP_HTTP_PARSER_H_
+#define WEBSERVER_HTTP_HTTP_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+#include <vector>
+
+// 请求头中的一个字段，指向读缓冲区中的内存
+struct HttpHeader {
+  std::string_view name;
+  std::string_view value;
+};
+
+// Range请求头中的一段(RFC 7233)，位置都是包含在内的字节偏移
+struct ByteRange {
+  int64_t first;  // 起始位置，-1表示后缀形式，即最后last个字节
+  int64_t last;   // 结束位置，-1表示直到文件末尾
+};
+
+// 请求行和请求头的解析器。
+// 用状态机直接扫描读缓冲区，解析过程中没有任何堆内存分配。
+// 解析可以分多次进行：数据不完整时保存状态和已解析到的位置，
+// 下次只从上次停下的地方继续扫描新到达的字节。
+// 内部只记录相对请求起点的偏移，缓冲区在两次调用之间被移动或扩容也没关系
+class HttpParser {
+ public:
+  enum Result {
+    PARSE_COMPLETE,    // 请求行和请求头完整
+    PARSE_INCOMPLETE,  // 数据不完整，需要继续读取
+    PARSE_ERROR,       // 请求报文有误
+  };
+
+  static const size_t MAX_HEADERS = 64;  // 最多支持的请求头字段数
+  static const size_t MAX_RANGES = 16;   // Range中最多支持的区间数
+
+  HttpParser() { Reset(); }
+
+  // 开始解析一个新的请求
+  void Reset();
+  // 解析[data, data+len)中的请求行和请求头，data为请求的起点。
+  // 返回PARSE_INCOMPLETE后，收到更多数据时用同一请求的数据再次调用即可继续。
+  // 解析完成后再调用会直接返回PARSE_COMPLETE，只更新结果指向的内存地址
+  Result Parse(const char* data, size_t len);
+  // 按名字查找请求头，不区分大小写，不存在时返回空串
+  std::string_view GetHeader(std::string_view name) const;
+
+  // 不区分大小写比较两个字符串
+  static bool EqualsIgnoreCase(std::string_view a, std::string_view b);
+  // 把十进制数字串转为整数，有非数字字符或溢出时返回false
+  static bool ToSize(std::string_view str, size_t* value);
+  // 解析Range的值，eg: bytes=0-499, -500, 9500-
+  // 格式不对或区间太多时返回false，按照RFC应当忽略这个Range
+  static bool ParseRange(std::string_view value,
+                         std::vector<ByteRange>* ranges);
+
+  // 取值函数，结果指向最近一次传给Parse的内存
+  inline std::string_view get_method() const { return View(method_); }
+  inline std::string_view get_path() const { return View(path_); }
+  inline std::string_view get_version() const {  // eg: 1.1
+    return View(version_);
+  }
+  // 请求行加请求头的长度，包括结尾的空行
+  inline size_t get_head_len() const { return head_len_; }
+  inline size_t get_num_headers() const { return num_headers_; }
+  // 是否还在解析请求行
+  inline bool InRequestLine() const { return state_ == REQUEST_LINE; }
+  inline HttpHeader get_header(size_t i) const {
+    return {View(headers_[i].name), View(headers_[i].value)};
+  }
+
+ private:
+  // 解析进度
+  enum State {
+    REQUEST_LINE,  // 请求行
+    HEADER_LINE,   // 请求头
+    HEAD_DONE,     // 请求头结束
+  };
+
+  // 请求中的一段，偏移相对于请求起点
+  struct Span {
+    size_t off;
+    size_t len;
+  };
+
+  struct HeaderSpan {
+    Span name;
+    Span value;
+  };
+
+  inline std::string_view View(Span span) const {
+    return std::string_view(base_ + span.off, span.len);
+  }
+  inline Span MakeSpan(const char* begin, const char* end) const {
+    return {static_cast<size_t>(begin - base_),
+            static_cast<size_t>(end - begin)};
+  }
+
+  // 解析一行完整的请求行/请求头，[p, end)不包括行尾的CRLF
+  Result ParseRequestLine(const char* p, const char* end);
+  Result ParseHeaderLine(const char* p, const char* end);
+
+  const char* base_;   // 最近一次传入的请求起点
+  State state_;
+  size_t line_start_;  // 当前行的起点
+  size_t scan_pos_;    // 当前行已经扫描过的位置，之前没有行尾
+  Span method_;
+  Span path_;
+  Span version_;
+  size_t head_len_;
+  size_t num_headers_;
+  HeaderSpan headers_[MAX_HEADERS];
+};
+
+#endif  // WEBSERVER_HTTP_HTTP_PARSER_H_
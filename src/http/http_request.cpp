@@ -5,12 +5,22 @@ using namespace std;
 HttpRequest::HttpRequest() { Init(); }
 
 void HttpRequest::Init() {
-  method_ = "";
-  path_ = "";
-  version_ = "";
-  content_ = "";
+  path_.clear();  // 保留容量，下一个请求不用重新分配
+  content_len_ = 0;
+  content_.clear();
+  keep_alive_ = false;
+  is_head_ = false;
+  error_code_ = 400;
+  ranges_.clear();
+  if_range_.clear();
+  if_none_match_.clear();
+  if_modified_since_.clear();
+  accept_encoding_ = 0;
+  defer_verify_ = false;
+  verify_pending_ = false;
+  verify_login_ = false;
   state_ = REQUEST_LINE;
-  header_.clear();
+  parser_.Reset();
   post_.clear();
 }
 
@@ -22,57 +32,87 @@ const unordered_map<string, int> HttpRequest::default_html_tags{
     {"/register.html", 0}, {"/login.html", 1},
 };
 
-bool HttpRequest::Parse(Buffer* buff) {
-  const char CRLF[] = "\r\n";
-  if (buff->ReadableBytes() <= 0) { return false; }
-  while (buff->ReadableBytes() > 0 && state_ != REQUEST_FINISH) {
-    // 每行以\r\n作为结束字符，查找\r\n就能将报文按行拆解
-    const char* line_end = search(buff->Peek(),
-                                  static_cast<const char*>(buff->BeginWrite()),
-                                  CRLF, CRLF+2);
-    // 读取一行
-    std::string line(buff->Peek(), line_end);  // read line, construct string
-    switch (state_) {
-      case REQUEST_LINE:
-        if (!ParseRequestLine(line)) { return false; }
-        ParsePath();  // get html path
-        break;
-      case REQUEST_HEADER:
-        ParseRequestHeader(line);
-        if (buff->ReadableBytes() <= 2) { state_ = REQUEST_FINISH; }
-        break;
-      case REQUEST_CONTENT:
-        ParseRequestContent(line);
-        break;
-      default:
-        break;
-    }  // switch
-    if (line_end == buff->BeginWrite()) { 
-      // 当方法体为POST的时候,此时会导致lineEnd已经走完了可读区域，
-      // 提前退出而没有偏移readpos_
-      if (method_ == "POST" && state_ == REQUEST_FINISH) 
-        buff->RetrieveUntil(line_end);
-      break; 
+HttpRequest::HttpCode HttpRequest::Parse(BufferChain* buff,
+                                         bool defer_verify) {
+  if (state_ == REQUEST_FINISH) { Init(); }  // 上一个请求已经处理完
+  defer_verify_ = defer_verify;
+  if (buff->ReadableBytes() <= 0) { return NO_REQUEST; }
+  HttpParser::Result ret = ParseHead(buff);
+  if (ret == HttpParser::PARSE_INCOMPLETE) {
+    // 请求头太长，不再等待，请求行还没结束说明是URL太长
+    if (buff->ReadableBytes() > MAX_HEAD_LEN) {
+      return Fail(parser_.InRequestLine() ? 414 : 400);
     }
-    buff->RetrieveUntil(line_end + 2);  // 移动读指针，同时跳过CRLF
-  }  // while
-  LOG_DEBUG("[%s], [%s], [%s]", method_.c_str(), path_.c_str(),
-            version_.c_str());
-  return true;
+    return NO_REQUEST;
+  }
+  if (ret == HttpParser::PARSE_ERROR) {
+    LOG_ERROR("RequestLine Error");
+    return Fail(400);
+  }
+  if (state_ != REQUEST_CONTENT) {
+    // 请求头刚刚完整，只处理一次。一次就收到了完整的超长请求也要拒绝
+    if (parser_.get_path().size() > MAX_URI_LEN) return Fail(414);
+    if (parser_.get_head_len() > MAX_HEAD_LEN) return Fail(400);
+    path_.assign(parser_.get_path().data(), parser_.get_path().size());  // URL
+    ParsePath();  // get html path
+    ParseConnection();
+    // 请求体长度由Content-Length给出，没有时没有请求体
+    string_view content_length = parser_.GetHeader("Content-Length");
+    if (!content_length.empty() &&
+        !HttpParser::ToSize(content_length, &content_len_)) {
+      return Fail(400);
+    }
+    if (content_len_ > MAX_CONTENT_LEN) return Fail(413);
+    // 只支持这几种方法
+    if (get_method() != "GET" && get_method() != "HEAD" &&
+        get_method() != "POST") {
+      return Fail(405);
+    }
+    is_head_ = get_method() == "HEAD";
+    ParseRange();
+    ParseValidators();
+    ParseAcceptEncoding();
+    state_ = REQUEST_CONTENT;
+  }
+  // 等待请求体全部到达
+  const size_t total_len = parser_.get_head_len() + content_len_;
+  if (buff->ReadableBytes() < total_len) { return NO_REQUEST; }
+  if (buff->PeekBytes() < total_len) {
+    // 请求体跨块了，拷贝到一起后让解析结果指向新的位置
+    buff->Pullup(total_len);
+    parser_.Parse(buff->Peek(), buff->PeekBytes());
+  }
+  ParseRequestContent(buff->Peek() + parser_.get_head_len(), content_len_);
+  LOG_DEBUG("[%.*s], [%s], [%.*s]", (int)get_method().size(),
+            get_method().data(), path_.c_str(), (int)get_version().size(),
+            get_version().data());
+  buff->Retrieve(total_len);  // 之后解析结果指向的内存可能已经还给块池
+  return GET_REQUEST;
 }
 
-bool HttpRequest::ParseRequestLine(const string& line) {
-  regex pattern("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");  // construct reg pattern
-  smatch match_group;
-  if (regex_match(line, match_group, pattern)) {
-    method_ = match_group[1];   // eg: GET, POST
-    path_ = match_group[2];     // URL
-    version_ = match_group[3];  // version of http
-    state_ = REQUEST_HEADER;    // next state
-    return true;
+HttpParser::Result HttpRequest::ParseHead(BufferChain* buff) {
+  // 直接在缓冲区第一块的内存上解析，请求通常不会跨块。
+  // 头部已经完整时这里只会更新解析结果指向的地址
+  HttpParser::Result ret = parser_.Parse(buff->Peek(), buff->PeekBytes());
+  // 第一块的数据不完整而后面还有数据，说明请求跨块了。先拼成一个块的大小，
+  // 还不够再拼到请求头的上限，超过上限的请求会被拒绝，不用再多拷贝
+  const size_t limits[] = {BlockPool::BLOCK_SIZE, MAX_HEAD_LEN + 1};
+  for (size_t limit : limits) {
+    if (ret != HttpParser::PARSE_INCOMPLETE ||
+        buff->PeekBytes() == buff->ReadableBytes()) {
+      break;
+    }
+    buff->Pullup(limit);
+    ret = parser_.Parse(buff->Peek(), buff->PeekBytes());
   }
-  LOG_ERROR("RequestLine Error");
-  return false;
+  return ret;
+}
+
+HttpRequest::HttpCode HttpRequest::Fail(int code) {
+  error_code_ = code;
+  keep_alive_ = false;  // 剩下的数据已经没法解析，响应后关闭连接
+  state_ = REQUEST_FINISH;
+  return BAD_REQUEST;
 }
 
 void HttpRequest::ParsePath() {
@@ -87,24 +127,94 @@ void HttpRequest::ParsePath() {
   }
 }
 
-void HttpRequest::ParseRequestHeader(const string& line) {
-  regex pattern("^([^:]*): ?(.*)$");  // construct reg pattern
-  smatch match_group;
-  if (regex_match(line, match_group, pattern)) {
-    header_[match_group[1]] = match_group[2];  // field = content
+void HttpRequest::ParseRange() {
+  // Range只对GET有意义，其他方法按RFC 7233忽略
+  if (get_method() != "GET") return;
+  string_view range = parser_.GetHeader("Range");
+  if (range.empty()) return;
+  if (!HttpParser::ParseRange(range, &ranges_)) {
+    LOG_DEBUG("Ignore invalid Range: %.*s", (int)range.size(), range.data());
+    ranges_.clear();  // 无效的Range当作没有，返回整个文件
+    return;
+  }
+  string_view if_range = parser_.GetHeader("If-Range");
+  if_range_.assign(if_range.data(), if_range.size());
+}
+
+void HttpRequest::ParseValidators() {
+  // 只有GET和HEAD可以返回304
+  if (get_method() != "GET" && !IsHead()) return;
+  string_view value = parser_.GetHeader("If-None-Match");
+  if_none_match_.assign(value.data(), value.size());
+  value = parser_.GetHeader("If-Modified-Since");
+  if_modified_since_.assign(value.data(), value.size());
+}
+
+void HttpRequest::ParseConnection() {
+  // HTTP/1.1默认长连接，除非带了close；HTTP/1.0要显式带keep-alive。
+  // Connection可以是逗号分隔的列表，eg: keep-alive, Upgrade
+  bool has_close = false, has_keep_alive = false;
+  string_view value = parser_.GetHeader("Connection");
+  while (!value.empty()) {
+    size_t comma = value.find(',');
+    string_view option = value.substr(0, comma);
+    value.remove_prefix(comma == string_view::npos ? value.size() : comma + 1);
+    while (!option.empty() && isspace(option.front())) option.remove_prefix(1);
+    while (!option.empty() && isspace(option.back())) option.remove_suffix(1);
+    if (HttpParser::EqualsIgnoreCase(option, "close")) {
+      has_close = true;
+    } else if (HttpParser::EqualsIgnoreCase(option, "keep-alive")) {
+      has_keep_alive = true;
+    }
+  }
+  if (has_close) {
+    keep_alive_ = false;
+  } else if (get_version() == "1.1") {
+    keep_alive_ = true;
   } else {
-    state_ = REQUEST_CONTENT;  // next state，请求体解析结束才进入下一个状态
+    keep_alive_ = get_version() == "1.0" && has_keep_alive;
   }
 }
 
-void HttpRequest::ParseRequestContent(const string& line) {
-  content_ = line;
-  if (method_ == "POST" && 
-      header_["Content-Type"] == "application/x-www-form-urlencoded") {
-    ParsePost();
+void HttpRequest::ParseAcceptEncoding() {
+  // eg: gzip, deflate, br;q=0.9, *;q=0.1，q=0表示不接受
+  string_view value = parser_.GetHeader("Accept-Encoding");
+  while (!value.empty()) {
+    size_t comma = value.find(',');
+    string_view item = value.substr(0, comma);
+    value.remove_prefix(comma == string_view::npos ? value.size() : comma + 1);
+    size_t semi = item.find(';');
+    string_view coding = item.substr(0, semi);
+    string_view params =
+        semi == string_view::npos ? string_view() : item.substr(semi + 1);
+    while (!coding.empty() && isspace(coding.front())) coding.remove_prefix(1);
+    while (!coding.empty() && isspace(coding.back())) coding.remove_suffix(1);
+    while (!params.empty() && isspace(params.front())) params.remove_prefix(1);
+    // q=0, q=0.0, q=0.000都是不接受
+    if (params.size() >= 3 && (params[0] == 'q' || params[0] == 'Q') &&
+        params[1] == '=' && params[2] == '0' &&
+        params.find_first_of("123456789", 3) == string_view::npos) {
+      continue;
+    }
+    if (HttpParser::EqualsIgnoreCase(coding, "gzip")) {
+      accept_encoding_ |= ENCODING_GZIP;
+    } else if (HttpParser::EqualsIgnoreCase(coding, "br")) {
+      accept_encoding_ |= ENCODING_BR;
+    } else if (coding == "*") {
+      accept_encoding_ |= ENCODING_GZIP | ENCODING_BR;
+    }
   }
+}
+
+void HttpRequest::ParseRequestContent(const char* begin, size_t len) {
   state_ = REQUEST_FINISH;
-  LOG_DEBUG("Body:%s, len:%d", line.c_str(), line.size());
+  if (len == 0) return;
+  content_.assign(begin, len);
+  if (get_method() == "POST" &&
+      parser_.GetHeader("Content-Type") == "application/x-www-form-urlencoded") {
+    ParsePost();
+  }
+  LOG_DEBUG("Body:%s, len:%d", content_.c_str(), content_.size());
 }
 
 void HttpRequest::ParseFormUrlEncoded() {
@@ -159,6 +269,11 @@ void HttpRequest::ParsePost() {
     LOG_DEBUG("Tag:%d", tag);
     if (tag == 0 || tag == 1) {
       bool is_login = (tag == 1);  // login or rigister
+      if (defer_verify_) {  // 留给VerifyAsync()
+        verify_pending_ = true;
+        verify_login_ = is_login;
+        return;
+      }
       if (UserVerify(post_["username"], post_["password"], is_login)) {
         path_ = "/welcome.html";
       } else {
@@ -172,63 +287,96 @@ void HttpRequest::ParsePost() {
 bool HttpRequest::UserVerify(const string& name, const string& pwd, 
                              bool is_login) {
   if (name == "" || pwd == "") { return false; }
-  LOG_INFO("Verify name:%s pwd:%s", name.c_str(), pwd.c_str());
+  LOG_INFO("Verify name:%s", name.c_str());
   // construt sql pool
   MYSQL* sql;
   SqlConnectionRaii sql_pool(&sql, SqlConnectionPool::Instance()); 
-  // auto sql = sql_pool.get_sql();  // get a sql connection
   assert(sql);
-  bool flag = false;              // 返回值
-  bool username_existed = false;  // 用户名是否已存在
-  unsigned int num_fields = 0;    // 查询到的字段数
-  char order[256] = {0};          // SQL语句
-  MYSQL_FIELD* fields = nullptr;  // mysql字段结构体
-  MYSQL_RES* res = nullptr;       // result set结构体
+  bool insert = false;
+  bool flag = CheckUser(
+      SqlConnectionPool::Execute(sql, SelectUserOrder(sql, name)), pwd,
+      is_login, &insert);
+  if (insert) {
+    flag = SqlConnectionPool::Execute(sql, InsertUserOrder(sql, name, pwd)).ok;
+  }
+  LOG_DEBUG("UserVerify success!!");
+  return flag;
+}
 
+string HttpRequest::SelectUserOrder(MYSQL* sql, const string& name) {
   // SQL语句，查询用户和密码根据用户名
-  snprintf(order, sizeof(order),
-           "SELECT username, password FROM user WHERE username='%s' LIMIT 1",
-           name.c_str());
-  LOG_DEBUG("%s", order);
-  if (mysql_query(sql, order) != 0) {  // 0 for success, nonzero if error
-    mysql_free_result(res);  // 释放结果集的内存
-    return false;
-  }
-  res = mysql_store_result(sql);       // 保存查询到的结果集
-  num_fields = mysql_num_fields(res);  // columns in a result set
-  fields = mysql_fetch_fields(res);    // 获取结果集的字段
-
-  while(MYSQL_ROW row = mysql_fetch_row(res)) {
-    LOG_DEBUG("MYSQL ROW: %s %s", row[0], row[1]);
-    string password(row[1]);
-    // 登录
+  string order = "SELECT username, password FROM user WHERE username='" +
+                 EscapeSql(sql, name) + "' LIMIT 1";
+  LOG_DEBUG("%s", order.c_str());
+  return order;
+}
+
+string HttpRequest::InsertUserOrder(MYSQL* sql, const string& name,
+                                    const string& pwd) {
+  // 插入命令，含有密码，不写日志
+  return "INSERT INTO user(username, password) VALUES('" +
+         EscapeSql(sql, name) + "','" + EscapeSql(sql, pwd) + "')";
+}
+
+string HttpRequest::EscapeSql(MYSQL* sql, const string& value) {
+  // 最坏情况每个字符都要转义，再加上结尾的'\0'
+  string escaped(value.size() * 2 + 1, '\0');
+  escaped.resize(mysql_real_escape_string(sql, &escaped[0], value.data(),
+                                          value.size()));
+  return escaped;
+}
+
+bool HttpRequest::CheckUser(const SqlResult& result, const string& pwd,
+                            bool is_login, bool* insert) {
+  *insert = false;
+  if (!result.ok) return false;  // 查询失败
+  bool flag = false;              // 返回值
+  bool username_existed = false;  // 用户名是否已存在
+  for (const vector<string>& row : result.rows) {
+    if (row.size() < 2) continue;
+    LOG_DEBUG("MYSQL ROW: %s", row[0].c_str());
     if (is_login) {  // 登录行为
-        if (pwd == password) { flag = true; }  // 验证密码
-        else {
-          flag = false;
-          LOG_DEBUG("pwd error!");
-        }
+      flag = (pwd == row[1]);  // 验证密码
+      if (!flag) LOG_DEBUG("pwd error!");
     } else {  // 用户不是登录行为，却查询到了用户名和密码，说明用户名被占用
-      username_existed = true;  // 用户名已经存在
-      flag = false;
+      username_existed = true;
       LOG_DEBUG("user used!");
     }
   }
-
   // 如果是注册行为且用户名未被占用
   if (!is_login && !username_existed) {
     LOG_DEBUG("regirster!");
-    bzero(order, 256);
-    // 插入命令
-    snprintf(order, 256,
-              "INSERT INTO user(username, password) VALUES('%s','%s')",
-              name.c_str(), pwd.c_str());
-    LOG_DEBUG( "%s", order);
-    if(mysql_query(sql, order) == 0) {  // 插入一条记录，命令执行成功
-        flag = true;
-    }
+    *insert = true;
   }
-  LOG_DEBUG( "UserVerify success!!");
-  mysql_free_result(res);  // 释放内存
   return flag;
+}
+
+Async<void> HttpRequest::VerifyAsync(AsyncContext ctx) {
+  assert(verify_pending_);
+  bool ok = co_await UserVerifyAsync(post_["username"], post_["password"],
+                                     verify_login_, ctx);
+  path_ = ok ? "/welcome.html" : "/error.html";
+  verify_pending_ = false;
+}
+
+// 和UserVerify的逻辑相同，等连接和等查询结果时挂起协程
+Async<bool> HttpRequest::UserVerifyAsync(string name, string pwd,
+                                         bool is_login, AsyncContext ctx) {
+  if (name == "" || pwd == "") { co_return false; }
+  LOG_INFO("Verify name:%s", name.c_str());
+  SqlConnectionPool* pool = SqlConnectionPool::Instance();
+  MYSQL* sql = co_await pool->Acquire(ctx.cpu);
+  SqlConnectionRaii sql_guard(sql, pool);  // 协程结束时归还连接
+  assert(sql);
+  bool insert = false;
+  bool flag = CheckUser(
+      co_await SqlConnectionPool::Query(ctx, sql, SelectUserOrder(sql, name)),
+      pwd, is_login, &insert);
+  if (insert) {
+    SqlResult result = co_await SqlConnectionPool::Query(
+        ctx, sql, InsertUserOrder(sql, name, pwd));
+    flag = result.ok;
+  }
+  LOG_DEBUG("UserVerify success!!");
+  co_return flag;
 }
\ No newline at end of file
@@ -7,29 +7,55 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
-#include <regex>
+#include <string_view>
 #include <algorithm>
+#include <vector>
 // Other header
 #include "../log/log.h"
 #include "../pool/sql_connect_raii.h"
 #include "../pool/sql_connect_pool.h"
-#include "../buffer/buffer.h"
+#include "../buffer/buffer_chain.h"
+#include "http_parser.h"
+#include "encoded_cache.h"
 
 class HttpRequest {
  public:
   HttpRequest();
   ~HttpRequest() = default;
 
+  // HTTP请求处理结果
+  enum HttpCode {
+    NO_REQUEST,          // 请求不完整
+    GET_REQUEST,         // 获得了完整的请求
+    BAD_REQUEST,         // 请求报文有误
+    NO_RESOURSE,
+    FORBIDDENT_REQUEST,
+    FILE_REQUEST,
+    INTERNAL_ERROR,      // 服务器内部错误
+    CLOSED_CONNECTION,
+  };
+
   void Init();
-  // 读缓冲池中的内容并解析
-  bool Parse(Buffer* buff);
+  // 读缓冲池中的内容并解析。请求不完整时返回NO_REQUEST，缓冲池不变，
+  // 解析进度保留下来，收到更多数据后再次调用会接着解析。
+  // 完整的请求(包括Content-Length长度的请求体)从缓冲池中取出后返回GET_REQUEST，
+  // 上一个请求完成后再调用则开始解析下一个请求。
+  // defer_verify: 登录/注册请求不在解析时查询数据库，只记下来，
+  //               由调用方在协程中co_await VerifyAsync()完成
+  HttpCode Parse(BufferChain* buff, bool defer_verify = false);
+  // 请求是否还需要VerifyAsync()查询数据库才能决定应答的页面
+  inline bool IsVerifyPending() const { return verify_pending_; }
+  // 查询数据库验证用户名和密码，按结果改写path_。等待数据库连接和查询时
+  // 协程挂起，不占用线程。协程中访问的是本对象，完成之前它必须一直有效
+  Async<void> VerifyAsync(AsyncContext ctx);
 
-  inline bool IsKeepAlive() const {
-    if(header_.count("Connection") == 1) {
-      return header_.at("Connection") == "keep-alive" && version_ == "1.1";
-    }
-    return false;
-  }
+  inline bool IsKeepAlive() const { return keep_alive_; }
+  // 取值函数，Parse返回BAD_REQUEST时应答的状态码(400, 405, 413, 414)
+  inline int get_error_code() const { return error_code_; }
+
+  static const size_t MAX_URI_LEN = 8 << 10;      // URL的长度上限
+  static const size_t MAX_HEAD_LEN = 16 << 10;    // 请求行和请求头的长度上限
+  static const size_t MAX_CONTENT_LEN = 1 << 20;  // 请求体的长度上限
 
   // 取值函数，获取path_的值
   inline std::string get_path() const {
@@ -39,16 +65,38 @@ class HttpRequest {
     return path_;
   }
 
-  // 取值函数，获取method_的值
-  inline std::string get_method() const {
-    return method_;
+  // 取值函数，获取请求方法，指向读缓冲池，请求被取出前有效
+  inline std::string_view get_method() const {
+    return parser_.get_method();
+  }
+
+  // 取值函数，获取HTTP版本，指向读缓冲池，请求被取出前有效
+  inline std::string_view get_version() const {
+    return parser_.get_version();
   }
 
-  // 取值函数，获取version_的值
-  inline std::string get_version() const {
-    return version_;
+  // 按名字查找请求头，不区分大小写，结果指向读缓冲池
+  inline std::string_view GetHeader(std::string_view name) const {
+    return parser_.GetHeader(name);
   }
 
+  // 取值函数，Range请求的区间，没有Range或者Range无效时为空
+  inline const std::vector<ByteRange>& get_ranges() const { return ranges_; }
+  // 取值函数，If-Range的值(ETag或者HTTP日期)，没有时为空
+  inline const std::string& get_if_range() const { return if_range_; }
+  // 取值函数，If-None-Match的值(ETag列表或*)，没有时为空
+  inline const std::string& get_if_none_match() const {
+    return if_none_match_;
+  }
+  // 取值函数，If-Modified-Since的值(HTTP日期)，没有时为空
+  inline const std::string& get_if_modified_since() const {
+    return if_modified_since_;
+  }
+  // 取值函数，Accept-Encoding中可以接受的编码，ContentEncoding的组合
+  inline int get_accept_encoding() const { return accept_encoding_; }
+  // 是否为HEAD请求，只返回响应头
+  inline bool IsHead() const { return is_head_; }
+
   // 取请求参数中的某个参数的对应值，const修饰的参数只能用at取值
   inline std::string GetPost(const std::string& key) const {
     assert(key != "");
@@ -69,27 +117,23 @@ class HttpRequest {
     REQUEST_FINISH,  // 请求结束
   };
 
-  // HTTP请求处理结果，没有用到
-  enum HttpCode {
-    NO_REQUEST,          // 请求不完整
-    GET_REQUEST,         // 获得了完整的请求
-    BAD_REQUEST,         // 请求报文有误
-    NO_RESOURSE,
-    FORBIDDENT_REQUEST,
-    FILE_REQUEST,
-    INTERNAL_ERROR,      // 服务器内部错误
-    CLOSED_CONNECTION,
-  };
-
  private:
-  // 解析请求行
-  bool ParseRequestLine(const std::string& line);
-  // 解析请求头
-  void ParseRequestHeader(const std::string& line);
+  // 请求有误，记录状态码并结束这个请求，返回BAD_REQUEST
+  HttpCode Fail(int code);
+  // 解析请求行和请求头。请求跨过了缓冲区块的边界时把它拷贝到连续的内存中
+  HttpParser::Result ParseHead(BufferChain* buff);
   // 解析请求体
-  void ParseRequestContent(const std::string& line);
+  void ParseRequestContent(const char* begin, size_t len);
   // 解析请求URL
   void ParsePath();
+  // 解析Range和If-Range请求头
+  void ParseRange();
+  // 解析条件请求的If-None-Match和If-Modified-Since请求头
+  void ParseValidators();
+  // 解析Accept-Encoding请求头
+  void ParseAcceptEncoding();
+  // 根据协议版本和Connection请求头决定是否保持连接
+  void ParseConnection();
   // 解析POST请求，必须满足Content-Type = application/x-www-form-urlencoded
   void ParsePost();
   // 获取请求参数，以K-V形式放入post_中
@@ -97,20 +141,45 @@ class HttpRequest {
   // 验证用户名，密码，登录/注册
   static bool UserVerify(const std::string& name, const std::string& pwd,
                          bool is_login);
+  // UserVerify的协程版本，参数按值传递，挂起期间一直有效
+  static Async<bool> UserVerifyAsync(std::string name, std::string pwd,
+                                     bool is_login, AsyncContext ctx);
+  // 以下是两个版本共用的部分，它们只在是否挂起等待连接和查询上不同。
+  // 生成查询用户和插入用户的语句，值都经过转义
+  static std::string SelectUserOrder(MYSQL* sql, const std::string& name);
+  static std::string InsertUserOrder(MYSQL* sql, const std::string& name,
+                                     const std::string& pwd);
+  // 根据查询用户的结果判断：登录时密码是否正确；注册时用户名没有被占用
+  // 则把*insert设为true，由调用方插入用户，插入成功才算注册成功
+  static bool CheckUser(const SqlResult& result, const std::string& pwd,
+                        bool is_login, bool* insert);
+  // 转义字符串中的引号、反斜杠等，用于拼接到SQL语句的引号中
+  static std::string EscapeSql(MYSQL* sql, const std::string& value);
   // convert %xy to integer
   inline int ConvertHexToInt(char x, char y) {
     int tmp_x = tolower(x) - 'a' + 10;
     int tmp_y = tolower(y) - 'a' + 10;
     return tmp_x * 16 + tmp_y;
   }
-  // 解析状态
+  // 解析状态，请求行和请求头内部的进度由parser_记录
   ParseState state_;
-  std::string method_;
+  // 请求行和请求头的解析器，解析结果指向读缓冲池
+  HttpParser parser_;
+  // 会被改写(补全.html，登录后跳转)，所以单独保存，复用容量不会反复分配
   std::string path_;
-  std::string version_;
+  size_t content_len_;  // Content-Length，没有时为0
   std::string content_;
-  // request header: field=value
-  std::unordered_map<std::string, std::string> header_;
+  bool keep_alive_;
+  bool is_head_;  // 方法指向读缓冲区，请求取出后就失效了，单独记下
+  int error_code_;
+  std::vector<ByteRange> ranges_;  // Range请求的区间
+  std::string if_range_;
+  std::string if_none_match_;
+  std::string if_modified_since_;
+  int accept_encoding_;
+  bool defer_verify_;   // 本次Parse是否推迟登录/注册的验证
+  bool verify_pending_;  // 有推迟的验证还没有完成
+  bool verify_login_;    // 推迟的验证是登录还是注册
   // request params: key=value
   std::unordered_map<std::string, std::string> post_;
   // 默认页面
@@ -1,84 +1,271 @@
 #include "http_response.h"
 
-using namespace std;
+#include <time.h>  // strptime(), timegm()
+#include <stdio.h>  // snprintf()
 
-const unordered_map<string, string> HttpResponse::suffix_type_ = { 
-    { ".html",  "text/html" },
-    { ".xml",   "text/xml" },
-    { ".xhtml", "application/xhtml+xml" },
-    { ".txt",   "text/plain" },
-    { ".rtf",   "application/rtf" },
-    { ".pdf",   "application/pdf" },
-    { ".word",  "application/nsword" },
-    { ".png",   "image/png" },
-    { ".gif",   "image/gif" },
-    { ".jpg",   "image/jpeg" },
-    { ".jpeg",  "image/jpeg" },
-    { ".au",    "audio/basic" },
-    { ".mpeg",  "video/mpeg" },
-    { ".mpg",   "video/mpeg" },
-    { ".avi",   "video/x-msvideo" },
-    { ".gz",    "application/x-gzip" },
-    { ".tar",   "application/x-tar" },
-    { ".css",   "text/css "},
-    { ".js",    "text/javascript "},
-};
+#include <atomic>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
 
 const unordered_map<int, string> HttpResponse::code_status_ = {
     { 200, "OK" },
+    { 206, "Partial Content" },
+    { 304, "Not Modified" },
     { 400, "Bad Request" },
     { 403, "Forbidden" },
     { 404, "Not Found" },
+    { 405, "Method Not Allowed" },
+    { 413, "Payload Too Large" },
+    { 414, "URI Too Long" },
+    { 416, "Range Not Satisfiable" },
+    { 500, "Internal Server Error" },
+    { 503, "Service Unavailable" },
 };
 
-const unordered_map<int, string> HttpResponse::code_path_ = {
-    { 400, "/400.html" },
-    { 403, "/403.html" },
-    { 404, "/404.html" },
-};
+unordered_map<int, HttpResponse::ErrorPage> HttpResponse::error_pages_;
 
-HttpResponse::HttpResponse() : code_(-1), path_(""), src_dir_(""),
-                               is_keep_alive_(false), mm_file_(nullptr),
-                               mm_file_stat_({0}) {};
+HttpResponse::HttpResponse() : code_(-1), is_keep_alive_(false), path_(""),
+                               src_dir_(""), file_size_(0), head_only_(false),
+                               accept_encoding_(0), vary_(false),
+                               part_mark_(0) {};
 
-HttpResponse::~HttpResponse() { UnmapFile(); }
+HttpResponse::~HttpResponse() { ResetFile(); }
 // 含参初始化函数
 void HttpResponse::Init(const string& src_dir, string& path, bool is_keep_alive, int code){
   assert(src_dir != "");
-  if(mm_file_) { UnmapFile(); }
+  ResetFile();
   code_ = code;
   is_keep_alive_ = is_keep_alive;
   path_ = path;
   src_dir_ = src_dir;
-  mm_file_ = nullptr; 
-  mm_file_stat_ = { 0 };
+  file_size_ = 0;
+  ranges_.clear();
+  if_range_.clear();
+  if_none_match_.clear();
+  if_modified_since_.clear();
+  head_only_ = false;
+  accept_encoding_ = 0;
+  vary_ = false;
+}
+
+void HttpResponse::SetRanges(const vector<ByteRange>& ranges,
+                             const string& if_range) {
+  ranges_ = ranges;
+  if_range_ = if_range;
 }
 
-void HttpResponse::MakeResponse(Buffer* buff) {
-  // 判断请求的资源文件
-  // stat获取文件的状态信息，并写入stat结构体变量中
-  // data方法将一个string变成c-string，以空字符结尾，c++11之后，c_str和data函数相同作用
-  if (stat((src_dir_ + path_).data(), &mm_file_stat_) < 0 || S_ISDIR(mm_file_stat_.st_mode)) {
-    code_ = 404;  // 路径为目录则404
-  } else if (!(mm_file_stat_.st_mode & S_IROTH)) {  // IR: 读权限, OTH: 其他用户
+void HttpResponse::SetValidators(const string& if_none_match,
+                                 const string& if_modified_since) {
+  if_none_match_ = if_none_match;
+  if_modified_since_ = if_modified_since;
+}
+
+void HttpResponse::MakeResponse(BufferChain* buff) {
+  parts_.clear();
+  part_mark_ = buff->ReadableBytes();
+  if (code_ >= 400) {  // 请求有误，不用再找文件
+    AddErrorPage(buff);
+    return;
+  }
+  // 判断请求的资源文件，有资源包时只在包内查找，
+  // 否则文件的打开、映射和状态信息都由文件缓存提供
+  AssetBundle* bundle = AssetBundle::Instance();
+  FileCache::Status status =
+      bundle->IsOpen() ? bundle->Find(path_, &file_)
+                       : FileCache::Instance()->Get(src_dir_ + path_, &file_);
+  if (status == FileCache::NOT_FOUND) {
+    code_ = 404;  // 不存在或路径为目录则404
+  } else if (status == FileCache::FORBIDDEN) {
     code_ = 403;  // 不具有读权限
+  } else if (status == FileCache::LOAD_FAILED) {
+    code_ = 500;
   } else if(code_ == -1) { 
     code_ = 200; 
   }
-  ErrorHtml();
+  if (code_ >= 400) {
+    AddErrorPage(buff);
+    return;
+  }
+  // 换成客户端可以接受的压缩版本，之后的验证和Range都针对这个版本
+  if (code_ == 200 && file_) {
+    shared_ptr<const CachedFile> variant;
+    vary_ = EncodedCache::Instance()->Get(file_, accept_encoding_, &variant);
+    if (variant) file_ = std::move(variant);
+  }
+  // 条件请求先于Range判断，文件没变就不用再发送任何内容
+  if (code_ == 200 && file_ && NotModified()) code_ = 304;
+  ResolveRanges();
+  if (code_ == 416) {
+    AddErrorPage(buff);
+    return;
+  }
+  if (code_ == 200 || code_ == 304) {
+    // 最常见的两种响应，响应头只和文件、状态码、长连接、Vary有关，
+    // 直接拷贝文件上缓存的响应头，再改掉Date
+    AddCachedHeader(buff);
+    AddPart(buff, 0, code_ == 200 && !head_only_ ? file_->size : 0);
+    return;
+  }
   AddStateLine(buff);
   AddHeader(buff);
   AddContent(buff);
 }
 
-void HttpResponse::ErrorHtml() {
-  if (code_path_.count(code_)) {
-    path_ = code_path_.at(code_);
-    stat((src_dir_ + path_).data(), &mm_file_stat_);
+const char* HttpResponse::CurrentDate() {
+  // 每个线程各自缓存，秒数变化时才重新格式化，不需要同步
+  thread_local time_t last = 0;
+  thread_local char date[32];
+  time_t now = time(nullptr);
+  if (now != last) {
+    last = now;
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  }
+  return date;
+}
+
+int HttpResponse::HeaderSlot() const {
+  return (code_ == 304 ? 4 : 0) | (is_keep_alive_ ? 2 : 0) | (vary_ ? 1 : 0);
+}
+
+void HttpResponse::AddCachedHeader(BufferChain* buff) {
+  atomic<const SerializedHeader*>& cached = file_->headers[HeaderSlot()];
+  const SerializedHeader* header = cached.load(memory_order_acquire);
+  if (header == nullptr) {
+    // 第一次用到，生成后发布出去。多个线程同时生成时只保留先放入的
+    BufferChain tmp;
+    AddStateLine(&tmp);
+    AddHeader(&tmp);
+    AddFileHeaderEnd(&tmp);
+    SerializedHeader* built = new SerializedHeader;
+    built->text = tmp.RetrieveAllToStr();
+    built->date_pos = built->text.find("Date: ") + 6;
+    const SerializedHeader* expected = nullptr;
+    if (cached.compare_exchange_strong(expected, built,
+                                       memory_order_acq_rel)) {
+      header = built;
+    } else {
+      delete built;
+      header = expected;
+    }
+  }
+  AppendSerialized(buff, *header);
+}
+
+void HttpResponse::AppendSerialized(BufferChain* buff,
+                                    const SerializedHeader& header) {
+  // 分三段追加，缓冲区不连续时也不用回头改写
+  const string& text = header.text;
+  const size_t date_end = header.date_pos + DATE_LEN;
+  buff->Append(text.data(), header.date_pos);
+  buff->Append(CurrentDate(), DATE_LEN);
+  buff->Append(text.data() + date_end, text.size() - date_end);
+}
+
+bool HttpResponse::NotModified() const {
+  // 两个都有时以If-None-Match为准
+  if (!if_none_match_.empty()) return EtagMatches(if_none_match_, file_->etag);
+  if (if_modified_since_.empty()) return false;
+  time_t since;
+  if (!ParseHttpDate(if_modified_since_, &since)) return false;
+  return file_->st.st_mtime <= since;
+}
+
+bool HttpResponse::EtagMatches(string_view list, const string& etag) {
+  // eg: "abc", W/"def" 或者 *
+  while (!list.empty()) {
+    size_t comma = list.find(',');
+    string_view tag = list.substr(0, comma);
+    list.remove_prefix(comma == string_view::npos ? list.size() : comma + 1);
+    while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+      tag.remove_prefix(1);
+    }
+    while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+      tag.remove_suffix(1);
+    }
+    if (tag == "*") return true;
+    if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);  // 弱比较忽略W/
+    if (tag == etag) return true;
   }
+  return false;
 }
 
-void HttpResponse::AddStateLine(Buffer* buff) {
+bool HttpResponse::ParseHttpDate(const string& date, time_t* t) {
+  struct tm tm = {};
+  const char* end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == nullptr || *end != '\0') return false;
+  *t = timegm(&tm);
+  return true;
+}
+
+void HttpResponse::ResolveRanges() {
+  if (code_ != 200 || !file_ || ranges_.empty()) {
+    ranges_.clear();
+    return;
+  }
+  if (!IfRangeMatches()) {  // 文件已经变了，客户端拿到的片段不能拼接
+    ranges_.clear();
+    return;
+  }
+  // 换算成文件中的闭区间，丢掉不可满足的区间
+  const int64_t size = file_->size;
+  size_t n = 0;
+  for (const ByteRange& range : ranges_) {
+    ByteRange resolved;
+    if (range.first < 0) {  // 最后last个字节
+      if (range.last == 0) continue;
+      resolved.first = range.last < size ? size - range.last : 0;
+      resolved.last = size - 1;
+    } else {
+      resolved.first = range.first;
+      resolved.last = range.last < 0 || range.last >= size ? size - 1
+                                                            : range.last;
+    }
+    if (resolved.first >= size) continue;
+    ranges_[n++] = resolved;
+  }
+  ranges_.resize(n);
+  if (ranges_.empty()) {
+    // 没有一个区间可以满足，只返回文件长度
+    code_ = 416;
+    file_size_ = size;
+    file_.reset();
+    return;
+  }
+  code_ = 206;
+  if (ranges_.size() > 1) {
+    // 分隔符只要不出现在文件内容中，用递增的序号即可
+    static atomic<unsigned long long> boundary_seq(0);
+    boundary_ = "webserver_byteranges_" + to_string(++boundary_seq);
+  }
+}
+
+bool HttpResponse::IfRangeMatches() const {
+  if (if_range_.empty()) return true;
+  // 实体标签要求强比较，弱标签(W/)一律不一致
+  if (if_range_[0] == '"') return if_range_ == file_->etag;
+  if (if_range_.compare(0, 2, "W/") == 0) return false;
+  // HTTP日期，和文件的修改时间完全相同才算一致
+  time_t t;
+  return ParseHttpDate(if_range_, &t) && t == file_->st.st_mtime;
+}
+
+void HttpResponse::AddPart(BufferChain* buff, size_t offset, size_t len) {
+  parts_.push_back({buff->ReadableBytes() - part_mark_, offset, len});
+  part_mark_ = buff->ReadableBytes();
+}
+
+string HttpResponse::PartHead(const ByteRange& range) const {
+  return "\r\n--" + boundary_ + "\r\nContent-type: " +
+         file_->content_type + "\r\nContent-Range: bytes " +
+         to_string(range.first) + "-" + to_string(range.last) + "/" +
+         to_string(file_->size) + "\r\n\r\n";
+}
+
+void HttpResponse::AddStateLine(BufferChain* buff) {
   // 状态码存在，查找返回；不存在，一律按400返回
   if (code_status_.count(code_) == 0) code_ = 400;  // 400 : bad_request
   auto status = code_status_.at(code_);
@@ -86,67 +273,149 @@ void HttpResponse::AddStateLine(Buffer* buff) {
   buff->Append("HTTP/1.1 " + to_string(code_) + " " + status + "\r\n");
 }
 
-void HttpResponse::AddHeader(Buffer* buff) {
-  buff->Append("Connection: ");
+void HttpResponse::AddHeader(BufferChain* buff) {
+  buff->Append("Date: ");
+  buff->Append(CurrentDate(), DATE_LEN);
+  buff->Append("\r\nConnection: ");
   if (is_keep_alive_) {
     buff->Append("keep-alive\r\n");
     buff->Append("keep-alive: max=6, timeout=120\r\n");
   } else buff->Append("close\r\n");
-  buff->Append("Content-type: " + GetFileType() + "\r\n");
+  if (code_ == 206 && ranges_.size() > 1) {
+    buff->Append("Content-type: multipart/byteranges; boundary=" + boundary_ +
+                 "\r\n");
+  } else if (code_ != 304) {
+    buff->Append(string("Content-type: ") + GetFileType() + "\r\n");
+  }
+  // 验证和缓存用的响应头，错误页不需要
+  if (file_ && (code_ == 200 || code_ == 206 || code_ == 304)) {
+    buff->Append("ETag: " + file_->etag + "\r\nLast-Modified: " +
+                 file_->last_modified + "\r\n");
+    if (!file_->cache_control.empty()) {
+      buff->Append("Cache-Control: " + file_->cache_control + "\r\n");
+    }
+    if (!file_->content_encoding.empty()) {
+      buff->Append("Content-Encoding: " + file_->content_encoding + "\r\n");
+    }
+    if (vary_) buff->Append("Vary: Accept-Encoding\r\n");
+  }
 }
 
-void HttpResponse::AddContent(Buffer* buff) {
-  // 只读方式打开文件
-  int src_fd = open((src_dir_ + path_).data(), O_RDONLY);
-  if (src_fd < 0) { 
-    ErrorContent(buff, "File NotFound!");
-    return; 
+void HttpResponse::AddFileHeaderEnd(BufferChain* buff) {
+  if (code_ == 304) {  // 没有响应体
+    buff->Append("\r\n");
+    return;
   }
-  LOG_DEBUG("file path %s", (src_dir_ + path_).data());
-  // 将文件映射到内存提高文件的访问速度 MAP_PRIVATE 建立一个写入时拷贝的私有映射
-  // mmap在进程的地址空间和流文件之间建立映射关系
-  // params: addr, len, protection, flags, fd, offset
-  // 从返回地址开始，长度为len的地址空间被映射到一个流文件，该文件从off开始，长度为len字节
-  int* mmRet = static_cast<int*>(mmap(0, mm_file_stat_.st_size, PROT_READ,
-                                      MAP_PRIVATE, src_fd, 0));
-  if (*mmRet == -1) {  // 映射文件失败
-    ErrorContent(buff, "File NotFound!");
-    return; 
-  }
-  mm_file_ = (char*)mmRet;  // 映射的地址保存起来
-  close(src_fd);
-  // 写入缓存
-  buff->Append("Content-length: " + to_string(mm_file_stat_.st_size) + "\r\n\r\n");
+  buff->Append("Accept-Ranges: bytes\r\nContent-length: " +
+               to_string(file_->size) + "\r\n\r\n");
 }
 
-void HttpResponse::UnmapFile() {
-  if (mm_file_) {
-    munmap(mm_file_, mm_file_stat_.st_size);  // 结束映射
-    mm_file_ = nullptr;
+void HttpResponse::AddContent(BufferChain* buff) {
+  LOG_DEBUG("file path %s", file_->path.c_str());
+  // 文件内容由连接直接从缓存的映射(或者fd)中发送，这里只写入响应头，
+  // 并记录每一部分响应头后面要发送的文件区间
+  buff->Append("Accept-Ranges: bytes\r\n");
+  if (ranges_.size() == 1) {
+    const ByteRange& range = ranges_[0];
+    const size_t len = range.last - range.first + 1;
+    buff->Append("Content-Range: bytes " + to_string(range.first) + "-" +
+                 to_string(range.last) + "/" + to_string(file_->size) +
+                 "\r\nContent-length: " + to_string(len) + "\r\n\r\n");
+    AddPart(buff, range.first, head_only_ ? 0 : len);
+  } else {
+    // multipart/byteranges: 每个区间前面有自己的分隔头，最后是结束分隔符
+    const string tail = "\r\n--" + boundary_ + "--\r\n";
+    size_t content_len = tail.size();
+    for (const ByteRange& range : ranges_) {
+      content_len += PartHead(range).size() + (range.last - range.first + 1);
+    }
+    buff->Append("Content-length: " + to_string(content_len) + "\r\n\r\n");
+    for (const ByteRange& range : ranges_) {
+      buff->Append(PartHead(range));
+      AddPart(buff, range.first, range.last - range.first + 1);
+    }
+    buff->Append(tail);
+    AddPart(buff, 0, 0);
   }
 }
 
-string HttpResponse::GetFileType() {
-  string::size_type idx = path_.find_last_of('.');
-  if (idx == string::npos) return "text/plain";  // 没有后缀名
-  auto suffix = path_.substr(idx);  // ".xxx"
-  if (suffix_type_.count(suffix) == 1) return suffix_type_.at(suffix);
-  return "text/plain";  // 后缀名不是已知的类型
+void HttpResponse::ResetFile() {
+  file_.reset();
 }
 
-void HttpResponse::ErrorContent(Buffer* buff, string message) {
-  // 如果有未定义的状态码，按 (400:bad_request) 处理
-  if (code_status_.count(code_) == 0) code_ = 400; 
-  string status = code_status_.at(code_);
-  string body = "";
+shared_ptr<const CachedFile> HttpResponse::ReleaseFile() {
+  return std::move(file_);
+}
 
-  body += "<html><title>Error</title>";
-  body += "<body bgcolor=\"ffffff\">";
+const char* HttpResponse::GetFileType() const {
+  if (file_) return file_->content_type.c_str();
+  return "text/html";
+}
 
-  body += to_string(code_) + " : " + status  + "\n";
-  body += "<p>" + message + "</p>";
-  body += "<hr><em>TinyWebServer</em></body></html>";
+void HttpResponse::AddErrorPage(BufferChain* buff) {
+  file_.reset();
+  if (code_ == 416) {
+    char range[64];
+    snprintf(range, sizeof(range), "Content-Range: bytes */%zu\r\n",
+             file_size_);
+    AppendErrorPage(buff, code_, is_keep_alive_, head_only_, range);
+  } else {
+    AppendErrorPage(buff, code_, is_keep_alive_, head_only_);
+  }
+  AddPart(buff, 0, 0);
+}
+
+void HttpResponse::AppendErrorPage(BufferChain* buff, int code, bool keep_alive,
+                                   bool head_only, const char* extra_header) {
+  auto it = error_pages_.find(code);
+  if (it == error_pages_.end()) it = error_pages_.find(400);
+  assert(it != error_pages_.end());  // 需要先调用LoadErrorPages
+  const ErrorPage& page = it->second;
+  AppendSerialized(buff, page.head[keep_alive ? 1 : 0]);
+  if (extra_header) buff->Append(extra_header, strlen(extra_header));
+  buff->Append("\r\n", 2);
+  if (!head_only) buff->Append(page.body);
+}
 
-  buff->Append("Content-length: " + to_string(body.size()) + "\r\n\r\n");
-  buff->Append(body);
-}
\ No newline at end of file
+void HttpResponse::LoadErrorPages(const string& src_dir) {
+  error_pages_.clear();
+  for (const auto& item : code_status_) {
+    const int code = item.first;
+    const string& status = item.second;
+    if (code < 400) continue;
+    ErrorPage& page = error_pages_[code];
+    // 优先使用资源包或资源目录下的页面，eg: 404.html
+    const string name = "/" + to_string(code) + ".html";
+    shared_ptr<const CachedFile> packed;
+    ifstream file;
+    if (AssetBundle::Instance()->IsOpen()) {
+      AssetBundle::Instance()->Find(name, &packed);
+    } else {
+      file.open(src_dir + name, ios::binary);
+    }
+    if (packed) {
+      page.body.assign(packed->data ? packed->data : "", packed->size);
+    } else if (file.is_open()) {
+      ostringstream content;
+      content << file.rdbuf();
+      page.body = content.str();
+    } else {
+      page.body = "<html><title>Error</title><body bgcolor=\"ffffff\">" +
+                  to_string(code) + " : " + status + "\n<p>" + status +
+                  "</p><hr><em>TinyWebServer</em></body></html>";
+    }
+    for (int keep_alive = 0; keep_alive < 2; ++keep_alive) {
+      string& text = page.head[keep_alive].text;
+      text = "HTTP/1.1 " + to_string(code) + " " + status + "\r\nDate: ";
+      page.head[keep_alive].date_pos = text.size();
+      text.append(CurrentDate(), DATE_LEN);
+      text += keep_alive ? "\r\nConnection: keep-alive\r\n"
+                           "keep-alive: max=6, timeout=120\r\n"
+                         : "\r\nConnection: close\r\n";
+      if (code == 405) text += "Allow: GET, HEAD, POST\r\n";
+      if (code == 503) text += "Retry-After: 1\r\n";
+      text += "Content-type: text/html\r\nContent-length: " +
+              to_string(page.body.size()) + "\r\n";
+    }
+  }
+}
@@ -1,60 +1,137 @@
 #ifndef WEBSERVER_HTTP_HTTP_RESPONSE_H_
 #define WEBSERVER_HTTP_HTTP_RESPONSE_H_
 
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
+#include <time.h>
 
+#include <memory>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
-#include "../buffer/buffer.h"
+#include "../buffer/buffer_chain.h"
 #include "../log/log.h"
+#include "asset_bundle.h"
+#include "file_cache.h"
+#include "encoded_cache.h"
+#include "http_parser.h"
 
 class HttpResponse {
  public:
+  // 响应报文由若干部分依次组成：先是写入缓冲池的head_len字节
+  // (状态行和响应头、错误页或multipart的分隔头)，然后是文件中
+  // [offset, offset+len)的内容，len为0时没有文件内容
+  struct BodyPart {
+    size_t head_len;
+    size_t offset;
+    size_t len;
+  };
+
   HttpResponse();
   ~HttpResponse();
 
   void Init(const std::string& srcDir, std::string& path,
             bool isKeepAlive = false, int code = -1);
+  // 设置请求的Range和If-Range，在Init之后、MakeResponse之前调用
+  void SetRanges(const std::vector<ByteRange>& ranges,
+                 const std::string& if_range);
+  // 设置条件请求的If-None-Match和If-Modified-Since，文件没有变化时返回304
+  void SetValidators(const std::string& if_none_match,
+                     const std::string& if_modified_since);
+  // 设置客户端可以接受的内容编码，有压缩版本时发送压缩版本
+  inline void SetAcceptEncoding(int accept) { accept_encoding_ = accept; }
+  // HEAD请求只发送响应头，Content-length仍然是完整响应的长度
+  inline void SetHeadOnly(bool head_only) { head_only_ = head_only; }
   // 组建报文响应请求
-  void MakeResponse(Buffer* buff);
-  // 结束内存映射，释放资源
-  void UnmapFile();
-  // 构建错误提示消息，写入缓冲池
-  void ErrorContent(Buffer* buff, std::string message);
-  // 获取文件的长度，用于mmap
-  inline size_t FileLen() const { return mm_file_stat_.st_size; }
+  void MakeResponse(BufferChain* buff);
+  // 释放对文件的引用
+  void ResetFile();
+  // 交出响应文件的引用，由调用者保证发送期间文件内容有效，没有文件时为空
+  std::shared_ptr<const CachedFile> ReleaseFile();
+  // 获取文件的长度
+  inline size_t FileLen() const { return file_ ? file_->size : 0; }
   // 取值函数，获取code_
   inline int get_code() const { return code_; }
-  // 取值函数，获取mm_file_
-  inline char* get_mm_file() { return mm_file_; }
+  // 取值函数，获取file_
+  inline const CachedFile* get_file() const { return file_.get(); }
+  // 取值函数，最近一次MakeResponse生成的各个部分
+  inline const std::vector<BodyPart>& get_parts() const { return parts_; }
+
+  // 启动时生成所有错误响应，页面优先使用src_dir下的<code>.html，
+  // 没有时用内置的页面。之后错误响应只需要拷贝，不会读文件或分配内存
+  static void LoadErrorPages(const std::string& src_dir);
+  // 把code对应的错误响应写入缓冲池，extra_header为额外的响应头(以CRLF结尾)。
+  // 不认识的状态码按400处理
+  static void AppendErrorPage(BufferChain* buff, int code, bool keep_alive,
+                              bool head_only,
+                              const char* extra_header = nullptr);
 
  private:
   // 将响应消息中的状态行写入到缓冲池中
-  void AddStateLine(Buffer* buff);
+  void AddStateLine(BufferChain* buff);
   // 将响应消息中的头部字段写入缓冲池中
-  void AddHeader(Buffer* buff);
-  // 将响应消息中的消息体写入缓冲池中
-  void AddContent(Buffer* buff);
-  // 若返回码为400，403，404其中之一，则将对应的文件路径与信息读取到对应的变量中
-  void ErrorHtml();
+  void AddHeader(BufferChain* buff);
+  // 将206响应中的Content-Range等和multipart的分隔头写入缓冲池中
+  void AddContent(BufferChain* buff);
+  // 写入code_对应的错误响应
+  void AddErrorPage(BufferChain* buff);
+  // 200和304响应头的最后几行(Content-length等)，写入缓冲池中
+  void AddFileHeaderEnd(BufferChain* buff);
+  // 写入文件上缓存的200/304响应头，第一次用到时生成
+  void AddCachedHeader(BufferChain* buff);
+  // 写入预先生成的响应头，Date的值换成当前时间
+  static void AppendSerialized(BufferChain* buff,
+                               const SerializedHeader& header);
+  // 缓存的响应头在CachedFile::headers中的下标
+  int HeaderSlot() const;
+  // 当前时间的HTTP日期，每秒更新一次
+  static const char* CurrentDate();
+  static const size_t DATE_LEN = 29;  // eg: Sun, 06 Nov 1994 08:49:37 GMT
   // 获取文件对应的返回类型
-  std::string GetFileType();
+  const char* GetFileType() const;
+  // 客户端缓存的文件是否还是最新的，是则返回304
+  bool NotModified() const;
+  // If-None-Match中是否有和etag相同的标签(弱比较)
+  static bool EtagMatches(std::string_view list, const std::string& etag);
+  // 解析HTTP日期，格式不对时返回false
+  static bool ParseHttpDate(const std::string& date, time_t* t);
+  // 把Range换算成文件中的区间，决定返回200、206还是416
+  void ResolveRanges();
+  // If-Range和文件是否一致，不一致时要返回整个文件
+  bool IfRangeMatches() const;
+  // 写完一部分响应头后调用，记录它后面跟着的文件区间
+  void AddPart(BufferChain* buff, size_t offset, size_t len);
+  // multipart/byteranges中每个区间前面的分隔头
+  std::string PartHead(const ByteRange& range) const;
 
   int code_;             // 状态码
   bool is_keep_alive_;   // 是否长连接
   std::string path_;     // 响应文件路径
   std::string src_dir_;  // 文件目录
-  char* mm_file_;             // mmap映射文件所在地址
-  struct stat mm_file_stat_;  // 路径为 src_dir_+path_ 的文件的状态信息
-  // 不同文件后缀对应的返回类型
-  static const std::unordered_map<std::string, std::string> suffix_type_;
+  // 路径为 src_dir_+path_ 的文件，来自文件缓存，不存在时为空
+  std::shared_ptr<const CachedFile> file_;
+  size_t file_size_;  // 416时文件已经释放，Content-Range还要用到长度
+  // 请求的区间，ResolveRanges后为文件中的闭区间[first, last]
+  std::vector<ByteRange> ranges_;
+  std::string if_range_;
+  std::string if_none_match_;
+  std::string if_modified_since_;
+  bool head_only_;
+  int accept_encoding_;
+  bool vary_;  // 文件有压缩版本，响应随Accept-Encoding变化
+  std::string boundary_;  // 多个区间时multipart的分隔符
+  std::vector<BodyPart> parts_;
+  size_t part_mark_;  // 缓冲池中已经记录到parts_的位置
   // http响应编码对应的解释
   static const std::unordered_map<int, std::string> code_status_;
-  // http错误编码对应的页面
-  static const std::unordered_map<int, std::string> code_path_;
+  // 启动时生成的错误响应，之后只读
+  struct ErrorPage {
+    // 状态行到Content-length为止的响应头，不含结尾的空行。
+    // 下标0为Connection: close，1为keep-alive
+    SerializedHeader head[2];
+    std::string body;
+  };
+  // 所有错误状态码对应的响应
+  static std::unordered_map<int, ErrorPage> error_pages_;
 };
 
 #endif  // WEBSERVER_HTTP_HTTP_RESPONSE_H_
\ No newline at end of file
@@ -0,0 +1,207 @@
+// by zxg
+//
+#include "http_scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// RFC 7230 tchar: 方法名和请求头字段名允许的字符
+// 数字、字母和 !#$%&'*+-.^_`|~
+const bool HttpScan::kTokenChars[256] = {
+    // 0x00 - 0x1f 控制字符
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    // 0x20 - 0x3f:  !"#$%&'()*+,-./0123456789:;<=>?
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    // 0x40 - 0x5f: @ABCDEFGHIJKLMNOPQRSTUVWXYZ[\]^_
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    // 0x60 - 0x7f: `abcdefghijklmnopqrstuvwxyz{|}~ DEL
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+    // 0x80 - 0xff 非ASCII字符
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+namespace {
+
+inline bool IsPathEnd(unsigned char c) { return c <= 0x20 || c == 0x7f; }
+
+inline bool IsValueEnd(unsigned char c) {
+  return c < 0x20 ? c != '\t' : c == 0x7f;
+}
+
+// ---------- 标量实现，也用来处理SIMD剩下的不足一个向量的尾部 ----------
+
+const char* FindNonTokenScalar(const char* p, const char* end) {
+  while (p != end && HttpScan::IsTokenChar(*p)) ++p;
+  return p;
+}
+
+const char* FindPathEndScalar(const char* p, const char* end) {
+  while (p != end && !IsPathEnd(*p)) ++p;
+  return p;
+}
+
+const char* FindValueEndScalar(const char* p, const char* end) {
+  while (p != end && !IsValueEnd(*p)) ++p;
+  return p;
+}
+
+#ifdef HTTP_SCAN_X86
+
+// ---------- SSE4.2: pcmpestri按字节范围匹配，一次16字节 ----------
+
+// 范围表，每两个字节表示一个闭区间。pcmpestri最多支持8个区间
+// token的补集需要10个区间，这里把{|}~和0x7f-0xff合成一个区间，
+// 命中'|'和'~'时再用查表确认
+alignas(16) const char kNonTokenRanges[16] = {
+    '\x00', ' ', '"', '"', '(', ')', ',', ',',
+    '/', '/', ':', '@', '[', ']', '{', '\xff',
+};
+alignas(16) const char kPathEndRanges[16] = {'\x00', ' ', '\x7f', '\x7f'};
+alignas(16) const char kValueEndRanges[16] = {
+    '\x00', '\x08', '\x0a', '\x1f', '\x7f', '\x7f',
+};
+
+const int kRangeMode =
+    _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT;
+
+// 返回第一个落在ranges中的字节，ranges_len为区间表的有效字节数
+__attribute__((target("sse4.2"))) inline const char* FindRangesSse42(
+    const char* p, const char* end, const char* ranges, int ranges_len) {
+  const __m128i r = _mm_load_si128(reinterpret_cast<const __m128i*>(ranges));
+  for (; end - p >= 16; p += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    int idx = _mm_cmpestri(r, ranges_len, x, 16, kRangeMode);
+    if (idx != 16) return p + idx;
+  }
+  return p;
+}
+
+__attribute__((target("sse4.2"))) const char* FindNonTokenSse42(
+    const char* p, const char* end) {
+  for (;;) {
+    p = FindRangesSse42(p, end, kNonTokenRanges, 16);
+    if (end - p < 16) return FindNonTokenScalar(p, end);
+    if (!HttpScan::IsTokenChar(*p)) return p;
+    ++p;  // '|'或'~'，是token字符，继续
+  }
+}
+
+__attribute__((target("sse4.2"))) const char* FindPathEndSse42(
+    const char* p, const char* end) {
+  p = FindRangesSse42(p, end, kPathEndRanges, 4);
+  return end - p < 16 ? FindPathEndScalar(p, end) : p;
+}
+
+__attribute__((target("sse4.2"))) const char* FindValueEndSse42(
+    const char* p, const char* end) {
+  p = FindRangesSse42(p, end, kValueEndRanges, 6);
+  return end - p < 16 ? FindValueEndScalar(p, end) : p;
+}
+
+// ---------- AVX2: 比较 + movemask，一次32字节 ----------
+
+// token字符集的半字节位图：第lo项的第hi位表示字符(hi<<4|lo)是否为token。
+// 用低4位查表得到位图，高4位查表得到位掩码，两者相与为0的就不是token。
+// 高4位>=8(非ASCII)时掩码为0，自然判为非token
+alignas(16) uint8_t token_lo_bits[16];
+alignas(16) const uint8_t kHiBit[16] = {1,  2,  4,  8, 16, 32, 64, 128,
+                                        0,  0,  0,  0, 0,  0,  0,  0};
+
+void BuildTokenBitmap() {
+  for (int lo = 0; lo < 16; ++lo) {
+    uint8_t bits = 0;
+    for (int hi = 0; hi < 8; ++hi) {
+      if (HttpScan::IsTokenChar(static_cast<unsigned char>(hi << 4 | lo))) {
+        bits |= 1 << hi;
+      }
+    }
+    token_lo_bits[lo] = bits;
+  }
+}
+
+__attribute__((target("avx2"))) const char* FindNonTokenAvx2(const char* p,
+                                                              const char* end) {
+  const __m256i lo_tbl = _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(token_lo_bits)));
+  const __m256i hi_tbl = _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(kHiBit)));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  for (; end - p >= 32; p += 32) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const __m256i lo = _mm256_and_si256(x, nibble);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+    const __m256i hit = _mm256_and_si256(_mm256_shuffle_epi8(lo_tbl, lo),
+                                         _mm256_shuffle_epi8(hi_tbl, hi));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return FindNonTokenScalar(p, end);
+}
+
+__attribute__((target("avx2"))) const char* FindPathEndAvx2(const char* p,
+                                                             const char* end) {
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  for (; end - p >= 32; p += 32) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    // min(x, 0x20) == x 即 x <= 0x20(无符号)
+    const __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(x, space), x);
+    const __m256i hit = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(x, del));
+    uint32_t mask = _mm256_movemask_epi8(hit);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return FindPathEndScalar(p, end);
+}
+
+__attribute__((target("avx2"))) const char* FindValueEndAvx2(const char* p,
+                                                              const char* end) {
+  const __m256i us = _mm256_set1_epi8(0x1f);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  for (; end - p >= 32; p += 32) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(x, us), x);
+    const __m256i hit =
+        _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(x, tab), ctl),
+                        _mm256_cmpeq_epi8(x, del));
+    uint32_t mask = _mm256_movemask_epi8(hit);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return FindValueEndScalar(p, end);
+}
+
+#endif  // HTTP_SCAN_X86
+
+}  // namespace
+
+HttpScan::Kernels HttpScan::SelectKernels() {
+#ifdef HTTP_SCAN_X86
+  __builtin_cpu_init();  // 静态初始化阶段调用，需要先初始化CPU信息
+  if (__builtin_cpu_supports("avx2")) {
+    BuildTokenBitmap();
+    return {FindNonTokenAvx2, FindPathEndAvx2, FindValueEndAvx2, "avx2"};
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return {FindNonTokenSse42, FindPathEndSse42, FindValueEndSse42, "sse4.2"};
+  }
+#endif
+  return {FindNonTokenScalar, FindPathEndScalar, FindValueEndScalar, "scalar"};
+}
+
+const HttpScan::Kernels HttpScan::kernels_ = HttpScan::SelectKernels();
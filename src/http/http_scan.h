@@ -0,0 +1,48 @@
+// Vectorized delimiter scanning used by the request parser.
+// by zxg
+//
+#ifndef WEBSERVER_HTTP_HTTP_SCAN_H_
+#define WEBSERVER_HTTP_HTTP_SCAN_H_
+
+#include <stddef.h>
+
+// 解析请求时查找分隔符的扫描函数。
+// 每个函数返回[p, end)中第一个满足条件的位置，找不到时返回end。
+// x86上启动时按CPU支持情况选择AVX2或SSE4.2实现，一次比较32/16个字节，
+// 其他平台或者老CPU使用逐字节的标量实现，结果完全一致
+class HttpScan {
+ public:
+  // 第一个不是token字符(RFC 7230 tchar)的位置，
+  // 用于方法名后的空格和字段名后的':'
+  static const char* FindNonToken(const char* p, const char* end) {
+    return kernels_.find_non_token(p, end);
+  }
+  // 第一个空白或控制字符的位置，用于URL结尾的空格
+  static const char* FindPathEnd(const char* p, const char* end) {
+    return kernels_.find_path_end(p, end);
+  }
+  // 第一个除制表符外的控制字符的位置，用于字段值结尾的CR/LF
+  static const char* FindValueEnd(const char* p, const char* end) {
+    return kernels_.find_value_end(p, end);
+  }
+
+  static inline bool IsTokenChar(unsigned char c) { return kTokenChars[c]; }
+  // 当前使用的实现，eg: avx2, sse4.2, scalar
+  static const char* Name() { return kernels_.name; }
+
+ private:
+  typedef const char* (*ScanFunc)(const char*, const char*);
+  struct Kernels {
+    ScanFunc find_non_token;
+    ScanFunc find_path_end;
+    ScanFunc find_value_end;
+    const char* name;
+  };
+
+  static Kernels SelectKernels();
+
+  static const bool kTokenChars[256];
+  static const Kernels kernels_;
+};
+
+#endif  // WEBSERVER_HTTP_HTTP_SCAN_H_
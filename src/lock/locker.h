@@ -35,6 +35,11 @@ class SemaphoreWrapper {
     return sem_wait(&m_sem_) == 0;  // ret: 0 or -1
   }
 
+  bool TryWait() {
+    // 信号量值大于0时减1并返回true，为0时不阻塞，直接返回false
+    return sem_trywait(&m_sem_) == 0;
+  }
+
   bool Post() {
     // 信号量值加1，如果值大于0了，其他正在调用sem-wait等待的线程或进程将被唤醒
     return sem_post(&m_sem_) == 0;  // ret: 0 or -1
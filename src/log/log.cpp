@@ -123,6 +123,11 @@ void Log::Write(int level, const char *format, ...) {
     va_start(vaList, format);
     int m = vsnprintf(buff_.BeginWrite(), buff_.WriteableBytes(), format, vaList);
     va_end(vaList);
+    // 超长的日志会被截断，vsnprintf返回的是未截断时的长度
+    if (m < 0) m = 0;
+    if (static_cast<size_t>(m) >= buff_.WriteableBytes()) {
+      m = buff_.WriteableBytes() - 1;
+    }
 
     buff_.HasWritten(m);
     buff_.Append("\n\0", 2);
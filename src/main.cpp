@@ -10,15 +10,26 @@ int main(int argc, char* argv[]) {
   int port = 9000;
   int trig_mode = 3;  // ET
   int timeout = 60000;
+  int idle_timeout = 10000;  // 空闲连接释放处理状态的时间，毫秒
   bool linger = false;
   char* database = "webserver";
   int num_sql_conn = 9;
-  int num_threads = 6;
+  // 静态通道和数据库通道的线程数、弹性上限、自旋轮数和准入上限
+  LaneOptions static_lane;
+  LaneOptions db_lane;
+  db_lane.pool.num_threads = 0;  // 和数据库连接数相同
+  db_lane.pool.spin = 0;  // 数据库请求少，空闲时不自旋
+  int num_reactors = 1;  // 大于1时开启多reactor模式，每个线程一个事件循环
+  bool use_uring = false;  // 使用io_uring作为事件后端
+  bool inline_mode = false;  // 静态请求直接在事件循环线程上处理
+  bool coroutine_mode = false;  // 登录/注册请求用协程处理
+  AcceptOptions accept_options;  // 监听队列长度，TCP_DEFER_ACCEPT等
+  FileCacheOptions cache_options;  // 静态文件缓存
   bool log = true;
   int log_level = 1;
 
   int opt = 0;
-  while ((opt = getopt(argc, argv, "p:m:s:t:lo")) != -1) {
+  while ((opt = getopt(argc, argv, "p:m:s:t:T:y:j:q:Q:r:uiCb:a:d:f:c:xz:g:k:we:lo")) != -1) {
     switch (opt) {
       case 'p':  // port
         port = atoi(optarg);
@@ -30,7 +41,71 @@ int main(int argc, char* argv[]) {
         num_sql_conn = atoi(optarg);
         break;
       case 't':
-        num_threads = atoi(optarg);
+        static_lane.pool.num_threads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'T':  // 弹性线程池最多的线程数，大于-t时开启
+        static_lane.pool.max_threads = atoi(optarg) > 0 ? atoi(optarg) : 0;
+        break;
+      case 'y':  // 线程池找不到任务时自旋的轮数
+        static_lane.pool.spin = atoi(optarg);
+        break;
+      case 'j':  // 数据库通道的线程数
+        db_lane.pool.num_threads = atoi(optarg) > 0 ? atoi(optarg) : 0;
+        break;
+      case 'q':  // 数据库通道同时接纳的请求数
+        db_lane.limit = atoi(optarg);
+        break;
+      case 'Q':  // 静态通道同时接纳的任务数
+        static_lane.limit = atoi(optarg);
+        break;
+      case 'r':  // 事件循环数量
+        num_reactors = atoi(optarg);
+        if (num_reactors < 1) num_reactors = 1;
+        break;
+      case 'u':  // io_uring
+        use_uring = true;
+        break;
+      case 'i':  // 内联模式
+        inline_mode = true;
+        break;
+      case 'C':  // 协程模式，等数据库时不占用线程
+        coroutine_mode = true;
+        break;
+      case 'b':  // listen队列长度
+        accept_options.backlog = atoi(optarg);
+        break;
+      case 'a':  // 每次唤醒最多accept的连接数
+        accept_options.batch = atoi(optarg);
+        break;
+      case 'd':  // TCP_DEFER_ACCEPT秒数
+        accept_options.defer_accept = atoi(optarg);
+        break;
+      case 'f':  // TCP_FASTOPEN队列长度
+        accept_options.fastopen = atoi(optarg);
+        break;
+      case 'c':  // 文件缓存上限，MB，0表示不缓存
+        cache_options.budget = atoi(optarg) > 0 ?
+                               static_cast<size_t>(atoi(optarg)) << 20 : 0;
+        break;
+      case 'x':  // 同时未命中的请求各自加载文件
+        cache_options.collapse_misses = false;
+        break;
+      case 'z':  // 不小于这个大小(KB)的文件用sendfile发送，0表示所有文件
+        cache_options.sendfile_min = atoi(optarg) > 0 ?
+                                     static_cast<size_t>(atoi(optarg)) << 10 : 0;
+        break;
+      case 'g':  // 压缩版本缓存上限，MB，0表示不压缩
+        cache_options.encoded_budget = atoi(optarg) > 0 ?
+                                       static_cast<size_t>(atoi(optarg)) << 20 : 0;
+        break;
+      case 'k':  // 资源包文件
+        cache_options.bundle_path = optarg;
+        break;
+      case 'w':  // 不用inotify监视资源目录，定期stat检查文件
+        cache_options.watch = false;
+        break;
+      case 'e':  // 空闲释放时间，毫秒，0表示不释放
+        idle_timeout = atoi(optarg) > 0 ? atoi(optarg) : 0;
         break;
       case 'l':
         linger = true;
@@ -41,7 +116,19 @@ int main(int argc, char* argv[]) {
       case '?':
         printf("Invalid option -- '%c'.\n", (char)optopt);
         printf("Usage: ./bin/server [-p port] [-m trig_mode]"
-               " [-s num_sql_conn] [-t num_threads] [-l (turn on opt_linger)]"
+               " [-s num_sql_conn] [-t num_threads] [-T max_threads]"
+               " [-y pool_spin] [-j db_threads] [-q db_limit]"
+               " [-Q static_limit]"
+               " [-r num_reactors]"
+               " [-u (use io_uring)] [-i (inline static requests)]"
+               " [-C (coroutine db handlers)]"
+               " [-b backlog] [-a accept_batch]"
+               " [-d defer_accept_secs] [-f fastopen_qlen]"
+               " [-c file_cache_mb] [-x (don't collapse cache misses)]"
+               " [-z sendfile_min_kb] [-g compressed_cache_mb]"
+               " [-k bundle_file] [-w (stat instead of inotify)]"
+               " [-e idle_release_ms]"
+               " [-l (turn on opt_linger)]"
                " [-o (trun off log)]\n");
         exit(EXIT_FAILURE);
         break;
@@ -49,8 +136,9 @@ int main(int argc, char* argv[]) {
         break;
     }
   }
-  WebServer server(port, trig_mode, timeout, linger,
+  WebServer server(port, trig_mode, timeout, idle_timeout, linger,
                    3306, "root", "12345678", database, num_sql_conn,  // mysql settings
-                   num_threads, log, log_level, 1024);           
+                   static_lane, db_lane, num_reactors, use_uring, inline_mode,
+                   coroutine_mode, accept_options, cache_options, log, log_level, 1024);
   server.Start();
 } 
\ No newline at end of file
@@ -0,0 +1,109 @@
+// Bounded lock-free multi-producer multi-consumer ring buffer.
+// by zxg
+//
+#ifndef WEBSERVER_POOL_BOUNDED_RING_H_
+#define WEBSERVER_POOL_BOUNDED_RING_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+// 固定容量的环形队列，任意线程都可以放入和取出，不加锁也不分配内存。
+// 算法来自Dmitry Vyukov的bounded MPMC queue：每个格子带一个序号，
+// 序号说明这个格子现在可以写(等于写位置)还是可以读(等于读位置+1)，
+// 元素随序号的release/acquire一起发布，所以可以按值存放任意类型。
+// 满了TryPush返回false，由调用方决定怎么办
+template <typename T>
+class BoundedRing {
+ public:
+  // capacity: 容量，必须是2的幂
+  explicit BoundedRing(size_t capacity)
+      : mask_(capacity - 1), cells_(new Cell[capacity]),
+        enqueue_pos_(0), dequeue_pos_(0) {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    for (size_t i = 0; i < capacity; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  BoundedRing(const BoundedRing&) = delete;
+  BoundedRing& operator=(const BoundedRing&) = delete;
+
+  // 放入尾部，满了返回false，item保持不变
+  bool TryPush(T&& item) {
+    Cell* cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        // 写位置的修改是顺序一致的，休眠前检查Size()的线程能看到它
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_seq_cst,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // 这个格子还没被读走，满了
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(item);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // 从头部取出，空的返回false
+  bool TryPop(T* item) {
+    Cell* cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // 空的，或者写入者占了位置还没写完
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    *item = std::move(cell->data);
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // 大致的元素个数，包括已经占了位置还没写完的
+  inline size_t Size() const {
+    size_t tail = enqueue_pos_.load();
+    size_t head = dequeue_pos_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+  inline size_t Capacity() const { return mask_ + 1; }
+
+ private:
+  struct alignas(64) Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  // 写位置和读位置分别在不同的缓存行
+  alignas(64) std::atomic<size_t> enqueue_pos_;
+  alignas(64) std::atomic<size_t> dequeue_pos_;
+};
+
+#endif  // WEBSERVER_POOL_BOUNDED_RING_H_
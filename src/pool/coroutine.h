@@ -0,0 +1,177 @@
+// C++20 coroutine primitives for request handlers.
+// by zxg
+//
+#ifndef WEBSERVER_POOL_COROUTINE_H_
+#define WEBSERVER_POOL_COROUTINE_H_
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "threadpool.h"
+
+// 协程在哪里执行：cpu执行解析和组建响应，blocking执行会阻塞的调用
+// (数据库查询)，阻塞调用完成后协程回到cpu上继续
+struct AsyncContext {
+  Threadpool* cpu = nullptr;
+  Threadpool* blocking = nullptr;
+};
+
+template <typename T>
+class Async;
+
+namespace detail {
+
+// Async的promise的公共部分：结束时恢复等待它的协程
+struct AsyncPromiseBase {
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<P> handle) noexcept {
+      // 对称转移，直接切换到等待者，调用链再长也不会栈溢出
+      std::coroutine_handle<> next = handle.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() { exception = std::current_exception(); }
+
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+};
+
+template <typename T>
+struct AsyncPromise : AsyncPromiseBase {
+  Async<T> get_return_object();
+  template <typename U>
+  void return_value(U&& value) {
+    result.emplace(std::forward<U>(value));
+  }
+  T Take() {
+    if (exception) std::rethrow_exception(exception);
+    return std::move(*result);
+  }
+  std::optional<T> result;
+};
+
+template <>
+struct AsyncPromise<void> : AsyncPromiseBase {
+  Async<void> get_return_object();
+  void return_void() const noexcept {}
+  void Take() {
+    if (exception) std::rethrow_exception(exception);
+  }
+};
+
+}  // namespace detail
+
+// 惰性启动的协程，co_await它时才开始执行，执行完恢复co_await它的协程。
+// 返回值为T，异常在co_await处重新抛出。协程帧归Async对象所有
+template <typename T = void>
+class [[nodiscard]] Async {
+ public:
+  typedef detail::AsyncPromise<T> promise_type;
+
+  Async(Async&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Async& operator=(Async&& other) noexcept {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  Async(const Async&) = delete;
+  Async& operator=(const Async&) = delete;
+  ~Async() {
+    if (handle_) handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<> continuation) noexcept {
+    handle_.promise().continuation = continuation;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().Take(); }
+
+ private:
+  friend promise_type;
+  explicit Async(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+Async<T> AsyncPromise<T>::get_return_object() {
+  return Async<T>(std::coroutine_handle<AsyncPromise<T>>::from_promise(*this));
+}
+
+inline Async<void> AsyncPromise<void>::get_return_object() {
+  return Async<void>(
+      std::coroutine_handle<AsyncPromise<void>>::from_promise(*this));
+}
+
+// Spawn用的最外层协程，立即开始执行，结束时自己释放协程帧
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    // 最外层没有人接异常，和线程中未捕获的异常一样结束进程
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+inline Detached RunDetached(Async<void> task) { co_await std::move(task); }
+
+}  // namespace detail
+
+// 在当前线程上开始执行task，直到它第一次挂起就返回。
+// 之后由唤醒它的线程接着执行，结束时协程帧自动释放
+inline void Spawn(Async<void> task) { detail::RunDetached(std::move(task)); }
+
+// co_await Offload(run_on, resume_on, f)：在run_on上执行会阻塞的f，
+// 完成后在resume_on上恢复协程，返回f的结果。等待期间不占用resume_on的线程
+template <typename F>
+class OffloadAwaiter {
+ public:
+  typedef std::invoke_result_t<F&> Result;
+  static_assert(!std::is_void<Result>::value, "Offload needs a result");
+
+  OffloadAwaiter(Threadpool* run_on, Threadpool* resume_on, F f)
+      : run_on_(run_on), resume_on_(resume_on), f_(std::move(f)) {}
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    run_on_->AddTask([this, handle] {
+      result_.emplace(f_());
+      // 提交之后协程随时可能恢复并销毁这个对象，不能再访问成员
+      Threadpool* resume_on = resume_on_;
+      resume_on->AddTask([handle] { handle.resume(); });
+    });
+  }
+  Result await_resume() { return std::move(*result_); }
+
+ private:
+  Threadpool* run_on_;
+  Threadpool* resume_on_;
+  F f_;
+  std::optional<Result> result_;
+};
+
+template <typename F>
+OffloadAwaiter<F> Offload(Threadpool* run_on, Threadpool* resume_on, F f) {
+  return OffloadAwaiter<F>(run_on, resume_on, std::move(f));
+}
+
+#endif  // WEBSERVER_POOL_COROUTINE_H_
@@ -0,0 +1,59 @@
+// Bounded free list of reusable objects.
+// by zxg
+//
+#ifndef WEBSERVER_POOL_OBJECT_POOL_H_
+#define WEBSERVER_POOL_OBJECT_POOL_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// 可复用对象的池。对象还回来时调用方负责把它恢复成初始状态，
+// 池最多保留max_free个空闲对象，多出来的直接释放，
+// 大量连接同时空闲时内存可以真正还给系统
+template <typename T>
+class ObjectPool {
+ public:
+  explicit ObjectPool(size_t max_free) : max_free_(max_free), in_use_(0) {}
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  // 取一个对象，没有空闲的时新建
+  std::unique_ptr<T> Acquire() {
+    ++in_use_;
+    {
+      std::lock_guard<std::mutex> locker(mtx_);
+      if (!free_.empty()) {
+        std::unique_ptr<T> obj = std::move(free_.back());
+        free_.pop_back();
+        return obj;
+      }
+    }
+    return std::unique_ptr<T>(new T());
+  }
+
+  // 还回一个对象，空闲对象已经够多时释放它
+  void Release(std::unique_ptr<T> obj) {
+    if (!obj) return;
+    --in_use_;
+    std::lock_guard<std::mutex> locker(mtx_);
+    if (free_.size() < max_free_) free_.push_back(std::move(obj));
+  }
+
+  inline size_t get_in_use() const { return in_use_; }
+  size_t get_num_free() {
+    std::lock_guard<std::mutex> locker(mtx_);
+    return free_.size();
+  }
+
+ private:
+  const size_t max_free_;
+  std::mutex mtx_;
+  std::vector<std::unique_ptr<T>> free_;
+  std::atomic<size_t> in_use_;  // 被取走还没还回来的对象数
+};
+
+#endif  // WEBSERVER_POOL_OBJECT_POOL_H_
@@ -56,12 +56,69 @@ MYSQL* SqlConnectionPool::GetConnection() {
   return conn;
 }
 
-// 释放一个当前使用的连接，就是把它再塞到连接队列里去，所以信号量加了，可用的连接加了
+// 不阻塞地取出一个空闲连接，信号量已经为0时返回nullptr
+MYSQL* SqlConnectionPool::TryGetConnection() {
+  if (!sem_id_.TryWait()) return nullptr;
+  lock_guard<mutex> locker(mtx_);
+  MYSQL* conn = sql_conn_que_.front();
+  sql_conn_que_.pop();
+  return conn;
+}
+
+bool SqlConnectionPool::AddWaiter(AcquireAwaiter* waiter) {
+  lock_guard<mutex> locker(mtx_);
+  // 在锁内再试一次，归还连接也在锁内进行，所以不会错过
+  if (sem_id_.TryWait()) {
+    waiter->conn_ = sql_conn_que_.front();
+    sql_conn_que_.pop();
+    return false;
+  }
+  waiters_.push_back(waiter);
+  return true;
+}
+
+// 释放一个当前使用的连接，就是把它再塞到连接队列里去，所以信号量加了，可用的连接加了。
+// 有协程在等待连接时直接把连接交给它，不经过队列和信号量
 void SqlConnectionPool::FreeConnection(MYSQL* sql) {
   assert(sql);  // 要释放的连接必须存在
-  lock_guard<mutex> locker(mtx_);
-  sql_conn_que_.emplace(sql);
-  sem_id_.Post();  // 信号量+1
+  AcquireAwaiter* waiter = nullptr;
+  {
+    lock_guard<mutex> locker(mtx_);
+    if (waiters_.empty()) {
+      sql_conn_que_.emplace(sql);
+      sem_id_.Post();  // 信号量+1
+      return;
+    }
+    waiter = waiters_.front();
+    waiters_.pop_front();
+  }
+  waiter->conn_ = sql;
+  // 提交之后waiter所在的协程帧随时可能被销毁，先取出需要的成员
+  std::coroutine_handle<> handle = waiter->handle_;
+  waiter->executor_->AddTask([handle] { handle.resume(); });
+}
+
+SqlResult SqlConnectionPool::Execute(MYSQL* sql, const string& order) {
+  SqlResult result;
+  if (mysql_query(sql, order.c_str())) {
+    // 语句中可能有密码，只记录错误信息
+    LOG_DEBUG("Query error: %s", mysql_error(sql));
+    return result;
+  }
+  result.ok = true;
+  MYSQL_RES* res = mysql_store_result(sql);
+  if (!res) return result;  // INSERT之类没有结果集的语句
+  unsigned int num_fields = mysql_num_fields(res);
+  while (MYSQL_ROW row = mysql_fetch_row(res)) {
+    vector<string> fields;
+    fields.reserve(num_fields);
+    for (unsigned int i = 0; i < num_fields; ++i) {
+      fields.emplace_back(row[i] ? row[i] : "");
+    }
+    result.rows.push_back(std::move(fields));
+  }
+  mysql_free_result(res);
+  return result;
 }
 
 // 获取空闲连接数量
@@ -6,13 +6,23 @@
 
 #include <string>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <mutex>
 #include <thread>
+#include <coroutine>
 
 #include <mysql/mysql.h>  
 
 #include "../lock/locker.h"
 #include "../log/log.h"
+#include "coroutine.h"
+
+// 一条SQL语句的执行结果，每行的各列都转成字符串，NULL转成空串
+struct SqlResult {
+  bool ok = false;
+  std::vector<std::vector<std::string>> rows;
+};
 
 // 数据库连接池
 class SqlConnectionPool {
@@ -21,9 +31,49 @@ class SqlConnectionPool {
   SqlConnectionPool(const SqlConnectionPool&) = delete;
   SqlConnectionPool& operator = (const SqlConnectionPool&) = delete;
 
+  // co_await Acquire(executor)：取得一个连接，没有空闲连接时挂起协程，
+  // 不阻塞线程。有连接归还时直接交给等待最久的协程，在executor上恢复它
+  class AcquireAwaiter {
+   public:
+    AcquireAwaiter(SqlConnectionPool* pool, Threadpool* executor)
+        : pool_(pool), executor_(executor), conn_(nullptr) {}
+    bool await_ready() {
+      conn_ = pool_->TryGetConnection();
+      return conn_ != nullptr;
+    }
+    // 排队之前连接刚好被归还时返回false，不挂起
+    bool await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      return pool_->AddWaiter(this);
+    }
+    MYSQL* await_resume() const { return conn_; }
+
+   private:
+    friend class SqlConnectionPool;
+    SqlConnectionPool* pool_;
+    Threadpool* executor_;
+    MYSQL* conn_;
+    std::coroutine_handle<> handle_;
+  };
+
   MYSQL* GetConnection();  // 取得一个连接
+  MYSQL* TryGetConnection();  // 取得一个空闲连接，没有时返回nullptr
+  AcquireAwaiter Acquire(Threadpool* executor) {
+    return AcquireAwaiter(this, executor);
+  }
   void FreeConnection(MYSQL* conn);  // 释放一个连接（释放==放入队列，并不是销毁）
   int GetNumFreeConn();
+
+  // 在sql上执行一条语句并取回全部结果，会阻塞
+  static SqlResult Execute(MYSQL* sql, const std::string& order);
+  // co_await Query(ctx, sql, order)：在ctx.blocking上执行语句，
+  // 完成后在ctx.cpu上恢复协程并返回结果
+  static auto Query(const AsyncContext& ctx, MYSQL* sql, std::string order) {
+    return Offload(ctx.blocking, ctx.cpu,
+                   [sql, order = std::move(order)] {
+                     return Execute(sql, order);
+                   });
+  }
   
   void Init(const char* host, int port, const char* user,
             const char* pwd, const char* db_name, int conn_size);
@@ -33,6 +83,9 @@ class SqlConnectionPool {
   SqlConnectionPool();
   ~SqlConnectionPool();
 
+  // 加入等待队列，排队前发现有空闲连接时直接取走并返回false
+  bool AddWaiter(AcquireAwaiter* waiter);
+
   int max_connections_;              // 最大连接数
   int num_users_;                    // 已使用连接数, not used
   int num_free_;                     // 空闲连接数, not used
@@ -40,6 +93,8 @@ class SqlConnectionPool {
   std::mutex mtx_;
   // sem_t sem_id_;                     // 信号量
   SemaphoreWrapper sem_id_;
+  // 等待连接的协程，先来先得，mtx_保护
+  std::deque<AcquireAwaiter*> waiters_;
 };
 
 #endif  // SERVER_POOL_SQL_CONNECT_POOL_H_
@@ -16,6 +16,12 @@ class SqlConnectionRaii {
     conn_pool_ = conn_pool;
   }
 
+  // 接管一个已经取得的连接，比如协程中co_await Acquire()得到的连接
+  SqlConnectionRaii(MYSQL* sql, SqlConnectionPool* conn_pool)
+      : sql_(sql), conn_pool_(conn_pool) {
+    assert(conn_pool);
+  }
+
   ~SqlConnectionRaii() {
     if (sql_) conn_pool_->FreeConnection(sql_);
   }
@@ -0,0 +1,104 @@
+// Move-only callable with fixed inline storage.
+// by zxg
+//
+#ifndef WEBSERVER_POOL_TASK_H_
+#define WEBSERVER_POOL_TASK_H_
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// 线程池的任务。可调用对象直接存放在对象内部的固定空间里，
+// 不像std::function那样可能在堆上分配，提交任务时没有内存分配。
+// 放不下的可调用对象在编译时报错，而不是悄悄退回到堆上。
+// 连同操作表指针一共48字节，加上队列中的入队时间和序号正好一个缓存行
+class Task {
+ public:
+  static const size_t kInlineSize = 40;
+
+  Task() : ops_(nullptr) {}
+
+  template <typename F, typename Fn = typename std::decay<F>::type,
+            typename = typename std::enable_if<
+                !std::is_same<Fn, Task>::value>::type>
+  Task(F&& f) : ops_(&Ops<Fn>::kTable) {  // NOLINT 允许隐式转换
+    static_assert(sizeof(Fn) <= kInlineSize,
+                  "callable too large for Task inline storage");
+    static_assert(alignof(Fn) <= alignof(void*),
+                  "callable over-aligned for Task inline storage");
+    static_assert(std::is_nothrow_move_constructible<Fn>::value,
+                  "Task callable must be nothrow movable");
+    new (storage_) Fn(std::forward<F>(f));
+  }
+
+  Task(Task&& other) noexcept : ops_(other.ops_) {
+    if (ops_) {
+      ops_->move(storage_, other.storage_);
+      other.ops_ = nullptr;
+    }
+  }
+
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      if (other.ops_) {
+        ops_ = other.ops_;
+        ops_->move(storage_, other.storage_);
+        other.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() { Reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  void operator()() {
+    assert(ops_);
+    ops_->invoke(storage_);
+  }
+
+  // 销毁保存的可调用对象，变回空任务
+  void Reset() {
+    if (ops_) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+ private:
+  // 每种可调用类型一张操作表，代替虚函数
+  struct Operations {
+    void (*invoke)(void* storage);
+    void (*move)(void* dst, void* src);  // 移动构造到dst并销毁src
+    void (*destroy)(void* storage);
+  };
+
+  template <typename Fn>
+  struct Ops {
+    static void Invoke(void* storage) { (*static_cast<Fn*>(storage))(); }
+    static void Move(void* dst, void* src) {
+      Fn* from = static_cast<Fn*>(src);
+      new (dst) Fn(std::move(*from));
+      from->~Fn();
+    }
+    static void Destroy(void* storage) { static_cast<Fn*>(storage)->~Fn(); }
+    static const Operations kTable;
+  };
+
+  alignas(void*) unsigned char storage_[kInlineSize];
+  const Operations* ops_;
+};
+
+template <typename Fn>
+const Task::Operations Task::Ops<Fn>::kTable = {
+    &Task::Ops<Fn>::Invoke, &Task::Ops<Fn>::Move, &Task::Ops<Fn>::Destroy};
+
+#endif  // WEBSERVER_POOL_TASK_H_
@@ -0,0 +1,364 @@
+// by zxg
+//
+#include "threadpool.h"
+
+#include <errno.h>
+#include <linux/futex.h>  // FUTEX_WAIT_PRIVATE
+#include <sys/syscall.h>  // SYS_futex
+#include <time.h>         // clock_gettime
+#include <unistd.h>       // syscall()
+
+// futex上的值还是expected时休眠，被唤醒或者值已经变了就返回。
+// timeout_ms大于0时最多等这么久，超时返回true
+static bool FutexWait(std::atomic<uint32_t>* addr, uint32_t expected,
+                      int timeout_ms = 0) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  long ret = syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+                     FUTEX_WAIT_PRIVATE, expected,
+                     timeout_ms > 0 ? &timeout : nullptr, nullptr, 0);
+  return ret == -1 && errno == ETIMEDOUT;
+}
+
+static void FutexWake(std::atomic<uint32_t>* addr) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE, 1,
+          nullptr, nullptr, 0);
+}
+
+static int64_t ToNs(const struct timespec& ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ToNs(ts);
+}
+
+// 本线程占用的CPU时间
+static int64_t ThreadCpuNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ToNs(ts);
+}
+
+// 排队时间落在直方图的哪个桶
+static int WaitBucket(int64_t wait_ns) {
+  unsigned long long us = wait_ns > 0 ? wait_ns / 1000 : 0;
+  if (us == 0) return 0;
+  int bucket = 64 - __builtin_clzll(us);
+  return bucket < Threadpool::kWaitBuckets ? bucket
+                                           : Threadpool::kWaitBuckets - 1;
+}
+
+// 向上取整到2的幂
+static size_t RoundUpPowerOfTwo(size_t n) {
+  size_t size = 1;
+  while (size < n) size <<= 1;
+  return size;
+}
+
+Threadpool::Threadpool(const ThreadpoolOptions& options)
+    : min_threads_(options.num_threads),
+      spin_(options.spin > 0 ? options.spin : 0),
+      target_wait_ns_(
+          static_cast<int64_t>(options.target_wait_ms > 0
+                                   ? options.target_wait_ms : 1) * 1000000LL),
+      cooldown_ms_(options.cooldown_ms > 0 ? options.cooldown_ms : 1),
+      active_(options.num_threads),
+      next_(0),
+      closed_(false),
+      num_parked_(0),
+      num_searching_(0),
+      steals_(0),
+      parks_(0),
+      overflows_(0),
+      grows_(0),
+      retires_(0),
+      monitor_wake_(0) {
+  assert(options.num_threads > 0);
+  const size_t queue_size = RoundUpPowerOfTwo(options.queue_size);
+  const size_t max_threads = options.max_threads > options.num_threads
+                                 ? options.max_threads : options.num_threads;
+  // 所有线程的状态都建好之后再启动，线程之间会互相访问
+  for (size_t i = 0; i < max_threads; ++i) {
+    workers_.emplace_back(new Worker(queue_size));
+  }
+  for (size_t i = 0; i < min_threads_; ++i) {
+    workers_[i]->thread = std::thread(&Threadpool::Run, this, i);
+  }
+  if (IsElastic()) monitor_ = std::thread(&Threadpool::Monitor, this);
+}
+
+Threadpool::~Threadpool() {
+  // 先停掉监视线程，之后不会再加线程
+  closed_.store(true);
+  if (monitor_.joinable()) {
+    monitor_wake_.store(1);
+    FutexWake(&monitor_wake_);
+    monitor_.join();
+  }
+  // 执行完所有任务后线程才会退出
+  for (auto& worker : workers_) Wake(worker.get());
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable()) worker->thread.join();
+  }
+}
+
+void Threadpool::Submit(size_t hint, Task&& task) {
+  Job job;
+  job.task = std::move(task);
+  job.enqueue_ns = NowNs();
+  // 目标线程的队列满了就放到下一个线程的队列。退出了的线程队列中剩下的任务
+  // 会被其他线程偷走，所以放进哪个位置都可以
+  const size_t n = workers_.size();
+  const size_t id = hint % active_.load(std::memory_order_relaxed);
+  size_t target = id;
+  bool queued = false;
+  for (size_t i = 0; i < n && !queued; ++i) {
+    target = (id + i) % n;
+    queued = workers_[target]->queue.TryPush(std::move(job));
+  }
+  if (!queued) {
+    // 所有队列都满了，说明线程池已经跟不上，由提交的线程自己执行，
+    // 顺便让提交慢下来
+    overflows_.fetch_add(1, std::memory_order_relaxed);
+    job.task();
+    return;
+  }
+  // 目标线程在休眠就叫醒它。它在忙而且没有线程在找活干时，
+  // 叫醒另一个线程来偷，任务不用等它忙完
+  if (!Wake(workers_[target].get()) && num_searching_.load() == 0) {
+    WakeAny(target);
+  }
+}
+
+void Threadpool::Run(size_t id) {
+  Worker* self = workers_[id].get();
+  Job job;
+  int idle_rounds = 0;
+  bool searching = false;
+  while (true) {
+    if (FindTask(id, &job)) {
+      if (searching) {
+        searching = false;
+        num_searching_.fetch_sub(1);
+      }
+      idle_rounds = 0;
+      Execute(self, &job);
+      continue;
+    }
+    if (closed_.load()) {
+      if (!HasWork()) break;  // 线程池要关闭了，而且没有剩下的任务
+      continue;
+    }
+    // 先自旋几轮，任务很快就会来时省掉休眠和唤醒的系统调用
+    if (idle_rounds < spin_) {
+      if (!searching) {
+        searching = true;
+        num_searching_.fetch_add(1);
+      }
+      ++idle_rounds;
+      std::this_thread::yield();
+      continue;
+    }
+    if (searching) {
+      searching = false;
+      num_searching_.fetch_sub(1);
+    }
+    idle_rounds = 0;
+    if (Park(id)) break;  // 空闲太久，退出
+  }
+  if (searching) num_searching_.fetch_sub(1);
+}
+
+void Threadpool::Execute(Worker* self, Job* job) {
+  const int64_t start = NowNs();
+  const int64_t wait = start - job->enqueue_ns;
+  // 统计只有本线程修改，普通的读再写就够了
+  std::atomic<unsigned long long>& count = self->wait_hist[WaitBucket(wait)];
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+  if (wait > self->max_wait_ns.load(std::memory_order_relaxed)) {
+    self->max_wait_ns.store(wait, std::memory_order_relaxed);
+  }
+  // 阻塞时间是执行时间减去占用的CPU时间，要多两次系统调用，只在弹性模式下算
+  const bool elastic = IsElastic();
+  const int64_t cpu_start = elastic ? ThreadCpuNs() : 0;
+  job->task();  // 执行任务
+  job->task.Reset();  // 马上释放任务持有的资源
+  const int64_t run = NowNs() - start;
+  self->run_ns.store(self->run_ns.load(std::memory_order_relaxed) + run,
+                     std::memory_order_relaxed);
+  if (elastic) {
+    const int64_t blocked = run - (ThreadCpuNs() - cpu_start);
+    if (blocked > 0) {
+      self->blocked_ns.store(
+          self->blocked_ns.load(std::memory_order_relaxed) + blocked,
+          std::memory_order_relaxed);
+    }
+  }
+  self->num_tasks.store(self->num_tasks.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+}
+
+bool Threadpool::FindTask(size_t id, Job* job) {
+  Worker* self = workers_[id].get();
+  if (self->queue.TryPop(job)) {
+    // 队列里还有积压时叫醒一个线程来分担
+    if (self->queue.Size() > 0 && num_searching_.load() == 0) WakeAny(id);
+    return true;
+  }
+  // 自己没有任务了，从下一个位置开始依次去偷，包括已经退出的线程的队列
+  const size_t n = workers_.size();
+  for (size_t i = 1; i < n; ++i) {
+    if (workers_[(id + i) % n]->queue.TryPop(job)) {
+      steals_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Threadpool::HasWork() const {
+  for (const auto& worker : workers_) {
+    if (worker->queue.Size() > 0) return true;
+  }
+  return false;
+}
+
+bool Threadpool::Park(size_t id) {
+  Worker* worker = workers_[id].get();
+  // 先声明要休眠，再确认没有任务：提交任务的线程先放任务再看parked，
+  // 两边都是顺序一致的读写，至少有一边能看到另一边，不会丢失唤醒
+  worker->parked.store(1);
+  num_parked_.fetch_add(1);
+  bool retire = false;
+  if (!HasWork() && !closed_.load()) {
+    parks_.fetch_add(1, std::memory_order_relaxed);
+    // 弹性模式下多出来的线程定时醒来，看看是不是该退出了
+    const int timeout_ms = id >= min_threads_ ? cooldown_ms_ : 0;
+    while (worker->parked.load() == 1) {
+      if (FutexWait(&worker->parked, 1, timeout_ms) && TryRetire(id)) {
+        retire = true;
+        break;
+      }
+    }
+  } else {
+    worker->parked.store(0);
+  }
+  num_parked_.fetch_sub(1);
+  return retire;
+}
+
+bool Threadpool::TryRetire(size_t id) {
+  Worker* worker = workers_[id].get();
+  if (worker->parked.load() == 0) return false;  // 刚好被叫醒了
+  // 只有末尾的线程能退出，运行中的线程总是前active_个
+  size_t expected = id + 1;
+  if (expected <= min_threads_ ||
+      !active_.compare_exchange_strong(expected, id)) {
+    return false;
+  }
+  worker->parked.store(0);
+  // 退出前有任务放进了自己的队列，叫醒别的线程来偷
+  if (worker->queue.Size() > 0) WakeAny(id);
+  retires_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool Threadpool::Wake(Worker* worker) {
+  if (worker->parked.load() == 0 || worker->parked.exchange(0) == 0) {
+    return false;
+  }
+  FutexWake(&worker->parked);
+  return true;
+}
+
+void Threadpool::WakeAny(size_t except) {
+  if (num_parked_.load() == 0) return;
+  const size_t n = workers_.size();
+  for (size_t i = 1; i < n; ++i) {
+    if (Wake(workers_[(except + i) % n].get())) return;
+  }
+}
+
+void Threadpool::Monitor() {
+  // 每个目标排队时间检查一次
+  const int tick_ms = static_cast<int>(target_wait_ns_ / 1000000);
+  const size_t num_cpus = std::thread::hardware_concurrency();
+  unsigned long long last_tasks = 0, last_run = 0, last_blocked = 0;
+  while (!closed_.load()) {
+    FutexWait(&monitor_wake_, 0, tick_ms);
+    if (closed_.load()) break;
+    int64_t max_wait = 0;
+    unsigned long long tasks = 0, run = 0, blocked = 0;
+    for (auto& worker : workers_) {
+      int64_t wait = worker->max_wait_ns.exchange(0, std::memory_order_relaxed);
+      if (wait > max_wait) max_wait = wait;
+      tasks += worker->num_tasks.load(std::memory_order_relaxed);
+      run += worker->run_ns.load(std::memory_order_relaxed);
+      blocked += worker->blocked_ns.load(std::memory_order_relaxed);
+    }
+    const unsigned long long done = tasks - last_tasks;
+    const unsigned long long run_delta = run - last_run;
+    const unsigned long long blocked_delta = blocked - last_blocked;
+    last_tasks = tasks;
+    last_run = run;
+    last_blocked = blocked;
+    // 还有任务在排队，而且刚执行的任务等了太久，或者这一周期一个都没做完
+    if (get_queue_depth() == 0) continue;
+    if (max_wait <= target_wait_ns_ && done > 0) continue;
+    // 线程都在算而不是在等时，加线程只会让它们抢CPU。
+    // 线程一半以上的时间在阻塞，或者CPU还没用满，才值得加
+    const bool blocking = done == 0 || blocked_delta * 2 >= run_delta ||
+                          active_.load() < num_cpus;
+    if (blocking) Grow();
+  }
+}
+
+void Threadpool::Grow() {
+  const size_t n = active_.load();
+  if (n >= workers_.size()) return;
+  Worker* worker = workers_[n].get();
+  // 这个位置上次的线程已经退出(或者正在退出)，回收它
+  if (worker->thread.joinable()) worker->thread.join();
+  // 这期间末尾的线程又退出了，下个周期再看
+  size_t expected = n;
+  if (!active_.compare_exchange_strong(expected, n + 1)) return;
+  worker->thread = std::thread(&Threadpool::Run, this, n);
+  grows_.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t Threadpool::get_queue_depth() const {
+  size_t depth = 0;
+  for (const auto& worker : workers_) depth += worker->queue.Size();
+  return depth;
+}
+
+std::vector<unsigned long long> Threadpool::GetWaitHistogram() const {
+  std::vector<unsigned long long> hist(kWaitBuckets, 0);
+  for (const auto& worker : workers_) {
+    for (int i = 0; i < kWaitBuckets; ++i) {
+      hist[i] += worker->wait_hist[i].load(std::memory_order_relaxed);
+    }
+  }
+  return hist;
+}
+
+unsigned long long Threadpool::get_num_tasks() const {
+  unsigned long long tasks = 0;
+  for (const auto& worker : workers_) {
+    tasks += worker->num_tasks.load(std::memory_order_relaxed);
+  }
+  return tasks;
+}
+
+unsigned long long Threadpool::get_blocked_ms() const {
+  unsigned long long blocked = 0;
+  for (const auto& worker : workers_) {
+    blocked += worker->blocked_ns.load(std::memory_order_relaxed);
+  }
+  return blocked / 1000000;
+}
@@ -4,74 +4,157 @@
 #ifndef SERVER_POOL_THREADPOOL_H_
 #define SERVER_POOL_THREADPOOL_H_
 
-#include <mutex>
-#include <condition_variable>
-#include <queue>
+#include <assert.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
 #include <thread>
-#include <functional>
+#include <utility>
+#include <vector>
+
+#include "bounded_ring.h"
+#include "task.h"
+
+// 线程池的可调参数
+struct ThreadpoolOptions {
+  // 线程数，弹性模式下是最少保留的线程数
+  size_t num_threads = 6;
+  // 大于num_threads时开启弹性模式：任务排队太久而线程都阻塞着
+  // (比如都在等数据库)时加线程，最多加到这么多；多出来的线程空闲后退出
+  size_t max_threads = 0;
+  // 弹性模式下任务排队超过这个时间认为线程不够
+  int target_wait_ms = 5;
+  // 弹性模式下多出来的线程空闲这么久后退出
+  int cooldown_ms = 10000;
+  // 找不到任务时先重试这么多轮(每轮把所有线程的队列都看一遍)再休眠，
+  // 越大唤醒延迟越低，空闲时占用的CPU越多。0表示直接休眠
+  int spin = 64;
+  // 每个线程任务队列的容量，2的幂。每个连接同时最多只有一个任务，
+  // 所有队列都满时任务直接在提交的线程上执行
+  size_t queue_size = 1024;
+};
 
+// 工作窃取线程池。
+// 每个线程有自己的任务队列，提交的任务按轮转或者按affinity分给某个线程，
+// 不再所有线程抢一把锁。线程先做自己的任务，做完了去偷其他线程的，
+// 都没有任务时自旋一会儿，然后在futex上休眠，有任务提交给它时被唤醒。
+// 任务按值存放在固定容量的环形队列里，提交和执行都不分配内存。
+// 弹性模式下按max_threads预留所有线程的位置，运行中的线程总是前active_个，
+// 由监视线程根据排队时间和阻塞时间在末尾加线程，末尾的线程空闲后自己退出。
+// 析构时等所有已提交的任务执行完，再join所有线程
 class Threadpool {
  public:
-  explicit Threadpool(size_t num_threads=8) : pool_(std::make_shared<Pool>()) {
-    assert(num_threads > 0);
-    for (size_t i = 0; i < num_threads; ++i) {
-      // 线程处理函数
-      auto worker = [pool = pool_]() {
-        std::unique_lock<std::mutex> locker(pool->mtx);  // 互斥锁
-        while (true) {
-          // locker.lock();  // 构造时不加锁，现在手动加锁
-          if (!pool->tasks.empty()) {
-            auto task = std::move(pool->tasks.front());  // 从请求队列中取出第一个
-            pool->tasks.pop();  // 删除被取出的请求
-            locker.unlock();
-            task();  // 执行请求
-            locker.lock();
-          } else if (pool->is_closed) {  // 线程池要关闭了
-            break;
-          } else {
-            pool->cond.wait(locker);  // 如果队列为空，在这里等待
-          }
-        }  // while
-      };
-      // 创建线程
-      std::thread(worker).detach();  // 将新线程和调用线程分离，调用之后不再是joinable状态了
-    }
-  }
-  Threadpool() = default;
-  Threadpool(Threadpool&&) = default;  // 移动构造
+  // 排队时间直方图的桶数：第0个桶是不到1us，第i个桶是[2^(i-1), 2^i)us，
+  // 最后一个桶包括所有更长的
+  static const int kWaitBuckets = 24;
 
-  ~Threadpool() {
-    if (static_cast<bool>(pool_)) {  // why?
-      {
-        std::lock_guard<std::mutex> locker(pool_->mtx);
-        pool_->is_closed = true;
-      }
-      // 唤醒所有等待的线程
-      // 执行完所有任务后才会退出
-      pool_->cond.notify_all();
-    }
-  }
+  explicit Threadpool(const ThreadpoolOptions& options = ThreadpoolOptions());
+  ~Threadpool();
+  Threadpool(const Threadpool&) = delete;
+  Threadpool& operator=(const Threadpool&) = delete;
 
-  template<typename F>  // TODO
+  // 按轮转交给一个线程
+  template<typename F>
   void AddTask(F&& task) {
-    {
-      std::lock_guard<std::mutex> locker(pool_->mtx);
-      // 完美转发？
-      pool_->tasks.emplace(std::forward<F>(task));
-    }
-    pool_->cond.notify_one();  // 唤醒一个等待的进程
+    Submit(next_.fetch_add(1, std::memory_order_relaxed),
+           Task(std::forward<F>(task)));
+  }
+  // affinity相同的任务(比如同一个连接上的)交给同一个线程，
+  // 它的数据大概率还在这个线程的缓存里。线程忙时仍然会被其他线程偷走
+  template<typename F>
+  void AddTask(size_t affinity, F&& task) {
+    Submit(affinity, Task(std::forward<F>(task)));
   }
 
+  // 统计信息，用于日志
+  // 正在运行的线程数
+  inline size_t get_num_threads() const { return active_; }
+  inline size_t get_max_threads() const { return workers_.size(); }
+  inline bool IsElastic() const { return min_threads_ < workers_.size(); }
+  // 所有队列中等待执行的任务数
+  size_t get_queue_depth() const;
+  // 从开始到现在所有任务的排队时间分布，kWaitBuckets个计数
+  std::vector<unsigned long long> GetWaitHistogram() const;
+  // 已执行的任务数
+  unsigned long long get_num_tasks() const;
+  // 任务执行中阻塞(等IO、等锁、被抢占)的总时间，只在弹性模式下统计
+  unsigned long long get_blocked_ms() const;
+  inline unsigned long long get_steals() const { return steals_; }
+  inline unsigned long long get_parks() const { return parks_; }
+  // 所有队列都满、在提交线程上直接执行的任务数
+  inline unsigned long long get_overflows() const { return overflows_; }
+  inline unsigned long long get_grows() const { return grows_; }
+  inline unsigned long long get_retires() const { return retires_; }
+
  private:
-  // 保存线程池相关参数的结构体
-  struct Pool {
-    std::mutex mtx;
-    std::condition_variable cond;
-    bool is_closed;  // 是否结束线程池
-    // using: function<return_type(args_type)>
-    std::queue<std::function<void()>> tasks;  // 请求队列
+  // 队列中的一项，记下入队时间用来统计排队时间
+  struct Job {
+    Task task;
+    int64_t enqueue_ns = 0;
+  };
+
+  // 一个工作线程的状态，各自对齐到缓存行，互不干扰
+  struct alignas(64) Worker {
+    explicit Worker(size_t queue_size)
+        : queue(queue_size), parked(0), num_tasks(0), run_ns(0),
+          blocked_ns(0), max_wait_ns(0) {
+      for (auto& count : wait_hist) count.store(0, std::memory_order_relaxed);
+    }
+    // 任何线程都可以放入，本线程和窃取者从这里取
+    BoundedRing<Job> queue;
+    // futex字，1表示正在休眠或准备休眠
+    std::atomic<uint32_t> parked;
+    std::thread thread;
+    // 以下统计只由本线程修改，其他线程只读，不用原子的读改写
+    alignas(64) std::atomic<unsigned long long> num_tasks;
+    std::atomic<unsigned long long> run_ns;      // 执行任务的总时间
+    std::atomic<unsigned long long> blocked_ns;  // 其中没有占用CPU的时间
+    std::atomic<int64_t> max_wait_ns;  // 上次检查以来最长的排队时间
+    std::atomic<unsigned long long> wait_hist[kWaitBuckets];
   };
-  std::shared_ptr<Pool> pool_;
+
+  // 放入hint对应线程的队列，并叫醒一个线程来处理
+  void Submit(size_t hint, Task&& task);
+  // 工作线程的主循环
+  void Run(size_t id);
+  // 执行一个任务并记录排队和执行时间
+  void Execute(Worker* self, Job* job);
+  // 先从自己的队列，再从其他线程的队列找一个任务
+  bool FindTask(size_t id, Job* job);
+  // 还有没有任何任务，休眠前再确认一次
+  bool HasWork() const;
+  // 休眠，直到被Wake或者线程池关闭。弹性模式下空闲太久时返回true，线程退出
+  bool Park(size_t id);
+  // 末尾的线程空闲够久了，退出
+  bool TryRetire(size_t id);
+  // 叫醒一个线程，已经醒着时返回false
+  bool Wake(Worker* worker);
+  // 叫醒除except外的任意一个正在休眠的线程
+  void WakeAny(size_t except);
+  // 弹性模式的监视线程，定期检查要不要加线程
+  void Monitor();
+  // 在末尾加一个线程，只在监视线程调用
+  void Grow();
+
+  std::vector<std::unique_ptr<Worker>> workers_;  // max_threads个位置
+  const size_t min_threads_;
+  const int spin_;
+  const int64_t target_wait_ns_;
+  const int cooldown_ms_;
+  std::atomic<size_t> active_;      // 正在运行的线程数，它们是前active_个
+  std::atomic<size_t> next_;        // 轮转的下一个线程
+  std::atomic<bool> closed_;        // 是否结束线程池
+  std::atomic<size_t> num_parked_;  // 正在休眠的线程数，为0时不用找
+  // 正在自旋找任务的线程数，不为0时新任务总会被它们发现，不用叫醒别人
+  std::atomic<size_t> num_searching_;
+  std::atomic<unsigned long long> steals_;     // 从其他线程偷到的任务数
+  std::atomic<unsigned long long> parks_;      // 休眠的次数
+  std::atomic<unsigned long long> overflows_;  // 队列满时直接执行的任务数
+  std::atomic<unsigned long long> grows_;      // 弹性模式下加线程的次数
+  std::atomic<unsigned long long> retires_;    // 空闲线程退出的次数
+  std::atomic<uint32_t> monitor_wake_;  // 监视线程休眠用的futex字
+  std::thread monitor_;
 };
 
-#endif  // SERVER_POOL_THREADPOOL_H_
\ No newline at end of file
+#endif  // SERVER_POOL_THREADPOOL_H_
@@ -16,19 +16,20 @@ Epoller::~Epoller() {
   close(epoll_fd_);
 }
 
-bool Epoller::AddFd(int fd, uint32_t events) {
+bool Epoller::AddFd(int fd, uint32_t events, uint32_t tag) {
   if (fd < 0) return false;
   epoll_event ev = {0};
-  ev.data.fd = fd;     // 用户数据，包含一些传递的参数
+  // 用户数据，包含一些传递的参数
+  ev.data.u64 = (static_cast<uint64_t>(tag) << 32) | static_cast<uint32_t>(fd);
   ev.events = events;  // epoll注册的事件
   // params: op: add entry to the interest list
   return 0 == epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
 }
 
-bool Epoller::ModFd(int fd, uint32_t events) {
+bool Epoller::ModFd(int fd, uint32_t events, uint32_t tag) {
   if (fd < 0) return false;
   epoll_event ev = {0};
-  ev.data.fd = fd;
+  ev.data.u64 = (static_cast<uint64_t>(tag) << 32) | static_cast<uint32_t>(fd);
   ev.events = events;
   // params: op: modify setting associated with fd in the interest list
   return 0 == epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
@@ -49,10 +50,15 @@ int Epoller::Wait(int timeout) {
 
 int Epoller::GetEventFd(size_t i) const {
   assert(i < events_.size() && i >= 0);
-  return events_[i].data.fd;
+  return static_cast<int>(events_[i].data.u64 & 0xffffffff);
 }
 
 uint32_t Epoller::GetEvents(size_t i) const {
   assert(i < events_.size() && i >= 0);
   return events_[i].events;
+}
+
+uint32_t Epoller::GetEventTag(size_t i) const {
+  assert(i < events_.size());
+  return static_cast<uint32_t>(events_[i].data.u64 >> 32);
 }
\ No newline at end of file
@@ -12,24 +12,30 @@
 
 #include <vector>
 
-class Epoller {
+#include "poller.h"
+
+class Epoller : public Poller {
  public:
   explicit Epoller();  // default max_event: 1024
   explicit Epoller(int max_event);
-  ~Epoller();
+  ~Epoller() override;
 
   // 添加监听事件
-  bool AddFd(int fd, uint32_t events);
+  // epoll_data.u64的低32位是fd，高32位是tag
+  bool AddFd(int fd, uint32_t events, uint32_t tag) override;
   // 改变被监听事件中的某个fd对应的设置，新设置在events中
-  bool ModFd(int fd, uint32_t events);
+  bool ModFd(int fd, uint32_t events, uint32_t tag) override;
   // 删除指定的事件
-  bool DelFd(int fd);
+  bool DelFd(int fd) override;
   // 在一段超时时间内等待事件（milliseconds）
-  int Wait(int timeout = -1);  // -1 means block
+  int Wait(int timeout = -1) override;  // -1 means block
   // 获取对应下标的epoll事件所从属的目标fd
-  int GetEventFd(size_t i) const;
+  int GetEventFd(size_t i) const override;
   // 获取对应下标的epoll事件
-  uint32_t GetEvents(size_t i) const;
+  uint32_t GetEvents(size_t i) const override;
+  // 获取对应下标的epoll事件附带的tag
+  uint32_t GetEventTag(size_t i) const override;
+  const char* Name() const override { return "epoll"; }
         
  private:
   int epoll_fd_;  // 指定的内核事件表
@@ -0,0 +1,14 @@
+// by zxg
+//
+#include "poller.h"
+#include "epoller.h"
+#include "uring_poller.h"
+
+std::unique_ptr<Poller> Poller::Create(bool use_uring) {
+  if (use_uring) {
+    std::unique_ptr<UringPoller> uring(new UringPoller());
+    if (uring->IsValid()) return uring;
+    // 内核不支持，退回epoll
+  }
+  return std::unique_ptr<Poller>(new Epoller());
+}
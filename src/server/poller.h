@@ -0,0 +1,43 @@
+// Abstract interface of the event backend, implemented by epoll and io_uring.
+// by zxg
+//
+#ifndef WEBSERVER_SERVER_POLLER_H_
+#define WEBSERVER_SERVER_POLLER_H_
+
+#include <sys/epoll.h>  // EPOLLIN, EPOLLOUT...
+#include <stdint.h>
+#include <stddef.h>
+
+#include <memory>
+
+// 事件后端的统一接口，事件掩码一律使用epoll的定义(EPOLLIN, EPOLLONESHOT...)，
+// 上层代码不需要关心具体是epoll还是io_uring。
+// 每个fd可以附带一个32位的tag，和fd一起放在事件的用户数据里原样返回，
+// 用来识别fd被关闭又复用之后残留的旧事件
+class Poller {
+ public:
+  virtual ~Poller() = default;
+
+  // 添加监听事件
+  virtual bool AddFd(int fd, uint32_t events, uint32_t tag) = 0;
+  // 改变被监听事件中的某个fd对应的设置，新设置在events中
+  virtual bool ModFd(int fd, uint32_t events, uint32_t tag) = 0;
+  // 删除指定的事件
+  virtual bool DelFd(int fd) = 0;
+  // 在一段超时时间内等待事件（milliseconds）
+  virtual int Wait(int timeout = -1) = 0;  // -1 means block
+  // 获取对应下标的事件所从属的目标fd
+  virtual int GetEventFd(size_t i) const = 0;
+  // 获取对应下标的事件
+  virtual uint32_t GetEvents(size_t i) const = 0;
+  // 获取对应下标的事件注册时附带的tag
+  virtual uint32_t GetEventTag(size_t i) const = 0;
+  // 后端名称，用于日志
+  virtual const char* Name() const = 0;
+
+  // 在启动时选择事件后端：要求使用io_uring且内核支持时返回io_uring实现，
+  // 否则退回epoll
+  static std::unique_ptr<Poller> Create(bool use_uring);
+};
+
+#endif  // WEBSERVER_SERVER_POLLER_H_
@@ -0,0 +1,360 @@
+// by zxg
+//
+#include "uring_poller.h"
+
+#include <sys/mman.h>     // mmap()
+#include <sys/syscall.h>  // __NR_io_uring_*
+#include <unistd.h>       // syscall(), close()
+
+#include <cstring>
+#include <algorithm>
+
+#include "../log/log.h"
+
+namespace {
+
+int IoUringSetup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IoUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags, const void* arg, size_t arg_size) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, arg, arg_size));
+}
+
+// epoll的ONESHOT/ET标志不交给内核，单次触发由我们自己重新注册来实现
+const uint32_t kPollMaskIgnored = EPOLLONESHOT | EPOLLET;
+
+}  // namespace
+
+UringPoller::UringPoller(int max_event)
+    : ring_fd_(-1), sqes_(nullptr), sq_ring_ptr_(MAP_FAILED), sq_ring_size_(0),
+      cq_ring_ptr_(MAP_FAILED), cq_ring_size_(0), sqes_size_(0), pending_(0),
+      has_owner_(false), poll_update_(false), events_(max_event) {
+  assert(events_.size() > 0);
+  if (!Setup(1024)) {
+    if (ring_fd_ >= 0) close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+UringPoller::~UringPoller() {
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (cq_ring_ptr_ != MAP_FAILED && cq_ring_ptr_ != sq_ring_ptr_) {
+    munmap(cq_ring_ptr_, cq_ring_size_);
+  }
+  if (sq_ring_ptr_ != MAP_FAILED) munmap(sq_ring_ptr_, sq_ring_size_);
+  if (ring_fd_ >= 0) close(ring_fd_);
+}
+
+bool UringPoller::Setup(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // 完成队列开大一些，每个连接同一时刻最多只有一个poll请求
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+  ring_fd_ = IoUringSetup(entries, &params);
+  if (ring_fd_ < 0) return false;  // 内核太旧或被禁用
+  // 带超时的等待需要EXT_ARG(5.11)，完成队列溢出不丢事件需要NODROP(5.5)
+  if (!(params.features & IORING_FEAT_EXT_ARG) ||
+      !(params.features & IORING_FEAT_NODROP)) {
+    return false;
+  }
+  // 映射提交队列、完成队列和SQE数组
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ptr_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ptr_ == MAP_FAILED) return false;
+  if (single_mmap) {
+    cq_ring_ptr_ = sq_ring_ptr_;
+  } else {
+    cq_ring_ptr_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ptr_ == MAP_FAILED) return false;
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return false;
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  char* sq = static_cast<char*>(sq_ring_ptr_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  char* cq = static_cast<char*>(cq_ring_ptr_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  // SQE下标和提交队列一一对应
+  for (unsigned i = 0; i < sq_entries_; ++i) sq_array_[i] = i;
+  // 特性位里没有表示原地更新poll的标志，只能实际试一次
+  poll_update_ = ProbePollUpdate();
+  return true;
+}
+
+bool UringPoller::ProbePollUpdate() {
+  io_uring_sqe* sqe = GetSqe();
+  if (!sqe) return false;
+  // 更新一个不存在的poll请求
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->len = IORING_POLL_UPDATE_EVENTS;
+  sqe->addr = OP_PROBE << 56;
+  sqe->user_data = OP_PROBE << 56;
+  __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+  if (IoUringEnter(ring_fd_, 1, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 1) {
+    return false;
+  }
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  int res = -EINVAL;
+  for (; head != tail; ++head) {
+    const io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+    if (cqe->user_data == (OP_PROBE << 56)) res = cqe->res;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  // 支持的内核找不到请求返回-ENOENT，不认识这个标志的内核(5.13之前)返回-EINVAL
+  return res == -ENOENT;
+}
+
+io_uring_sqe* UringPoller::GetSqe() {
+  unsigned tail = *sq_tail_;
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (tail - head >= sq_entries_) {
+    // 提交队列满了，先把积压的提交掉
+    int ret = IoUringEnter(ring_fd_, pending_, 0, 0, nullptr, 0);
+    if (ret > 0) pending_ -= std::min<unsigned>(pending_, ret);
+    head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail - head >= sq_entries_) return nullptr;
+  }
+  io_uring_sqe* sqe = &sqes_[tail & *sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+uint64_t UringPoller::PollKey(int fd, const FdState& state) {
+  return (OP_POLL << 56) |
+         (static_cast<uint64_t>(state.generation & 0xffffff) << 32) |
+         static_cast<uint32_t>(fd);
+}
+
+UringPoller::FdState& UringPoller::State(int fd) {
+  if (static_cast<size_t>(fd) >= fds_.size()) {
+    fds_.resize(std::max<size_t>(fd + 1, fds_.size() * 2), FdState());
+  }
+  return fds_[fd];
+}
+
+bool UringPoller::PrepPollAdd(int fd, uint32_t events) {
+  io_uring_sqe* sqe = GetSqe();
+  if (!sqe) return false;
+  FdState& state = State(fd);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events & ~kPollMaskIgnored;
+  sqe->user_data = PollKey(fd, state);
+  // SQE写完之后再移动队尾，内核才能看到完整的请求
+  __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+  ++pending_;
+  state.armed = true;
+  return true;
+}
+
+bool UringPoller::PrepPollUpdate(int fd, uint32_t events) {
+  FdState& state = State(fd);
+  if (!poll_update_) {
+    // 不支持原地更新：撤销旧请求，换一代再添加，撤销产生的完成事件会被丢弃
+    if (!PrepPollRemove(fd)) return false;
+    ++state.generation;
+    return PrepPollAdd(fd, events);
+  }
+  io_uring_sqe* sqe = GetSqe();
+  if (!sqe) return false;
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->len = IORING_POLL_UPDATE_EVENTS;
+  sqe->addr = PollKey(fd, state);
+  sqe->poll32_events = events & ~kPollMaskIgnored;
+  sqe->user_data = OP_REMOVE << 56;
+  __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+  ++pending_;
+  return true;
+}
+
+bool UringPoller::PrepPollRemove(int fd) {
+  io_uring_sqe* sqe = GetSqe();
+  if (!sqe) return false;
+  FdState& state = State(fd);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = PollKey(fd, state);
+  sqe->user_data = OP_REMOVE << 56;
+  __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+  ++pending_;
+  state.armed = false;
+  return true;
+}
+
+void UringPoller::Arm(int fd) {
+  FdState& state = State(fd);
+  bool ok = true;
+  if (state.registered) {
+    ok = state.armed ? PrepPollUpdate(fd, state.events)
+                     : PrepPollAdd(fd, state.events);
+  } else if (state.armed) {
+    // poll请求持有文件的引用，必须撤销，否则close之后socket也不会真正关闭
+    ok = PrepPollRemove(fd);
+  }
+  if (ok) {
+    state.deferred = false;
+  } else if (!state.deferred) {
+    // 提交队列满了(内核暂时不收新的请求)，不能当作注册成功，
+    // 否则这个fd再也不会有事件，记下来等下一次Wait重试
+    LOG_WARN("io_uring submission queue full, fd %d deferred", fd);
+    state.deferred = true;
+    deferred_.push_back(fd);
+  }
+}
+
+size_t UringPoller::RetryDeferred() {
+  std::vector<int> retry;
+  retry.swap(deferred_);
+  for (int fd : retry) {
+    FdState& state = State(fd);
+    // 之后的AddFd/ModFd/DelFd已经注册成功了
+    if (!state.deferred) continue;
+    state.deferred = false;
+    Arm(fd);
+  }
+  return deferred_.size();
+}
+
+void UringPoller::SubmitIfForeign() {
+  // 事件循环线程上的修改留到Wait时一起提交
+  if (!has_owner_ || pthread_equal(owner_, pthread_self())) return;
+  int ret = IoUringEnter(ring_fd_, pending_, 0, 0, nullptr, 0);
+  if (ret > 0) pending_ -= std::min<unsigned>(pending_, ret);
+}
+
+bool UringPoller::AddFd(int fd, uint32_t events, uint32_t tag) {
+  if (fd < 0) return false;
+  std::lock_guard<std::mutex> locker(mtx_);
+  FdState& state = State(fd);
+  if (state.registered) return false;  // 和epoll一样，重复添加是错误
+  // 换一代，fd被关闭又复用之后，旧的poll完成事件会被丢弃
+  ++state.generation;
+  state.registered = true;
+  state.events = events;
+  state.tag = tag;
+  Arm(fd);
+  SubmitIfForeign();
+  return true;
+}
+
+bool UringPoller::ModFd(int fd, uint32_t events, uint32_t tag) {
+  if (fd < 0) return false;
+  std::lock_guard<std::mutex> locker(mtx_);
+  FdState& state = State(fd);
+  if (!state.registered) return false;
+  state.events = events;
+  state.tag = tag;
+  // 仍在监听中时原地更新监听的事件，ONESHOT触发过后重新注册
+  Arm(fd);
+  SubmitIfForeign();
+  return true;
+}
+
+bool UringPoller::DelFd(int fd) {
+  if (fd < 0) return false;
+  std::lock_guard<std::mutex> locker(mtx_);
+  FdState& state = State(fd);
+  if (!state.registered) return false;
+  state.registered = false;
+  Arm(fd);
+  SubmitIfForeign();
+  return true;
+}
+
+int UringPoller::Wait(int timeout) {
+  unsigned to_submit = 0;
+  {
+    std::lock_guard<std::mutex> locker(mtx_);
+    if (!has_owner_) {
+      owner_ = pthread_self();
+      has_owner_ = true;
+    }
+    // 还有没注册上的fd时不能睡太久
+    if (!deferred_.empty() && RetryDeferred() > 0 &&
+        (timeout < 0 || timeout > 1)) {
+      timeout = 1;
+    }
+    to_submit = pending_;
+    pending_ = 0;
+  }
+  // 提交积压的请求并等待，只需要一次io_uring_enter
+  unsigned flags = IORING_ENTER_GETEVENTS;
+  io_uring_getevents_arg arg;
+  __kernel_timespec ts;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000LL;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  int ret = IoUringEnter(ring_fd_, to_submit, 1, flags,
+                         (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr,
+                         (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+  std::lock_guard<std::mutex> locker(mtx_);
+  // 没能提交的留到下一次
+  unsigned submitted = ret > 0 ? static_cast<unsigned>(ret) : 0;
+  if (submitted < to_submit) pending_ += to_submit - submitted;
+
+  // 收割完成队列
+  int num_events = 0;
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail && static_cast<size_t>(num_events) < events_.size()) {
+    const io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+    ++head;
+    if ((cqe->user_data >> 56) != OP_POLL) continue;  // 撤销/更新的结果
+    int fd = static_cast<int>(cqe->user_data & 0xffffffff);
+    FdState& state = State(fd);
+    if (cqe->user_data != PollKey(fd, state)) continue;  // 旧连接的事件
+    state.armed = false;
+    if (cqe->res < 0 || !state.registered) continue;  // 被撤销
+    events_[num_events].fd = fd;
+    events_[num_events].events = static_cast<uint32_t>(cqe->res);
+    events_[num_events].tag = state.tag;
+    ++num_events;
+    // 没有ONESHOT的fd(监听socket)需要持续监听，重新注册
+    if (!(state.events & EPOLLONESHOT)) Arm(fd);
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  return num_events;
+}
+
+int UringPoller::GetEventFd(size_t i) const {
+  assert(i < events_.size());
+  return events_[i].fd;
+}
+
+uint32_t UringPoller::GetEvents(size_t i) const {
+  assert(i < events_.size());
+  return events_[i].events;
+}
+
+uint32_t UringPoller::GetEventTag(size_t i) const {
+  assert(i < events_.size());
+  return events_[i].tag;
+}
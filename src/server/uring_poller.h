@@ -0,0 +1,120 @@
+// Event backend built on io_uring, using raw syscalls (no liburing needed).
+// by zxg
+//
+#ifndef WEBSERVER_SERVER_URING_POLLER_H_
+#define WEBSERVER_SERVER_URING_POLLER_H_
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "poller.h"
+
+// 用io_uring的POLL_ADD模拟epoll的就绪通知。
+// 事件循环线程上的AddFd/ModFd/DelFd只是往提交队列里放一个SQE，
+// 下一次Wait时和等待一起通过一次io_uring_enter提交，
+// 原本每个请求都要做的epoll_ctl系统调用就省掉了。
+// 其他线程(线程池)上的修改会立即提交，提交队列由互斥锁保护。
+// 这只是就绪通知的后端，accept/read/write仍然是各自的系统调用，
+// 没有使用multishot accept/recv、provided buffer和链接的send。
+// 所以它只在内联模式(-i)下有收益：重新注册全在事件循环线程上，
+// 随下一次等待一起提交，每个请求少两次epoll_ctl。线程池模式下重新注册
+// 来自工作线程，每次都要单独io_uring_enter，不比epoll好，默认仍用epoll
+// 提交队列暂时放不下时不会丢掉请求，fd记下来在下一次Wait时重试
+class UringPoller : public Poller {
+ public:
+  explicit UringPoller(int max_event = 1024);
+  ~UringPoller() override;
+
+  // 初始化是否成功，内核不支持io_uring或缺少必要特性时为false
+  inline bool IsValid() const { return ring_fd_ >= 0; }
+
+  bool AddFd(int fd, uint32_t events, uint32_t tag) override;
+  bool ModFd(int fd, uint32_t events, uint32_t tag) override;
+  bool DelFd(int fd) override;
+  int Wait(int timeout = -1) override;
+  int GetEventFd(size_t i) const override;
+  uint32_t GetEvents(size_t i) const override;
+  uint32_t GetEventTag(size_t i) const override;
+  const char* Name() const override { return "io_uring"; }
+
+ private:
+  // user_data最高字节区分请求类型，中间24位为fd的代数，低32位为fd
+  enum Op : uint64_t {
+    OP_POLL = 0,
+    OP_REMOVE = 1,
+    OP_PROBE = 2,
+  };
+
+  // 每个fd的登记状态
+  struct FdState {
+    uint32_t generation;  // AddFd的次数，写入user_data用来识别过期的完成事件
+    uint32_t events;  // 注册的事件
+    uint32_t tag;     // 调用者附带的tag
+    bool registered;  // 是否在监听中(AddFd之后，DelFd之前)
+    bool armed;       // 内核中是否有一个尚未触发的poll请求
+    bool deferred;    // 提交队列满了没能注册，在deferred_中等待重试
+  };
+
+  struct ReadyEvent {
+    int fd;
+    uint32_t events;
+    uint32_t tag;
+  };
+
+  bool Setup(unsigned entries);
+  // 内核是否支持原地更新poll请求监听的事件(IORING_POLL_UPDATE_EVENTS，5.13)
+  bool ProbePollUpdate();
+  // 以下函数要求持有mtx_
+  io_uring_sqe* GetSqe();
+  // 没有空闲的SQE时返回false，什么也不做
+  bool PrepPollAdd(int fd, uint32_t events);
+  bool PrepPollUpdate(int fd, uint32_t events);
+  bool PrepPollRemove(int fd);
+  // 按fd当前的状态注册或更新poll请求，SQE不够时放进deferred_稍后重试
+  void Arm(int fd);
+  // 重试之前没能注册的fd，返回还剩下的数量
+  size_t RetryDeferred();
+  FdState& State(int fd);
+  // poll请求的user_data
+  static uint64_t PollKey(int fd, const FdState& state);
+  // 非事件循环线程上的修改需要马上提交，否则要等到下一次Wait
+  void SubmitIfForeign();
+
+  int ring_fd_;
+  // 提交队列
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  io_uring_sqe* sqes_;
+  unsigned sq_entries_;
+  // 完成队列
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+  // mmap的区域，析构时释放
+  void* sq_ring_ptr_;
+  size_t sq_ring_size_;
+  void* cq_ring_ptr_;
+  size_t cq_ring_size_;
+  size_t sqes_size_;
+
+  std::mutex mtx_;        // 保护提交队列和fds_
+  unsigned pending_;      // 事件循环线程放入但还没提交的SQE数
+  pthread_t owner_;       // 调用Wait的事件循环线程
+  std::atomic<bool> has_owner_;
+  bool poll_update_;      // 支持原地更新，否则先撤销再重新添加
+  std::vector<FdState> fds_;
+  std::vector<int> deferred_;  // 等待重试注册的fd
+  std::vector<ReadyEvent> events_;  // 本轮就绪的事件
+};
+
+#endif  // WEBSERVER_SERVER_URING_POLLER_H_
@@ -2,28 +2,108 @@
 //
 #include "webserver.h"
 
-WebServer::WebServer(int port, int trig_mode, int timeout, bool opt_linger,
+WebServer::WebServer(int port, int trig_mode, int timeout, int idle_timeout,
+                     bool opt_linger,
                      int sql_port, const char* sql_user, const char* sql_pwd, 
-                     const char* db_name, int num_conn_pool, int num_threads,
-                     bool open_log, int log_level, int log_que_size)
+                     const char* db_name, int num_conn_pool,
+                     const LaneOptions& static_lane,
+                     const LaneOptions& db_lane,
+                     int num_reactors, bool use_uring, bool inline_mode,
+                     bool coroutine_mode,
+                     const AcceptOptions& accept_options,
+                     const FileCacheOptions& cache_options, bool open_log,
+                     int log_level, int log_que_size)
     : port_(port),
       open_linger_(opt_linger),
       timeout_(timeout),
+      idle_timeout_(idle_timeout),
       is_close_(false),
-      timer_(new HeapTimer()),  // 智能指针，不用自己释放
-      threadpool_(new Threadpool(num_threads)),
-      epoller_(new Epoller()) {
+      num_reactors_(num_reactors),
+      accept_options_(accept_options),
+      inline_io_(inline_mode || num_reactors > 1),
+      coroutine_mode_(coroutine_mode),
+      slots_(new ConnSlot[MAX_FD_]()),
+      last_report_(std::chrono::steady_clock::now()),
+      last_accepted_(0),
+      last_trim_(last_report_),
+      last_idle_releases_(0) {
+  assert(num_reactors > 0);
+  // 对端已经关闭时写socket(包括sendfile)会产生SIGPIPE，默认动作是终止进程。
+  // 忽略它，写操作返回EPIPE，按普通的写错误关闭连接
+  signal(SIGPIPE, SIG_IGN);
+  if (accept_options_.batch < 1) accept_options_.batch = 1;
+  // 静态通道默认最多接纳所有队列能放下的任务，再多就只能在提交的线程上执行了
+  const size_t static_threads = std::max(static_lane.pool.num_threads,
+                                         static_lane.pool.max_threads);
+  InitLane(&static_lane_, static_lane,
+           static_cast<int>(static_lane.pool.queue_size * static_threads));
+  // 数据库通道的线程比数据库连接多也只能等连接，默认和连接数相同
+  LaneOptions db_options = db_lane;
+  if (db_options.pool.num_threads == 0) {
+    db_options.pool.num_threads = num_conn_pool > 0 ? num_conn_pool : 1;
+  }
+  const size_t db_threads = std::max(db_options.pool.num_threads,
+                                     db_options.pool.max_threads);
+  InitLane(&db_lane_, db_options,
+           coroutine_mode_ ? 1024 : static_cast<int>(db_threads * 4));
+  async_ctx_.cpu = static_lane_.pool.get();
+  async_ctx_.blocking = db_lane_.pool.get();
   src_dir_ = getcwd(nullptr, 256);  // 资源目录
   assert(src_dir_);
   strncat(src_dir_, "/resources/", 16);
   // 初始化http连接类的静态变量
   HttpConnect::user_count = 0;
   HttpConnect::src_dir = src_dir_;
+  // 资源包要在错误页面之前打开，错误页面也从包中读取
+  bool bundle_failed = false;
+  if (!cache_options.bundle_path.empty()) {
+    bundle_failed = !AssetBundle::Instance()->Open(cache_options.bundle_path);
+  }
+  HttpResponse::LoadErrorPages(src_dir_);
+  FileCache::Instance()->Init(cache_options);
+  EncodedCache::Instance()->Init(cache_options.encoded_budget);
+  // 压缩版本在静态通道的线程上生成，不占用事件循环
+  EncodedCache::Instance()->SetPool(static_lane_.pool.get());
   // 获取数据库连接池实例
   SqlConnectionPool::Instance()->Init("localhost", sql_port, sql_user, sql_pwd,
                                       db_name, num_conn_pool);
   InitEventMode(trig_mode);  // 确定事件工作模式
-  if (!InitSocket()) is_close_ = true;
+  // 每个事件循环拥有自己的epoll、定时器、连接表和监听socket
+  for (int i = 0; i < num_reactors; ++i) {
+    std::unique_ptr<Reactor> reactor(new Reactor());
+    reactor->listen_fd = -1;
+    reactor->timer.reset(new HeapTimer());
+    reactor->idle_timer.reset(new HeapTimer());
+    reactor->epoller = Poller::Create(use_uring);
+    if (!InitSocket(reactor.get())) {
+      is_close_ = true;
+      break;
+    }
+    reactors_.push_back(std::move(reactor));
+  }
+  // 文件的变化由inotify通知第一个事件循环，缓存命中时不再stat
+  bool watch_failed = false;
+  if (!is_close_ && cache_options.watch && cache_options.budget > 0 &&
+      !AssetBundle::Instance()->IsOpen()) {
+    watcher_.reset(new FileWatcher());
+    // 缓存的键是src_dir_加上以'/'开头的请求路径
+    if (watcher_->Init(std::string(src_dir_) + "/") &&
+        reactors_[0]->epoller->AddFd(watcher_->get_fd(), EPOLLIN, 0)) {
+      FileCache::Instance()->SetWatched(true);
+    } else {
+      watcher_.reset();
+      watch_failed = true;
+    }
+  } else if (!is_close_ && cache_options.watch &&
+             AssetBundle::Instance()->IsOpen()) {
+    // 使用资源包时只监视资源包文件，部署新的资源包不用重启
+    watcher_.reset(new FileWatcher());
+    if (!watcher_->InitBundle(cache_options.bundle_path) ||
+        !reactors_[0]->epoller->AddFd(watcher_->get_fd(), EPOLLIN, 0)) {
+      watcher_.reset();
+      watch_failed = true;
+    }
+  }
   // 开启日志
   if (open_log) {
     Log::Instance()->Init(log_level, "./logfiles", ".log", log_que_size);
@@ -36,15 +116,72 @@ WebServer::WebServer(int port, int trig_mode, int timeout, bool opt_linger,
                (listen_event_ & EPOLLET ? "ET": "LT"),
                (conn_event_ & EPOLLET ? "ET": "LT"));
       LOG_INFO("LogSys level: %d", log_level);
+      if (idle_timeout_ > 0) {
+        LOG_INFO("Timeout: %dms, Idle release: %dms", timeout_, idle_timeout_);
+      } else {
+        LOG_INFO("Timeout: %dms, Idle release: off", timeout_);
+      }
       LOG_INFO("srcDir: %s", HttpConnect::src_dir);
-      LOG_INFO("SqlConnPool num: %d, ThreadPool num: %d", num_conn_pool,
-               num_threads);
+      if (bundle_failed) {
+        LOG_ERROR("Open bundle %s failed, serving srcDir instead",
+                  cache_options.bundle_path.c_str());
+      } else if (AssetBundle::Instance()->IsOpen()) {
+        LOG_INFO("Bundle: %s, %zu files, reload on change: %s",
+                 cache_options.bundle_path.c_str(),
+                 AssetBundle::Instance()->get_num_entries(),
+                 watcher_ ? "true" : "false");
+        if (watch_failed) LOG_WARN("inotify unavailable, bundle won't reload");
+      }
+      LOG_INFO("SqlConnPool num: %d", num_conn_pool);
+      LOG_INFO("Static lane: threads %zu-%zu, spin: %d, queue: %zu, "
+               "limit: %d", static_lane_.pool->get_num_threads(),
+               static_lane_.pool->get_max_threads(), static_lane.pool.spin,
+               static_lane.pool.queue_size, static_lane_.limit);
+      LOG_INFO("DB lane: threads %zu-%zu, spin: %d, queue: %zu, limit: %d",
+               db_lane_.pool->get_num_threads(),
+               db_lane_.pool->get_max_threads(), db_options.pool.spin,
+               db_options.pool.queue_size, db_lane_.limit);
+      LOG_INFO("Reactor num: %d, IO in loop: %s, Coroutine handlers: %s",
+               num_reactors, inline_io_ ? "true" : "false",
+               coroutine_mode_ ? "true" : "false");
+      LOG_INFO("Event backend: %s, Parser scan: %s",
+               reactors_[0]->epoller->Name(), HttpScan::Name());
+      LOG_INFO("Backlog: %d, Accept batch: %d, DeferAccept: %ds, FastOpen: %d",
+               accept_options_.backlog, accept_options_.batch,
+               accept_options_.defer_accept, accept_options_.fastopen);
+      LOG_INFO("FileCache budget: %zuKB, Collapse misses: %s",
+               cache_options.budget >> 10,
+               cache_options.collapse_misses ? "true" : "false");
+      LOG_INFO("Compressed variants budget: %zuKB",
+               cache_options.encoded_budget >> 10);
+      if (watcher_ && !AssetBundle::Instance()->IsOpen()) {
+        LOG_INFO("File changes: inotify, %zu dirs watched",
+                 watcher_->get_num_dirs());
+      } else if (!AssetBundle::Instance()->IsOpen()) {
+        if (watch_failed) LOG_WARN("inotify unavailable, fall back to stat");
+        LOG_INFO("File changes: stat every %dms",
+                 FileCache::VALIDATE_INTERVAL_MS);
+      }
+      if (cache_options.sendfile_min == SIZE_MAX) {
+        LOG_INFO("File body: mmap + writev");
+      } else {
+        LOG_INFO("File body: sendfile for files >= %zuKB",
+                 cache_options.sendfile_min >> 10);
+      }
     }  // else
   }  // if
 }
 
 WebServer::~WebServer() {
-  close(listen_fd_);
+  // 先等线程池中的任务执行完，它们还会用到连接表和事件循环。
+  // 静态通道的任务可能把请求交给数据库通道，所以先停静态通道。
+  // 之后数据库通道上的请求要生成压缩版本时就在自己的线程上生成
+  EncodedCache::Instance()->SetPool(nullptr);
+  static_lane_.pool.reset();
+  db_lane_.pool.reset();
+  for (auto& reactor : reactors_) {
+    if (reactor->listen_fd >= 0) close(reactor->listen_fd);
+  }
   is_close_ = true;
   free(src_dir_);
   SqlConnectionPool::Instance()->CloseSqlConnPool();
@@ -77,7 +214,7 @@ void WebServer::InitEventMode(int trig_mode) {
   HttpConnect::is_ET = (conn_event_ & EPOLLET);
 }
 
-bool WebServer::InitSocket() {
+bool WebServer::InitSocket(Reactor* reactor) {
   int ret;
   struct sockaddr_in addr;
   // 端口检查
@@ -98,50 +235,73 @@ bool WebServer::InitSocket() {
     optLinger.l_linger = 1;  // linger time on close (units: seconds)
   }
   // create server socket and set option
-  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_fd_ < 0) {
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
     LOG_ERROR("Create socket error!", port_);
     return false;
   }
-  ret = setsockopt(listen_fd_, SOL_SOCKET, SO_LINGER, &optLinger, 
+  ret = setsockopt(listen_fd, SOL_SOCKET, SO_LINGER, &optLinger, 
                    sizeof(optLinger));
   if (ret < 0) {
-    close(listen_fd_);
+    close(listen_fd);
     LOG_ERROR("Init linger error!", port_);
     return false;
   }
   // 开启端口复用选项
   int reuse = 1;
-  ret = setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, (const void*)&reuse,
+  ret = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const void*)&reuse,
                    sizeof(int));
   if (ret == -1) {
     LOG_ERROR("set socket setsockopt error !");
-    close(listen_fd_);
+    close(listen_fd);
     return false;
   }
+  // 多个事件循环各自监听同一端口，由内核在这些socket之间分发新连接
+  if (num_reactors_ > 1) {
+    ret = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void*)&reuse,
+                     sizeof(int));
+    if (ret == -1) {
+      LOG_ERROR("set socket SO_REUSEPORT error !");
+      close(listen_fd);
+      return false;
+    }
+  }
+  // 连接上有数据到达之后才让accept返回，第一次读取可以直接进行
+  if (accept_options_.defer_accept > 0) {
+    ret = setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                     &accept_options_.defer_accept, sizeof(int));
+    if (ret == -1) LOG_WARN("set TCP_DEFER_ACCEPT error !");
+  }
+  // 允许客户端在SYN中携带第一个请求，设置的是等待三次握手完成的TFO请求队列长度
+  if (accept_options_.fastopen > 0) {
+    ret = setsockopt(listen_fd, IPPROTO_TCP, TCP_FASTOPEN,
+                     &accept_options_.fastopen, sizeof(int));
+    if (ret == -1) LOG_WARN("set TCP_FASTOPEN error !");
+  }
   // 绑定
-  ret = bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr));
+  ret = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
   if (ret < 0) {
     LOG_ERROR("Bind Port:%d error!", port_);
-    close(listen_fd_);
+    close(listen_fd);
     return false;
   }
   // 监听，设定队列长度
-  ret = listen(listen_fd_, 6);
+  ret = listen(listen_fd, accept_options_.backlog);
   if (ret < 0) {
     LOG_ERROR("Listen port:%d error!", port_);
-    close(listen_fd_);
+    close(listen_fd);
     return false;
   }
   // 加入监听事件描述符集
-  ret = epoller_->AddFd(listen_fd_,  listen_event_ | EPOLLIN);
+  ret = reactor->epoller->AddFd(listen_fd,  listen_event_ | EPOLLIN, 0);
   if (ret == 0) {
     LOG_ERROR("Add listen error!");
-    close(listen_fd_);
+    close(listen_fd);
     return false;
   }
   // 设置监听事件为非阻塞
-  SetFdNonblock(listen_fd_);
+  SetFdNonblock(listen_fd);
+  reactor->listen_fd = listen_fd;
   LOG_INFO("Server port:%d", port_);
   return true;
 }
@@ -149,125 +309,577 @@ bool WebServer::InitSocket() {
 int WebServer::SetFdNonblock(int fd) {
   assert(fd > 0);
   // fcntl params: fd, cmd, args
-  // F_GETFD: get fd flags
+  // F_GETFL: get the file status flags
   // F_SETFL: set the file status flags
-  return fcntl(fd, F_SETFL, fcntl(fd, F_GETFD, 0) | O_NONBLOCK);
+  return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
-void WebServer::SendError(int fd, const char*info) {
+void WebServer::SendError(int fd, int code) {
   assert(fd > 0);
-  int ret = send(fd, info, strlen(info), 0);
-  if (ret < 0) LOG_WARN("send error to client[%d] error!", fd);
+  // 用启动时生成好的错误响应，块来自线程缓存，连接满时大量拒绝也不会分配内存
+  BufferChain buff;
+  HttpResponse::AppendErrorPage(&buff, code, false, false);
+  int save_errno = 0;
+  if (buff.WriteFd(fd, &save_errno) < 0) {
+    LOG_WARN("send error to client[%d] error!", fd);
+  }
   close(fd);  // 为什么不调用CloseConnect
 }
 
-void WebServer::CloseConnect(HttpConnect* client) {
+void WebServer::Rearm(Reactor* reactor, HttpConnect* client,
+                      uint32_t events) {
+  ConnSlot& slot = slots_[client->get_fd()];
+  // 重新注册之后连接才可能有新的事件，在这之前交还给事件循环
+  client->SetBusy(false);
+  if (slot.registered) {
+    reactor->epoller->ModFd(client->get_fd(), events, slot.generation);
+  } else {
+    slot.registered = true;
+    reactor->epoller->AddFd(client->get_fd(), events, slot.generation);
+  }
+}
+
+void WebServer::CloseConnect(Reactor* reactor, HttpConnect* client) {
   assert(client);
   LOG_INFO("Client[%d] quit!", client->get_fd());
-  epoller_->DelFd(client->get_fd());
+  ConnSlot& slot = slots_[client->get_fd()];
+  if (slot.registered) {
+    slot.registered = false;
+    reactor->epoller->DelFd(client->get_fd());
+  }
+  slot.waiter.store(nullptr, std::memory_order_relaxed);
   client->Close();
 }
 
 void WebServer::Start() {
-  int time_ms = -1;  // epoll wait timeout == -1 无事件将阻塞
-  if (!is_close_) LOG_INFO("========== Server start ==========");
+  if (is_close_) return;
+  LOG_INFO("========== Server start ==========");
+  // 第一个事件循环运行在当前线程，其余的各自占用一个线程
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < reactors_.size(); ++i) {
+    threads.emplace_back(&WebServer::Loop, this, reactors_[i].get());
+  }
+  Loop(reactors_[0].get());
+  for (auto& t : threads) t.join();
+}
+
+void WebServer::Loop(Reactor* reactor) {
+  const bool is_first = reactor == reactors_[0].get();
+  // 内联处理请求或者线程池队列满时，文件缓存未命中会发生在这个线程上，
+  // 不能等其他线程加载
+  FileCache::SetMayWait(false);
   // 启动服务
   while (!is_close_) {
+    int time_ms = -1;  // epoll wait timeout == -1 无事件将阻塞
     // 如果设置了超时时间，需要处理超时事件
-    if (timeout_ > 0) time_ms = timer_->GetNextTick();
-    int num_events = epoller_->Wait(time_ms);  // 就绪事件数
+    if (timeout_ > 0) time_ms = reactor->timer->GetNextTick();
+    if (idle_timeout_ > 0) {
+      int idle_ms = reactor->idle_timer->GetNextTick();
+      // 第一个事件循环还要定期整理块池，至少每idle_timeout_醒来一次
+      if (is_first && (idle_ms < 0 || idle_ms > idle_timeout_)) {
+        idle_ms = idle_timeout_;
+      }
+      if (idle_ms >= 0 && (time_ms < 0 || idle_ms < time_ms)) {
+        time_ms = idle_ms;
+      }
+    }
+    int num_events = reactor->epoller->Wait(time_ms);  // 就绪事件数
+    // 由第一个事件循环负责定期输出统计信息
+    if (is_first) {
+      ReportStats();
+      if (idle_timeout_ > 0) TrimPools();
+    }
     // 处理事件
     for (int i = 0; i < num_events; i++) {
-      int fd = epoller_->GetEventFd(i);
-      uint32_t events = epoller_->GetEvents(i);
+      int fd = reactor->epoller->GetEventFd(i);
+      uint32_t events = reactor->epoller->GetEvents(i);
+      if (fd == reactor->listen_fd) {
+        DealConnect(reactor);
+        continue;
+      }
+      if (watcher_ && fd == watcher_->get_fd()) {
+        watcher_->HandleEvents();
+        continue;
+      }
+      // fd直接索引到连接槽，代数不一致说明是已关闭连接的残留事件
+      ConnSlot& slot = slots_[fd];
+      if (slot.generation != reactor->epoller->GetEventTag(i)) continue;
+      HttpConnect* client = slot.conn.get();
+      assert(client);
+      // 协程在等这个事件，关闭也由它来做
+      if (slot.waiter.load(std::memory_order_acquire)) {
+        // 超时后关闭读写引起的EPOLLHUP到来时定时器已经删除了
+        if (!(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+          ExtentTime(reactor, client);
+        }
+        ResumeWaiter(client, events);
+        continue;
+      }
       // 分情况处理
-      if (fd == listen_fd_) {
-        DealConnect();
-      } else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {  // 关闭或挂起
-        assert(users_.count(fd) > 0);
-        CloseConnect(&users_[fd]);
+      if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {  // 关闭或挂起
+        CloseConnect(reactor, client);
       } else if (events & EPOLLIN) {   // 读事件
-        assert(users_.count(fd) > 0);
-        DealRead(&users_[fd]);
+        DealRead(reactor, client);
       } else if (events & EPOLLOUT) {  // 写事件
-        assert(users_.count(fd) > 0);
-        DealWrite(&users_[fd]);
+        DealWrite(reactor, client);
       } else LOG_ERROR("Unexpected event");  // 错误
     }  // for
   }  // while
 }
 
-void WebServer::AddClient(int conn_fd, sockaddr_in cli_addr) {
-  assert(conn_fd > 0);
-  users_[conn_fd].Init(conn_fd, cli_addr);  // 创建并初始化一个httpconnect对象
+void WebServer::AddClient(Reactor* reactor, int conn_fd, sockaddr_in cli_addr) {
+  assert(conn_fd > 0 && conn_fd < MAX_FD_);
+  ConnSlot& slot = slots_[conn_fd];
+  // 该fd第一次使用时才创建连接对象，之后复用
+  if (!slot.conn) slot.conn.reset(new HttpConnect());
+  if (++slot.generation == 0) slot.generation = 1;  // 0留给监听socket
+  slot.waiter.store(nullptr, std::memory_order_relaxed);
+  HttpConnect* client = slot.conn.get();
+  client->Init(conn_fd, cli_addr);  // 初始化httpconnect对象
   // 需要增加一个定时器，超时则触发关闭连接函数
   if (timeout_ > 0) {
-    timer_->AddTimer(conn_fd, timeout_, std::bind(&WebServer::CloseConnect,
-                                                  this, &users_[conn_fd]));
+    reactor->timer->AddTimer(conn_fd, timeout_,
+                             std::bind(&WebServer::OnTimeout, this, reactor,
+                                       conn_fd, slot.generation.load()));
+  }
+  LOG_INFO("Client[%d] in!", client->get_fd());
+  slot.registered = false;
+  // 开启了TCP_DEFER_ACCEPT时，accept返回时请求数据通常已经到达，
+  // 直接读取可以省掉一轮epoll_wait，读完之后再注册事件
+  if (accept_options_.defer_accept > 0) {
+    DealRead(reactor, client);
+    return;
   }
   // 添加epoll监听事件
-  epoller_->AddFd(conn_fd, EPOLLIN | conn_event_);
-  SetFdNonblock(conn_fd);  // 连接设为非阻塞
-  LOG_INFO("Client[%d] in!", users_[conn_fd].get_fd());
+  Rearm(reactor, client, EPOLLIN | conn_event_);
 }
 
-void WebServer::DealConnect() {
+void WebServer::DealConnect(Reactor* reactor) {
   struct sockaddr_in cli_addr;
-  socklen_t cli_len = sizeof(cli_addr);
-  do {
-    int fd = accept(listen_fd_, (struct sockaddr *)&cli_addr, &cli_len);
-    if (fd < 0) return;  // or <= ?
-    else if (HttpConnect::user_count >= MAX_FD_) {  // too many clients
-      SendError(fd, "Server busy!");
-      LOG_WARN("Clients is full!");
+  AcceptStats& stats = reactor->accept_stats;
+  int num_accepted = 0;
+  // 一次唤醒最多处理batch个连接，避免新连接长时间占住事件循环
+  while (num_accepted < accept_options_.batch) {
+    socklen_t cli_len = sizeof(cli_addr);
+    // accept4直接得到非阻塞、close-on-exec的socket，省掉两次fcntl
+    int fd = accept4(reactor->listen_fd, (struct sockaddr *)&cli_addr,
+                     &cli_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      // EAGAIN表示队列已空，其余错误(EMFILE, ENFILE, ENOBUFS...)需要记录
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED) {
+        stats.errors.fetch_add(1, std::memory_order_relaxed);
+        LOG_WARN("Accept error: %s", strerror(errno));
+      }
       return;
     }
-    AddClient(fd, cli_addr);  // add timer or epoll events
-  } while (listen_event_ & EPOLLET);
+    ++num_accepted;
+    stats.accepted.fetch_add(1, std::memory_order_relaxed);
+    // too many clients，或fd超出了连接表的范围
+    if (HttpConnect::user_count >= MAX_FD_ || fd >= MAX_FD_) {
+      stats.rejected.fetch_add(1, std::memory_order_relaxed);
+      SendError(fd, 503);
+      LOG_WARN("Clients is full!");
+      continue;
+    }
+    AddClient(reactor, fd, cli_addr);  // add timer or epoll events
+  }
+  if (num_accepted < accept_options_.batch) return;
+  // 达到批量上限时队列里可能还有连接，ET模式不会再次通知，需要重新注册
+  stats.batch_limited.fetch_add(1, std::memory_order_relaxed);
+  SampleAcceptQueue(reactor);
+  if (listen_event_ & EPOLLET) {
+    reactor->epoller->ModFd(reactor->listen_fd, listen_event_ | EPOLLIN, 0);
+  }
 }
 
-void WebServer::DealRead(HttpConnect* client) {
+void WebServer::SampleAcceptQueue(Reactor* reactor) {
+  // 对监听socket，tcpi_unacked是当前accept队列长度，tcpi_sacked是队列上限
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (getsockopt(reactor->listen_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+    return;
+  }
+  uint32_t depth = info.tcpi_unacked;
+  auto& peak = reactor->accept_stats.queue_peak;
+  if (depth > peak.load(std::memory_order_relaxed)) {
+    peak.store(depth, std::memory_order_relaxed);
+  }
+}
+
+// 读取内核的ListenOverflows计数(整个网络命名空间)，失败返回-1
+static long long ReadListenOverflows() {
+  FILE* fp = fopen("/proc/net/netstat", "r");
+  if (!fp) return -1;
+  char names[4096];
+  char values[4096];
+  long long result = -1;
+  // 文件由成对的行组成，第一行是字段名，第二行是对应的值
+  while (fgets(names, sizeof(names), fp) && fgets(values, sizeof(values), fp)) {
+    if (strncmp(names, "TcpExt:", 7) != 0) continue;
+    char* name_save = nullptr;
+    char* value_save = nullptr;
+    char* name = strtok_r(names, " \n", &name_save);
+    char* value = strtok_r(values, " \n", &value_save);
+    while (name && value) {
+      if (strcmp(name, "ListenOverflows") == 0) {
+        result = atoll(value);
+        break;
+      }
+      name = strtok_r(nullptr, " \n", &name_save);
+      value = strtok_r(nullptr, " \n", &value_save);
+    }
+    break;
+  }
+  fclose(fp);
+  return result;
+}
+
+// 输出任务排队时间的分布，只列出非空的桶，以及估计的p50/p99(桶的上界)
+static void LogWaitHistogram(const char* name, const Threadpool& pool) {
+  std::vector<unsigned long long> hist = pool.GetWaitHistogram();
+  unsigned long long total = 0;
+  for (unsigned long long count : hist) total += count;
+  if (total == 0) return;
+  char buf[1024];
+  int len = 0;
+  unsigned long long sum = 0;
+  long long p50 = -1, p99 = -1;
+  for (int i = 0; i < Threadpool::kWaitBuckets; ++i) {
+    if (hist[i] == 0) continue;
+    sum += hist[i];
+    const long long bound = 1LL << i;  // 这个桶的上界，us
+    if (p50 < 0 && sum * 2 >= total) p50 = bound;
+    if (p99 < 0 && sum * 100 >= total * 99) p99 = bound;
+    if (len < static_cast<int>(sizeof(buf))) {
+      len += snprintf(buf + len, sizeof(buf) - len, " %s%lld:%llu",
+                      i + 1 < Threadpool::kWaitBuckets ? "<" : ">=",
+                      i + 1 < Threadpool::kWaitBuckets ? bound : bound / 2,
+                      hist[i]);
+    }
+  }
+  LOG_INFO("%s lane wait(us): p50 <%lld, p99 <%lld,%s", name, p50, p99, buf);
+}
+
+void WebServer::LogLane(const char* name, const Lane& lane) {
+  const Threadpool& pool = *lane.pool;
+  LOG_INFO("%s lane: in flight %d/%d, rejected %llu, threads %zu/%zu, "
+           "queued %zu, tasks %llu, steals %llu, parks %llu, overflows %llu, "
+           "grows %llu, retires %llu, blocked %llums", name,
+           lane.in_flight.load(), lane.limit, lane.rejected.load(),
+           pool.get_num_threads(), pool.get_max_threads(),
+           pool.get_queue_depth(), pool.get_num_tasks(), pool.get_steals(),
+           pool.get_parks(), pool.get_overflows(), pool.get_grows(),
+           pool.get_retires(), pool.get_blocked_ms());
+  LogWaitHistogram(name, pool);
+}
+
+void WebServer::ReportStats() {
+  auto now = std::chrono::steady_clock::now();
+  auto secs = std::chrono::duration_cast<std::chrono::seconds>(
+      now - last_report_).count();
+  if (secs < STATS_REPORT_INTERVAL_) return;
+  uint64_t accepted = 0, rejected = 0, errors = 0, batch_limited = 0;
+  uint32_t queue_peak = 0;
+  for (auto& reactor : reactors_) {
+    SampleAcceptQueue(reactor.get());
+    AcceptStats& stats = reactor->accept_stats;
+    accepted += stats.accepted.load(std::memory_order_relaxed);
+    rejected += stats.rejected.load(std::memory_order_relaxed);
+    errors += stats.errors.load(std::memory_order_relaxed);
+    batch_limited += stats.batch_limited.load(std::memory_order_relaxed);
+    queue_peak = std::max(queue_peak,
+                          stats.queue_peak.exchange(0, std::memory_order_relaxed));
+  }
+  LOG_INFO("Accept: total %llu, rate %.1f/s, rejected %llu, errors %llu, "
+           "batch limited %llu, queue peak %u/%d, kernel ListenOverflows %lld",
+           (unsigned long long)accepted,
+           (double)(accepted - last_accepted_) / secs,
+           (unsigned long long)rejected, (unsigned long long)errors,
+           (unsigned long long)batch_limited, queue_peak,
+           accept_options_.backlog, ReadListenOverflows());
+  FileCache* cache = FileCache::Instance();
+  LOG_INFO("FileCache: entries %zu, used %zu/%zuKB, hits %llu, misses %llu, "
+           "evictions %llu", cache->get_num_entries(), cache->get_used() >> 10,
+           cache->get_budget() >> 10, cache->get_hits(), cache->get_misses(),
+           cache->get_evictions());
+  if (watcher_) {
+    LOG_INFO("FileWatcher: dirs %zu, events %llu, invalidations %llu",
+             watcher_->get_num_dirs(), watcher_->get_num_events(),
+             cache->get_invalidations());
+  }
+  LogLane("Static", static_lane_);
+  LogLane("DB", db_lane_);
+  EncodedCache* encoded = EncodedCache::Instance();
+  LOG_INFO("EncodedCache: entries %zu, used %zu/%zuKB, compressed %llu",
+           encoded->get_num_entries(), encoded->get_used() >> 10,
+           encoded->get_budget() >> 10, encoded->get_compressed());
+  BlockPool* pool = BlockPool::Instance();
+  LOG_INFO("BlockPool: slabs %zu (%zuKB), blocks in use %zu, oversized %zu, "
+           "released %zu", pool->get_num_slabs(),
+           pool->get_num_slabs() * BlockPool::SLAB_BLOCKS *
+               BlockPool::BLOCK_SIZE >> 10,
+           pool->get_in_use(), pool->get_oversized(),
+           pool->get_num_released());
+  // 连接占用的内存：连接对象、处理状态和缓冲区中的块
+  const size_t users = HttpConnect::user_count;
+  const size_t exchanges = HttpConnect::get_num_exchanges();
+  const size_t conn_memory = users * sizeof(HttpConnect) +
+                             exchanges * HttpConnect::get_exchange_size() +
+                             pool->get_in_use() * BlockPool::BLOCK_SIZE;
+  LOG_INFO("Connections: %zu, active %zu, idle releases %llu, "
+           "memory %zuKB (%zu bytes/conn)", users, exchanges,
+           HttpConnect::idle_releases.load(), conn_memory >> 10,
+           users > 0 ? conn_memory / users : 0);
+  last_accepted_ = accepted;
+  last_report_ = now;
+}
+
+void WebServer::DealRead(Reactor* reactor, HttpConnect* client) {
   assert(client);
-  ExtentTime(client);  // 调整连接的过期时间
+  ExtentTime(reactor, client);  // 调整连接的过期时间
+  // 内联模式下直接在本循环线程上读取，避免线程间的交接
+  if (inline_io_) {
+    OnRead(reactor, client);
+    return;
+  }
+  // 静态通道积压太多时不再排队，在事件循环线程上读出请求，直接回复503
+  if (!static_lane_.TryEnter()) {
+    int read_errno = 0;
+    if (client->Read(&read_errno) <= 0 && read_errno != EAGAIN) {
+      CloseConnect(reactor, client);
+      return;
+    }
+    Reject(reactor, client);
+    return;
+  }
   // 向线程池任务队列中增加一个读任务
-  threadpool_->AddTask(std::bind(&WebServer::OnRead, this, client));
+  client->SetBusy(true);
+  // 同一个连接的任务优先交给同一个线程
+  static_lane_.pool->AddTask(client->get_fd(), [this, reactor, client] {
+    OnRead(reactor, client);
+    static_lane_.Leave();
+  });
 }
 
-void WebServer::DealWrite(HttpConnect* client) {
+void WebServer::DealWrite(Reactor* reactor, HttpConnect* client) {
   assert(client);
-  ExtentTime(client);
-  // 向线程池任务队列中增加一个写任务
-  threadpool_->AddTask(std::bind(&WebServer::OnWrite, this, client));
+  ExtentTime(reactor, client);
+  if (inline_io_) {
+    OnWrite(reactor, client);
+    return;
+  }
+  // 向线程池任务队列中增加一个写任务，响应已经生成了，不受准入上限限制
+  client->SetBusy(true);
+  static_lane_.Enter();
+  static_lane_.pool->AddTask(client->get_fd(), [this, reactor, client] {
+    OnWrite(reactor, client);
+    static_lane_.Leave();
+  });
 }
 
-void WebServer::ExtentTime(HttpConnect* client) {
+void WebServer::ExtentTime(Reactor* reactor, HttpConnect* client) {
   assert(client);
-  if (timeout_ > 0) timer_->Adjust(client->get_fd(), timeout_);
+  if (timeout_ > 0) reactor->timer->Adjust(client->get_fd(), timeout_);
+  if (idle_timeout_ <= 0) return;
+  const int fd = client->get_fd();
+  ConnSlot& slot = slots_[fd];
+  if (slot.idle_generation == slot.generation) {
+    reactor->idle_timer->Adjust(fd, idle_timeout_);
+    return;
+  }
+  // 定时器触发后就被删除了，下一次活动时再加上。堆中可能还有这个fd上
+  // 一个连接的节点，AddTimer会直接更新它
+  slot.idle_generation = slot.generation;
+  reactor->idle_timer->AddTimer(fd, idle_timeout_,
+                                std::bind(&WebServer::OnIdle, this, fd,
+                                          slot.generation.load()));
+}
+
+void WebServer::OnIdle(int fd, uint32_t generation) {
+  ConnSlot& slot = slots_[fd];
+  // 连接已经关闭，fd被其他连接复用了
+  if (slot.generation != generation) return;
+  slot.idle_generation = 0;
+  HttpConnect* client = slot.conn.get();
+  // 在线程池上处理得比空闲时间还久，先不动，下一次活动之后重新计时
+  if (client->IsBusy()) return;
+  client->ReleaseIdle();
 }
 
-void WebServer::OnRead(HttpConnect* client) {
+void WebServer::TrimPools() {
+  auto now = std::chrono::steady_clock::now();
+  if (now - last_trim_ < std::chrono::milliseconds(idle_timeout_)) return;
+  last_trim_ = now;
+  size_t released = BlockPool::Instance()->Trim(POOL_KEEP_BLOCKS_);
+  if (released > 0) LOG_DEBUG("BlockPool: released %zu blocks", released);
+  // 释放的处理状态超出了对象池的容量时被delete，但glibc不会主动把
+  // 堆中间的空闲页还给系统，有连接空闲释放过才需要整理一次
+  unsigned long long idle_releases = HttpConnect::idle_releases;
+  if (idle_releases != last_idle_releases_) {
+    last_idle_releases_ = idle_releases;
+    malloc_trim(0);
+  }
+}
+
+void WebServer::OnRead(Reactor* reactor, HttpConnect* client) {
   assert(client);
   int len = -1;  // 读取的长度，字节数
   int readErrno = 0;
   len = client->Read(&readErrno);
   if (len <= 0 && readErrno != EAGAIN) {
-    CloseConnect(client);  // 发生错误
+    CloseConnect(reactor, client);  // 发生错误
+    return;
+  }
+  DealProcess(reactor, client);
+}
+
+void WebServer::DealProcess(Reactor* reactor, HttpConnect* client) {
+  // 可能阻塞的请求(登录/注册要查询数据库)交给数据库通道，
+  // 数据库慢的时候只有这个通道的线程被卡住。静态资源请求在当前线程
+  // (静态通道或者内联模式下的事件循环线程)上接着处理
+  if (client->MayBlock()) {
+    if (!db_lane_.TryEnter()) {
+      Reject(reactor, client);
+      return;
+    }
+    client->SetBusy(true);
+    if (coroutine_mode_) {
+      // 在当前线程上开始处理，第一次等待数据库时就返回
+      Spawn(Serve(reactor, client));
+      return;
+    }
+    db_lane_.pool->AddTask(client->get_fd(), [this, reactor, client] {
+      OnProcess(reactor, client);
+      db_lane_.Leave();
+    });
     return;
   }
-  OnProcess(client);
+  OnProcess(reactor, client);
 }
 
-void WebServer::OnProcess(HttpConnect* client) {
+Async<void> WebServer::Serve(Reactor* reactor, HttpConnect* client) {
+  struct LaneGuard {  // 协程结束时归还数据库通道的名额
+    Lane* lane;
+    ~LaneGuard() { lane->Leave(); }
+  } lane_guard{&db_lane_};
+  while (true) {
+    if (!co_await client->ProcessAsync(async_ctx_)) {
+      if (!client->HasPendingInput()) {
+        Rearm(reactor, client, conn_event_ | EPOLLIN);
+        co_return;
+      }
+      // 请求还不完整(比如请求体还没收全)，等可读之后接着读
+      uint32_t events = co_await WaitIo(reactor, client, EPOLLIN);
+      int read_errno = 0;
+      if ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ||
+          (client->Read(&read_errno) <= 0 && read_errno != EAGAIN)) {
+        CloseConnect(reactor, client);
+        co_return;
+      }
+      continue;
+    }
+    // 和OnWrite相同，发送缓冲区满了或者只写了一部分时等可写
+    while (true) {
+      int write_errno = 0;
+      ssize_t len = client->Write(&write_errno);
+      if (client->ToWriteBytes() == 0) break;
+      if (len <= 0 && write_errno != EAGAIN) {
+        CloseConnect(reactor, client);
+        co_return;
+      }
+      uint32_t events = co_await WaitIo(reactor, client, EPOLLOUT);
+      if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        CloseConnect(reactor, client);
+        co_return;
+      }
+    }
+    if (!client->IsKeepAlive()) {
+      CloseConnect(reactor, client);
+      co_return;
+    }
+    // 后面还有要查数据库的请求时接着处理，否则回到同步的处理方式
+    if (client->MayBlock()) continue;
+    OnProcess(reactor, client);
+    co_return;
+  }
+}
+
+void WebServer::IoAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  // 注册之后协程随时可能被恢复，这个对象随之失效，先把成员取出来
+  WebServer* self = server;
+  Reactor* loop = reactor;
+  HttpConnect* conn = client;
+  const uint32_t wait_events = events;
+  self->slots_[conn->get_fd()].waiter.store(handle,
+                                            std::memory_order_release);
+  self->Rearm(loop, conn, self->conn_event_ | wait_events);
+}
+
+uint32_t WebServer::IoAwaiter::await_resume() const {
+  return server->slots_[client->get_fd()].waiter_events;
+}
+
+void WebServer::ResumeWaiter(HttpConnect* client, uint32_t events) {
+  ConnSlot& slot = slots_[client->get_fd()];
+  std::coroutine_handle<> waiter =
+      slot.waiter.exchange(nullptr, std::memory_order_acquire);
+  slot.waiter_events = events;
+  client->SetBusy(true);
+  static_lane_.Enter();
+  static_lane_.pool->AddTask(client->get_fd(), [this, waiter] {
+    waiter.resume();
+    static_lane_.Leave();
+  });
+}
+
+void WebServer::OnTimeout(Reactor* reactor, int fd, uint32_t generation) {
+  ConnSlot& slot = slots_[fd];
+  // 连接已经关闭，fd被复用了(可能在另一个事件循环上)，新连接有自己的定时器
+  if (slot.generation != generation) return;
+  HttpConnect* client = slot.conn.get();
+  // 先看busy再看waiter：协程挂起时先写waiter再清除busy，
+  // 反过来读可能看到waiter为空而连接不忙，把挂起的协程关掉
+  if (client->IsBusy()) {
+    // 还在线程池上处理(比如在等数据库)，现在关闭会和处理它的线程冲突，
+    // 过一个超时周期再看
+    reactor->timer->AddTimer(fd, timeout_,
+                             std::bind(&WebServer::OnTimeout, this, reactor,
+                                       fd, generation));
+    return;
+  }
+  if (slot.waiter.load(std::memory_order_relaxed)) {
+    // 协程在等socket，关闭读写后事件循环会收到EPOLLHUP，交给协程去关闭
+    shutdown(fd, SHUT_RDWR);
+    return;
+  }
+  CloseConnect(reactor, client);
+}
+
+void WebServer::Reject(Reactor* reactor, HttpConnect* client) {
+  // 503带Retry-After，客户端稍后重试；发送完关闭连接，丢掉后面排着的请求
+  LOG_DEBUG("Client[%d] rejected, lane is full", client->get_fd());
+  client->Reject(503);
+  Rearm(reactor, client, conn_event_ | EPOLLOUT);
+}
+
+void WebServer::InitLane(Lane* lane, const LaneOptions& options,
+                         int default_limit) {
+  lane->pool.reset(new Threadpool(options.pool));
+  lane->limit = options.limit > 0 ? options.limit : default_limit;
+}
+
+void WebServer::OnProcess(Reactor* reactor, HttpConnect* client) {
   if (client->Process()) {  // 没有可读数据会返回false
     // 如果请求解析成功则将对应的epoll事件改为写事件
-    epoller_->ModFd(client->get_fd(), conn_event_ | EPOLLOUT);
+    Rearm(reactor, client, conn_event_ | EPOLLOUT);
   } else {
     // 否则相反
-    epoller_->ModFd(client->get_fd(), conn_event_ | EPOLLIN);
+    Rearm(reactor, client, conn_event_ | EPOLLIN);
   }
 }
 
-void WebServer::OnWrite(HttpConnect* client) {
+void WebServer::OnWrite(Reactor* reactor, HttpConnect* client) {
   assert(client);
   int len = -1;  // 写入的长度，字节数
   int writeErrno = 0;
@@ -277,16 +889,14 @@ void WebServer::OnWrite(HttpConnect* client) {
     // 传输完成,如果客户端设置了长连接，那么调用OnProcess函数，因为此时的client->process()
     // 会返回false，所以该连接会重新注册epoll的EPOLLIN事件
     if (client->IsKeepAlive()) {
-      OnProcess(client);
-      return;
-    }
-  } else if (len < 0) {
-    // 若返回值小于0，且信号为EAGAIN说明数据还没有发送完
-    // 重新在EPOLL上注册该连接的EPOLLOUT事件*/
-    if (writeErrno == EAGAIN) {
-      epoller_->ModFd(client->get_fd(), conn_event_ | EPOLLOUT);
+      DealProcess(reactor, client);
       return;
     }
+  } else if (len > 0 || writeErrno == EAGAIN) {
+    // 数据还没有发送完：发送缓冲区满了(EAGAIN)，或者LT模式下只写了一部分，
+    // 重新在EPOLL上注册该连接的EPOLLOUT事件
+    Rearm(reactor, client, conn_event_ | EPOLLOUT);
+    return;
   }
-  CloseConnect(client);  // 否则关闭连接
+  CloseConnect(reactor, client);  // 否则关闭连接
 }
\ No newline at end of file
@@ -5,60 +5,214 @@
 #define WEBSERVER_SERVER_WEBSERVER_H_
 
 #include <fcntl.h>       // fcntl()
+#include <malloc.h>      // malloc_trim()
 #include <unistd.h>      // close()
 #include <assert.h>
 #include <errno.h>
+#include <signal.h>      // signal()
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>  // TCP_DEFER_ACCEPT, TCP_FASTOPEN, TCP_INFO
 #include <arpa/inet.h>
 
-#include <unordered_map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <coroutine>
 
 #include "../pool/threadpool.h"
+#include "../pool/coroutine.h"
 #include "../pool/sql_connect_raii.h"
 #include "../pool/sql_connect_pool.h"
 #include "../http/http_connect.h"
+#include "../http/http_scan.h"
+#include "../http/file_cache.h"
+#include "../http/file_watcher.h"
+#include "../http/asset_bundle.h"
+#include "../http/encoded_cache.h"
 #include "../timer/heaptimer.h"
 #include "../log/log.h"
-#include "epoller.h"
+#include "poller.h"
+
+// 监听socket和accept路径的可调参数
+struct AcceptOptions {
+  int backlog = 1024;    // listen()的队列长度，实际上限受net.core.somaxconn限制
+  int batch = 64;        // 每次唤醒最多accept的连接数
+  int defer_accept = 0;  // TCP_DEFER_ACCEPT等待数据的秒数，0表示关闭
+  int fastopen = 0;      // TCP_FASTOPEN的队列长度，0表示关闭
+};
+
+// 一个执行通道：一组独立的线程和它的准入上限
+struct LaneOptions {
+  ThreadpoolOptions pool;
+  // 同时接纳的任务数(排队和执行中)，超出时直接回复503。
+  // 0表示取默认值：静态通道是所有队列的总容量，数据库通道是线程数的4倍，
+  // 协程模式下数据库请求等待时不占线程，数据库通道默认接纳1024个
+  int limit = 0;
+};
 
 class WebServer {
  public:
   // params: 
-  WebServer(int port, int trig_mode, int timeout, bool opt_linger,
+  // static_lane: 处理读写和静态请求的线程池及其准入上限
+  // db_lane: 处理要查询数据库的请求(登录/注册)的线程池及其准入上限，
+  //          线程数为0时和数据库连接数相同
+  // num_reactors: 事件循环的数量，大于1时每个线程独占一个epoll循环和监听socket
+  // use_uring: 使用io_uring作为事件后端，内核不支持时退回epoll
+  // inline_mode: 在事件循环线程上直接处理读写和静态请求，只有可能阻塞的请求
+  //              交给数据库通道，多reactor模式下总是开启
+  // coroutine_mode: 登录/注册请求由协程处理，等数据库连接、等查询结果和
+  //                 等socket可读写时挂起，不占用线程，数据库通道只执行查询
+  // accept_options: 监听队列长度、accept批量大小以及TCP选项
+  // cache_options: 静态文件缓存的内存上限、未命中合并、资源包和目录监视
+  // idle_timeout: 连接空闲这么久(毫秒)后释放处理请求用的内存，0表示不释放
+  WebServer(int port, int trig_mode, int timeout, int idle_timeout,
+            bool opt_linger,
             int sql_port, const char* sql_user, const char* sql_pwd, 
-            const char* db_name, int num_conn_pool, int num_threads,
-            bool open_log, int log_level, int log_que_size);
+            const char* db_name, int num_conn_pool,
+            const LaneOptions& static_lane, const LaneOptions& db_lane,
+            int num_reactors, bool use_uring, bool inline_mode,
+            bool coroutine_mode, const AcceptOptions& accept_options,
+            const FileCacheOptions& cache_options, bool open_log,
+            int log_level, int log_que_size);
   ~WebServer();
   // 启动服务器
   void Start();
 
  private:
-  // 创建服务端监听套接字
-  bool InitSocket();
+  // accept路径的计数器，每个事件循环一份，由本循环写，统计时汇总
+  struct AcceptStats {
+    std::atomic<uint64_t> accepted{0};       // 成功accept的连接数
+    std::atomic<uint64_t> rejected{0};       // 连接数已满被拒绝的连接数
+    std::atomic<uint64_t> errors{0};         // accept出错(EMFILE, ENFILE...)的次数
+    std::atomic<uint64_t> batch_limited{0};  // 一次唤醒达到批量上限的次数
+    std::atomic<uint32_t> queue_peak{0};     // 观察到的accept队列最大长度
+  };
+
+  // 一个事件循环独占的全部状态，多reactor模式下每个线程各有一份，
+  // 循环之间不共享任何数据，热路径上无需加锁
+  struct Reactor {
+    int listen_fd;  // 监听的socket，多reactor模式下通过SO_REUSEPORT绑定同一端口
+    std::unique_ptr<HeapTimer> timer;
+    std::unique_ptr<HeapTimer> idle_timer;  // 连接空闲后释放内存
+    std::unique_ptr<Poller> epoller;  // 事件后端，epoll或io_uring
+    AcceptStats accept_stats;
+  };
+
+  // 一个执行通道。数据库请求和静态请求各用一个，登录注册阻塞在数据库上时
+  // 不会占满处理静态请求的线程，各自积压太多时拒绝新的请求而不是无限排队
+  struct Lane {
+    std::unique_ptr<Threadpool> pool;
+    int limit = 0;  // 同时接纳的任务数
+    std::atomic<int> in_flight{0};  // 排队和执行中的任务数
+    std::atomic<unsigned long long> rejected{0};  // 超出上限被拒绝的请求数
+    // 占一个名额，已经满了时返回false
+    bool TryEnter() {
+      if (in_flight.fetch_add(1, std::memory_order_relaxed) >= limit) {
+        in_flight.fetch_sub(1, std::memory_order_relaxed);
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+    // 不受上限限制地占一个名额，用于已经接纳的请求的后续任务
+    void Enter() { in_flight.fetch_add(1, std::memory_order_relaxed); }
+    void Leave() { in_flight.fetch_sub(1, std::memory_order_relaxed); }
+  };
+
+  // 连接表中的一个槽，以fd为下标。fd在进程内唯一，所以各个事件循环
+  // 只会访问自己的连接所在的槽，不需要加锁。例外是定时器：定时器属于
+  // 事件循环，连接关闭时不删除，fd被另一个事件循环上的新连接复用后，
+  // 旧的定时器仍会触发，回调比较代数后直接返回。
+  // 连接对象在该fd第一次被使用时创建，之后一直复用，地址不会变化
+  struct ConnSlot {
+    std::unique_ptr<HttpConnect> conn;
+    // 每有一个新连接占用该槽就加1，随fd一起注册到事件后端，
+    // 用来丢弃fd被关闭又复用之后残留的旧事件和旧定时器。
+    // 其他事件循环的旧定时器也会读它，所以是原子变量
+    std::atomic<uint32_t> generation;
+    // 是否已经注册到事件后端，开启TCP_DEFER_ACCEPT时连接先读再注册
+    bool registered;
+    // 空闲定时器是为哪一代连接设置的，0表示没有设置
+    uint32_t idle_generation;
+    // 在等待这个连接上的事件的协程，事件循环收到事件时恢复它，没有时为空。
+    // 由挂起协程的工作线程写入，在Rearm清除busy之前，事件循环看到连接
+    // 不忙时一定也能看到它
+    std::atomic<std::coroutine_handle<>> waiter;
+    uint32_t waiter_events;  // 恢复协程时发生的事件
+  };
+
+  // co_await WaitIo(...)的返回值：注册events后挂起协程，
+  // 事件循环收到事件(或者连接超时)时在静态通道上恢复，返回发生的事件
+  struct IoAwaiter {
+    WebServer* server;
+    Reactor* reactor;
+    HttpConnect* client;
+    uint32_t events;
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    uint32_t await_resume() const;
+  };
+
+  // 为一个事件循环创建服务端监听套接字
+  bool InitSocket(Reactor* reactor);
   // 初始化事件工作模式
   void InitEventMode(int trig_mode);
+  // 运行一个事件循环，直到服务器关闭
+  void Loop(Reactor* reactor);
   // 根据客户的fd初始化httpconnect，添加对应的计时器和epoll监听事件
-  void AddClient(int conn_fd, sockaddr_in cli_addr);
-  // 处理连接事件
-  void DealConnect();
+  void AddClient(Reactor* reactor, int conn_fd, sockaddr_in cli_addr);
+  // 处理连接事件，每次最多accept accept_options_.batch个连接
+  void DealConnect(Reactor* reactor);
+  // 记录监听socket当前accept队列的长度
+  void SampleAcceptQueue(Reactor* reactor);
+  // 定期汇总各个事件循环的accept计数和文件缓存的统计并写入日志
+  void ReportStats();
   // 处理写事件
-  void DealWrite(HttpConnect* client);
+  void DealWrite(Reactor* reactor, HttpConnect* client);
   // 处理读事件
-  void DealRead(HttpConnect* client);
-  // 向客户端发送给错误消息并关闭连接
-  void SendError(int fd, const char* info);
-  // 延长当前连接的过期时间
-  void ExtentTime(HttpConnect* client);
+  void DealRead(Reactor* reactor, HttpConnect* client);
+  // 向客户端发送code对应的错误响应并关闭连接
+  void SendError(int fd, int code);
+  // 延长当前连接的过期时间，空闲定时器重新计时
+  void ExtentTime(Reactor* reactor, HttpConnect* client);
+  // 连接空闲超过idle_timeout_，把处理状态还给池
+  void OnIdle(int fd, uint32_t generation);
+  // 把块池中多余的空闲块的物理内存还给系统，每idle_timeout_做一次
+  void TrimPools();
+  // 注册或修改连接在事件后端上监听的事件
+  void Rearm(Reactor* reactor, HttpConnect* client, uint32_t events);
   // 删除epoll监听事件，关闭连接
-  void CloseConnect(HttpConnect* client);
+  void CloseConnect(Reactor* reactor, HttpConnect* client);
   // 读取一条连接上的数据
-  void OnRead(HttpConnect* client);
+  void OnRead(Reactor* reactor, HttpConnect* client);
   // 向一条连接上写数据
-  void OnWrite(HttpConnect* client);
+  void OnWrite(Reactor* reactor, HttpConnect* client);
   // 处理数据
-  void OnProcess(HttpConnect* client);
+  void OnProcess(Reactor* reactor, HttpConnect* client);
+  // 根据请求是否可能阻塞，决定在当前线程处理数据还是交给数据库通道
+  void DealProcess(Reactor* reactor, HttpConnect* client);
+  // 协程模式下处理连接上可能阻塞的请求：处理、发送，直到读缓冲中没有
+  // 完整的请求，再交还给事件循环。占用一个数据库通道的名额，结束时归还
+  Async<void> Serve(Reactor* reactor, HttpConnect* client);
+  // 在协程中等待连接上的events事件
+  IoAwaiter WaitIo(Reactor* reactor, HttpConnect* client, uint32_t events) {
+    return IoAwaiter{this, reactor, client, events};
+  }
+  // 连接上有协程在等待，把发生的事件交给它，在静态通道上恢复
+  void ResumeWaiter(HttpConnect* client, uint32_t events);
+  // 连接超时。还在被线程池或协程处理时推迟，处理完再关闭。
+  // generation不一致说明连接已经关闭，fd可能被别的事件循环复用了
+  void OnTimeout(Reactor* reactor, int fd, uint32_t generation);
+  // 通道已满，丢弃连接上的请求并回复503
+  void Reject(Reactor* reactor, HttpConnect* client);
+  // 创建通道的线程池，计算默认的准入上限
+  static void InitLane(Lane* lane, const LaneOptions& options,
+                       int default_limit);
+  // 把通道的准入和线程池统计写入日志
+  static void LogLane(const char* name, const Lane& lane);
   // 将描述符fd设为非阻塞状态
   static int SetFdNonblock(int fd);
 
@@ -66,18 +220,35 @@ class WebServer {
   int port_;          // 服务器端口
   bool open_linger_;  // socket选项SO_LINGER是否开启，用来处理在close()时残留的数据，丢弃或继续发送
   int timeout_;       // 超时时间，毫秒MS
+  int idle_timeout_;  // 空闲多久后释放连接的处理状态，毫秒MS，0表示不释放
   bool is_close_;     // 初始化套接字是否成功，成功则表示服务开启，为false
-  int listen_fd_;     // 监听的socket
   char* src_dir_;     // 资源文件目录
+  int num_reactors_;  // 事件循环(reactor)的数量
+  AcceptOptions accept_options_;
+  // 读写和静态请求是否直接在事件循环线程上执行，只有可能阻塞的请求交给数据库通道
+  bool inline_io_;
+  // 登录/注册请求是否用协程处理
+  bool coroutine_mode_;
+  AsyncContext async_ctx_;  // 协程在静态通道上执行，查询交给数据库通道
   
   uint32_t listen_event_;  // 监听的socket上发生的事件
   uint32_t conn_event_;    // 一个连接上发生的事件
   
-  std::unique_ptr<HeapTimer> timer_;
-  std::unique_ptr<Threadpool> threadpool_;
-  std::unique_ptr<Epoller> epoller_;
-  // fd和客户连接之间的映射，方便快速找到一个连接
-  std::unordered_map<int, HttpConnect> users_;
+  Lane static_lane_;  // 读写和静态请求
+  Lane db_lane_;      // 要查询数据库的请求
+  std::vector<std::unique_ptr<Reactor>> reactors_;  // 至少一个事件循环
+  // 预先分配的连接表，MAX_FD_个槽，按fd直接索引，无需哈希查找
+  std::unique_ptr<ConnSlot[]> slots_;
+  // 监视资源目录的inotify，注册在第一个事件循环上，没有开启时为空
+  std::unique_ptr<FileWatcher> watcher_;
+
+  static const int STATS_REPORT_INTERVAL_ = 60;  // 统计信息的输出间隔，秒
+  std::chrono::steady_clock::time_point last_report_;
+  uint64_t last_accepted_;  // 上次统计时的accept总数，用来计算速率
+  // 块池保留的空闲块数，多出来的交还物理内存
+  static const size_t POOL_KEEP_BLOCKS_ = 256;
+  std::chrono::steady_clock::time_point last_trim_;
+  unsigned long long last_idle_releases_;  // 上次整理时的空闲释放次数
 };
 
 
@@ -11,13 +11,13 @@ void HeapTimer::SwapNode(size_t i, size_t j) {
 
 void HeapTimer::SiftUp(size_t idx, size_t n) {
   assert(idx >= 0 && idx < heap_.size());
-  size_t parent = (idx - 1) / 2;  // 父节点
-  while (parent >= 0) {
+  // 下标是无符号数，到根节点就停，否则(0 - 1) / 2会越界
+  while (idx > 0) {
+    size_t parent = (idx - 1) / 2;  // 父节点
     if (heap_[parent] < heap_[idx]) break;  // 加个等号？
     SwapNode(idx, parent);
     // 向上移动
     idx = parent;
-    parent = (idx - 1) / 2;
   }
 }
 
@@ -64,8 +64,8 @@ void HeapTimer::DoWork(int id) {
   if (heap_.empty() || ref_.count(id) == 0) return;  // 判断条件应该多了
   size_t i = ref_[id];
   TimerNode node = heap_[i];
+  DelTimer(i);  // 先删除再回调，回调中可以为同一个id重新添加定时器
   node.cb();
-  DelTimer(i);
 }
 
 void HeapTimer::DelTimer(size_t idx) {
@@ -99,8 +99,8 @@ void HeapTimer::Tick() {
     // 未超时
     if (std::chrono::duration_cast<MS>(node.expires - Clock::now())
         .count() > 0) break; 
+    Pop();  // 同上，先删除再回调
     node.cb();
-    Pop();
   }
 }
 
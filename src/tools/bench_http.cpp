@@ -0,0 +1,226 @@
+// Keep-alive HTTP load generator for comparing server configurations.
+// by zxg
+//
+// 用法: ./bin/bench_http port [connections] [seconds] [path] [server_pid]
+// 单线程用epoll驱动connections条长连接，每条连接上一问一答地发GET请求，
+// 服务器关闭连接时重新连接，输出每秒请求数和响应延迟。
+// 给出server_pid时还输出服务器每个请求消耗的CPU时间(用户态+内核态，
+// 从/proc/<pid>/stat读取)，机器只有一两个核、压测程序和服务器抢CPU时，
+// 这个比每秒请求数更能反映服务器本身的开销。
+// eg: 分别用 ./bin/server 和 ./bin/server -u 启动，比较epoll和io_uring后端
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+struct Conn {
+  int fd = -1;
+  string in;               // 收到的还没解析完的响应
+  size_t sent = 0;         // 当前请求已经发出的字节数
+  Clock::time_point start;  // 当前请求开始发送的时间
+};
+
+// 建立连接并注册到epfd，注册的数据是连接的下标
+bool Open(int epfd, int port, uint32_t index, Conn* conn) {
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (conn->fd < 0) return false;
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(conn->fd, reinterpret_cast<sockaddr*>(&addr),
+              sizeof(addr)) < 0 &&
+      errno != EINPROGRESS) {
+    close(conn->fd);
+    return false;
+  }
+  epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.u32 = index;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+  conn->in.clear();
+  conn->sent = 0;
+  conn->start = Clock::now();
+  return true;
+}
+
+// 从in的开头解析出一个完整的响应，返回它的长度，还不完整时返回0，
+// 格式错误时返回-1
+long ParseResponse(const string& in, int* status) {
+  size_t head_end = in.find("\r\n\r\n");
+  if (head_end == string::npos) return 0;
+  if (in.compare(0, 9, "HTTP/1.1 ") != 0) return -1;
+  *status = atoi(in.c_str() + 9);
+  size_t body_len = 0;
+  // 字段名不区分大小写
+  const char* pos = strcasestr(in.c_str(), "\r\ncontent-length:");
+  if (pos && pos < in.c_str() + head_end) {
+    body_len = strtoul(pos + 17, nullptr, 10);
+  }
+  size_t total = head_end + 4 + body_len;
+  return in.size() >= total ? static_cast<long>(total) : 0;
+}
+
+// 进程累计消耗的CPU时间，单位为时钟周期(sysconf(_SC_CLK_TCK))
+bool ReadCpuTicks(int pid, unsigned long long* ticks) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+  char buf[1024];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+  buf[len] = '\0';
+  // 进程名可能带空格，从最后一个')'之后开始数，utime和stime是第14、15项
+  const char* p = strrchr(buf, ')');
+  if (!p) return false;
+  unsigned long long utime = 0, stime = 0;
+  if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+             &utime, &stime) != 2) {
+    return false;
+  }
+  *ticks = utime + stime;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s port [connections] [seconds] [path] [server_pid]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  const int port = atoi(argv[1]);
+  const int num_conns = argc > 2 ? atoi(argv[2]) : 32;
+  const int seconds = argc > 3 ? atoi(argv[3]) : 5;
+  const string path = argc > 4 ? argv[4] : "/index.html";
+  const int server_pid = argc > 5 ? atoi(argv[5]) : 0;
+  if (port <= 0 || num_conns <= 0 || seconds <= 0) {
+    fprintf(stderr, "invalid arguments\n");
+    return EXIT_FAILURE;
+  }
+  const string request =
+      "GET " + path +
+      " HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  vector<Conn> conns(num_conns);
+  for (int i = 0; i < num_conns; ++i) {
+    if (!Open(epfd, port, i, &conns[i])) {
+      fprintf(stderr, "connect: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  unsigned long long cpu_begin = 0, cpu_end = 0;
+  const bool has_cpu = server_pid > 0 && ReadCpuTicks(server_pid, &cpu_begin);
+  vector<long long> latency_us;
+  latency_us.reserve(1 << 20);
+  size_t errors = 0;      // 不是200或者格式错误的响应数
+  size_t reconnects = 0;  // 服务器关闭连接后重新连接的次数
+  vector<epoll_event> events(num_conns);
+  char buf[65536];
+  const Clock::time_point begin = Clock::now();
+  const Clock::time_point end = begin + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    int n = epoll_wait(epfd, events.data(), num_conns, 100);
+    for (int i = 0; i < n; ++i) {
+      Conn& conn = conns[events[i].data.u32];
+      if (conn.sent < request.size() && (events[i].events & EPOLLOUT)) {
+        ssize_t len = send(conn.fd, request.data() + conn.sent,
+                           request.size() - conn.sent, MSG_NOSIGNAL);
+        if (len > 0) conn.sent += len;
+        if (conn.sent == request.size()) {
+          // 发完了只等响应，不再关心可写
+          epoll_event ev = {};
+          ev.events = EPOLLIN;
+          ev.data.u32 = events[i].data.u32;
+          epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+        }
+      }
+      if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+      ssize_t len;
+      while ((len = recv(conn.fd, buf, sizeof(buf), 0)) > 0) {
+        conn.in.append(buf, len);
+      }
+      const bool closed = len == 0 || (len < 0 && errno != EAGAIN);
+      int status = 0;
+      long used = ParseResponse(conn.in, &status);
+      const Clock::time_point now = Clock::now();
+      if (used > 0) {
+        if (status != 200) ++errors;
+        conn.in.erase(0, used);
+        latency_us.push_back(
+            chrono::duration_cast<chrono::microseconds>(now - conn.start)
+                .count());
+      } else if (used < 0) {
+        ++errors;
+      }
+      if (closed || used < 0) {
+        // 服务器关闭了连接(没有收完的请求作废)或者响应格式错误，重新连接
+        close(conn.fd);
+        ++reconnects;
+        if (!Open(epfd, port, events[i].data.u32, &conn)) {
+          fprintf(stderr, "connect: %s\n", strerror(errno));
+          return EXIT_FAILURE;
+        }
+        continue;
+      }
+      if (used == 0) continue;
+      // 下一个请求，通常一次send就能发完
+      conn.start = now;
+      conn.sent = 0;
+      len = send(conn.fd, request.data(), request.size(), MSG_NOSIGNAL);
+      if (len > 0) conn.sent = len;
+      if (conn.sent < request.size()) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u32 = events[i].data.u32;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+      }
+    }
+  }
+  const double secs =
+      chrono::duration<double>(Clock::now() - begin).count();
+  if (has_cpu) ReadCpuTicks(server_pid, &cpu_end);
+  for (Conn& conn : conns) close(conn.fd);
+  close(epfd);
+
+  if (latency_us.empty()) {
+    fprintf(stderr, "no responses\n");
+    return EXIT_FAILURE;
+  }
+  sort(latency_us.begin(), latency_us.end());
+  const size_t num = latency_us.size();
+  printf("%zu requests in %.2fs, %.0f req/s, %zu errors, %zu reconnects\n",
+         num, secs, num / secs, errors, reconnects);
+  printf("latency p50 %lldus, p99 %lldus, max %lldus\n", latency_us[num / 2],
+         latency_us[num * 99 / 100], latency_us[num - 1]);
+  if (has_cpu) {
+    const double cpu_us =
+        (cpu_end - cpu_begin) * 1e6 / sysconf(_SC_CLK_TCK) / num;
+    printf("server cpu %.1fus/request\n", cpu_us);
+  }
+  return 0;
+}
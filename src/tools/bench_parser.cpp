@@ -0,0 +1,188 @@
+// Benchmarks the state machine request parser against the old regex parser.
+// by zxg
+//
+// 用法: ./bin/bench_parser [iterations]
+// 用几种典型的请求分别测量两种解析方式每个请求的耗时和堆内存分配次数。
+// 正则解析照搬了原来HttpRequest::ParseRequestLine/ParseRequestHeader的做法：
+// 每行拷贝成std::string，每次调用都构造std::regex，请求头放进unordered_map
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <new>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "../http/http_parser.h"
+#include "../http/http_scan.h"
+
+using namespace std;
+
+namespace {
+
+// 统计堆内存分配次数，单线程使用
+size_t g_num_allocs = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++g_num_allocs;
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw bad_alloc();
+}
+
+// 不内联，否则gcc会把内联后的free和new配对，误报-Wmismatched-new-delete
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+// 原来基于正则的解析，只保留请求行和请求头部分
+class RegexParser {
+ public:
+  bool Parse(const char* begin, const char* end) {
+    const char kCrlf[] = "\r\n";
+    method_.clear();
+    path_.clear();
+    version_.clear();
+    header_.clear();
+    bool in_request_line = true;
+    while (begin < end) {
+      const char* line_end = search(begin, end, kCrlf, kCrlf + 2);
+      string line(begin, line_end);
+      if (line.empty()) return !in_request_line;  // 请求头结束
+      if (in_request_line) {
+        if (!ParseRequestLine(line)) return false;
+        in_request_line = false;
+      } else {
+        ParseRequestHeader(line);
+      }
+      if (line_end == end) break;
+      begin = line_end + 2;
+    }
+    return false;
+  }
+
+  string GetHeader(const string& name) {
+    auto it = header_.find(name);
+    return it == header_.end() ? "" : it->second;
+  }
+
+ private:
+  bool ParseRequestLine(const string& line) {
+    regex pattern("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");
+    smatch match_group;
+    if (!regex_match(line, match_group, pattern)) return false;
+    method_ = match_group[1];
+    path_ = match_group[2];
+    version_ = match_group[3];
+    return true;
+  }
+
+  void ParseRequestHeader(const string& line) {
+    regex pattern("^([^:]*): ?(.*)$");
+    smatch match_group;
+    if (regex_match(line, match_group, pattern)) {
+      header_[match_group[1]] = match_group[2];
+    }
+  }
+
+  string method_;
+  string path_;
+  string version_;
+  unordered_map<string, string> header_;
+};
+
+struct Sample {
+  const char* name;
+  string request;
+};
+
+double NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct Result {
+  double ns_per_req;
+  double allocs_per_req;
+};
+
+// 运行f iterations次，返回每次的平均耗时和分配次数。f返回false表示解析失败
+template <typename F>
+Result Run(size_t iterations, F f) {
+  for (size_t i = 0; i < iterations / 10 + 1; ++i) f();  // 预热
+  size_t allocs = g_num_allocs;
+  double start = NowNs();
+  size_t ok = 0;
+  for (size_t i = 0; i < iterations; ++i) ok += f();
+  double elapsed = NowNs() - start;
+  if (ok != iterations) {
+    fprintf(stderr, "parse failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return {elapsed / iterations,
+          static_cast<double>(g_num_allocs - allocs) / iterations};
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+  if (iterations == 0) iterations = 1;
+
+  const Sample samples[] = {
+      {"minimal GET", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"},
+      {"browser GET",
+       "GET /css/bootstrap.min.css HTTP/1.1\r\n"
+       "Host: www.example.com:9006\r\n"
+       "Connection: keep-alive\r\n"
+       "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+       "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+       "Accept: text/css,*/*;q=0.1\r\n"
+       "Referer: http://www.example.com:9006/index.html\r\n"
+       "Accept-Encoding: gzip, deflate, br\r\n"
+       "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+       "If-None-Match: \"5f2b-1a2c3\"\r\n"
+       "If-Modified-Since: Tue, 15 Nov 1994 08:12:31 GMT\r\n"
+       "\r\n"},
+      {"login POST",
+       "POST /login HTTP/1.1\r\n"
+       "Host: www.example.com:9006\r\n"
+       "Connection: keep-alive\r\n"
+       "Content-Type: application/x-www-form-urlencoded\r\n"
+       "Content-Length: 29\r\n"
+       "\r\n"},
+  };
+
+  printf("scan kernels: %s, %zu iterations\n", HttpScan::Name(), iterations);
+  printf("%-12s %14s %14s %12s %12s %8s\n", "request", "regex ns/req",
+         "state ns/req", "regex alloc", "state alloc", "speedup");
+  RegexParser regex_parser;
+  HttpParser state_parser;
+  for (const Sample& sample : samples) {
+    const char* begin = sample.request.data();
+    const char* end = begin + sample.request.size();
+    Result regex_result = Run(iterations / 10 + 1, [&] {
+      return regex_parser.Parse(begin, end) &&
+             !regex_parser.GetHeader("Host").empty();
+    });
+    Result state_result = Run(iterations, [&] {
+      state_parser.Reset();
+      return state_parser.Parse(begin, end - begin) ==
+                 HttpParser::PARSE_COMPLETE &&
+             !state_parser.GetHeader("Host").empty();
+    });
+    printf("%-12s %14.1f %14.1f %12.1f %12.1f %7.1fx\n", sample.name,
+           regex_result.ns_per_req, state_result.ns_per_req,
+           regex_result.allocs_per_req, state_result.allocs_per_req,
+           regex_result.ns_per_req / state_result.ns_per_req);
+  }
+  return 0;
+}
@@ -0,0 +1,215 @@
+// Benchmarks the work-stealing thread pool against the old mutex + queue pool.
+// by zxg
+//
+// 用法: ./bin/bench_threadpool [num_threads] [num_tasks]
+// 提交的任务和服务器一样是std::bind(&WebServer::OnRead, this, reactor, client)，
+// 分别测量：
+//   吞吐：几个线程(模拟事件循环)同时提交num_tasks个任务，到全部执行完的速度
+//   延迟：一次只提交一个任务，从提交到开始执行的时间。连续提交时线程还在
+//         自旋，间隔一段时间再提交时线程已经休眠，要被唤醒
+//   分配：每次提交的堆内存分配次数
+// 原来的线程池(一把锁保护std::queue<std::function>)在这里按原样实现一份，
+// 只是析构时join线程，测完可以干净地退出
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "../pool/threadpool.h"
+
+using namespace std;
+
+namespace {
+
+atomic<size_t> g_num_allocs{0};  // 堆内存分配次数
+
+}  // namespace
+
+void* operator new(size_t size) {
+  g_num_allocs.fetch_add(1, memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw bad_alloc();
+}
+
+// 不内联，否则gcc会把内联后的free和new配对，误报-Wmismatched-new-delete
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+// 原来的线程池
+class MutexPool {
+ public:
+  explicit MutexPool(size_t num_threads) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads_.emplace_back([this] {
+        unique_lock<mutex> locker(mtx_);
+        while (true) {
+          if (!tasks_.empty()) {
+            auto task = std::move(tasks_.front());
+            tasks_.pop();
+            locker.unlock();
+            task();
+            locker.lock();
+          } else if (is_closed_) {
+            break;
+          } else {
+            cond_.wait(locker);
+          }
+        }
+      });
+    }
+  }
+  ~MutexPool() {
+    {
+      lock_guard<mutex> locker(mtx_);
+      is_closed_ = true;
+    }
+    cond_.notify_all();
+    for (thread& t : threads_) t.join();
+  }
+
+  template <typename F>
+  void AddTask(F&& task) {
+    {
+      lock_guard<mutex> locker(mtx_);
+      tasks_.emplace(std::forward<F>(task));
+    }
+    cond_.notify_one();
+  }
+
+ private:
+  mutex mtx_;
+  condition_variable cond_;
+  bool is_closed_ = false;
+  queue<function<void()>> tasks_;
+  vector<thread> threads_;
+};
+
+// 代替WebServer，任务的形状和大小和服务器提交的一样
+struct FakeServer {
+  void OnRead(void* reactor, void* client) {
+    (void)reactor;
+    (void)client;
+    done.fetch_add(1, memory_order_release);
+  }
+  void OnLatency(void* reactor, void* client) {
+    (void)reactor;
+    const Clock::time_point submitted =
+        *static_cast<const Clock::time_point*>(client);
+    latency_ns.push_back(
+        chrono::duration_cast<chrono::nanoseconds>(Clock::now() - submitted)
+            .count());
+    done.fetch_add(1, memory_order_release);
+  }
+
+  atomic<size_t> done{0};
+  vector<long long> latency_ns;  // 一次只有一个任务，不用加锁
+};
+
+const int kProducers = 2;  // 提交任务的线程数，相当于事件循环数
+
+struct Throughput {
+  double tasks_per_sec;
+  double allocs_per_task;
+};
+
+template <typename Pool>
+Throughput MeasureThroughput(Pool* pool, size_t num_tasks) {
+  FakeServer server;
+  char reactor, client;
+  const size_t per_producer = num_tasks / kProducers;
+  const size_t total = per_producer * kProducers;
+  const size_t allocs = g_num_allocs.load();
+  const Clock::time_point start = Clock::now();
+  vector<thread> producers;
+  for (int i = 0; i < kProducers; ++i) {
+    producers.emplace_back([&] {
+      for (size_t j = 0; j < per_producer; ++j) {
+        pool->AddTask(
+            std::bind(&FakeServer::OnRead, &server, &reactor, &client));
+      }
+    });
+  }
+  for (thread& t : producers) t.join();
+  while (server.done.load(memory_order_acquire) < total) this_thread::yield();
+  const double secs =
+      chrono::duration<double>(Clock::now() - start).count();
+  return {total / secs,
+          static_cast<double>(g_num_allocs.load() - allocs) / total};
+}
+
+struct Latency {
+  long long p50_ns;
+  long long p99_ns;
+};
+
+// 一次提交一个任务，等它执行完再提交下一个，两次之间间隔gap
+template <typename Pool>
+Latency MeasureLatency(Pool* pool, size_t samples, chrono::microseconds gap) {
+  FakeServer server;
+  server.latency_ns.reserve(samples);
+  char reactor;
+  for (size_t i = 0; i < samples; ++i) {
+    if (gap.count() > 0) this_thread::sleep_for(gap);
+    Clock::time_point submitted = Clock::now();
+    pool->AddTask(
+        std::bind(&FakeServer::OnLatency, &server, &reactor, &submitted));
+    // 延迟在任务开始时就记下了，等待时让出CPU不影响结果
+    while (server.done.load(memory_order_acquire) <= i) this_thread::yield();
+  }
+  vector<long long>& lat = server.latency_ns;
+  sort(lat.begin(), lat.end());
+  return {lat[lat.size() / 2], lat[lat.size() * 99 / 100]};
+}
+
+template <typename Pool>
+void Report(const char* name, Pool* pool, size_t num_tasks) {
+  Throughput throughput = MeasureThroughput(pool, num_tasks);
+  Latency hot = MeasureLatency(pool, 20000, chrono::microseconds(0));
+  Latency parked = MeasureLatency(pool, 1000, chrono::microseconds(500));
+  printf("%-12s %12.2f %10.2f %10lld %10lld %12lld %12lld\n", name,
+         throughput.tasks_per_sec / 1e6, throughput.allocs_per_task,
+         hot.p50_ns, hot.p99_ns, parked.p50_ns, parked.p99_ns);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  size_t num_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4;
+  size_t num_tasks = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000000;
+  if (num_threads == 0 || num_tasks < kProducers) {
+    fprintf(stderr, "usage: %s [num_threads] [num_tasks]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu threads, %d producers, %zu tasks, %u cpus\n", num_threads,
+         kProducers, num_tasks, thread::hardware_concurrency());
+  printf("%-12s %12s %10s %10s %10s %12s %12s\n", "pool", "Mtasks/s",
+         "alloc/task", "hot p50ns", "hot p99ns", "parked p50ns",
+         "parked p99ns");
+  {
+    MutexPool pool(num_threads);
+    Report("mutex queue", &pool, num_tasks);
+  }
+  {
+    ThreadpoolOptions options;
+    options.num_threads = num_threads;
+    Threadpool pool(options);
+    Report("work steal", &pool, num_tasks);
+  }
+  return 0;
+}
@@ -0,0 +1,235 @@
+// Packs a resources directory into one asset bundle file.
+// by zxg
+//
+// 用法: ./bin/pack_bundle resources/ resources.pack
+// 然后用 ./bin/server -k resources.pack 启动。
+// 所有响应头需要的字段(类型、ETag、修改时间、缓存策略)和压缩版本都在这里生成，
+// 服务器启动时只映射文件，不再打开、stat或压缩任何资源
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../http/asset_bundle.h"
+#include "../http/encoded_cache.h"
+#include "../http/file_cache.h"
+
+using namespace std;
+
+namespace {
+
+// 打包前的一个资源
+struct Asset {
+  string path;  // URL路径，eg: /css/style.css
+  struct stat st;
+  string data;
+  string gzip;
+  string br;
+};
+
+// 递归列出dir下的普通文件，名字以'.'开头的文件和目录不打包
+bool ListFiles(const string& root, const string& rel, vector<string>* files) {
+  DIR* dir = opendir((root + rel).c_str());
+  if (dir == nullptr) {
+    fprintf(stderr, "opendir %s%s: %s\n", root.c_str(), rel.c_str(),
+            strerror(errno));
+    return false;
+  }
+  bool ok = true;
+  while (struct dirent* ent = readdir(dir)) {
+    if (ent->d_name[0] == '.') continue;
+    const string path = rel + "/" + ent->d_name;
+    struct stat st;
+    if (stat((root + path).c_str(), &st) < 0) continue;  // 断开的符号链接
+    if (S_ISDIR(st.st_mode)) {
+      ok = ListFiles(root, path, files) && ok;
+    } else if (S_ISREG(st.st_mode)) {
+      files->push_back(path);
+    }
+  }
+  closedir(dir);
+  return ok;
+}
+
+bool ReadFile(const string& path, string* data) {
+  ifstream file(path, ios::binary);
+  if (!file) return false;
+  ostringstream content;
+  content << file.rdbuf();
+  *data = content.str();
+  return true;
+}
+
+// 压缩为gzip格式，压缩后没有变小时返回false
+bool Gzip(const string& in, string* out) {
+  z_stream zs = {};
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  out->resize(deflateBound(&zs, in.size()));
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  zs.avail_in = in.size();
+  zs.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  zs.avail_out = out->size();
+  int ret = deflate(&zs, Z_FINISH);
+  out->resize(zs.total_out);
+  deflateEnd(&zs);
+  return ret == Z_STREAM_END && out->size() < in.size();
+}
+
+// 同目录下的压缩文件，比原文件旧时不使用(和EncodedCache的规则一样)
+void LoadSibling(const string& root, const Asset& asset, const char* suffix,
+                 string* data) {
+  const string path = root + asset.path + suffix;
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_mtime < asset.st.st_mtime || !ReadFile(path, data)) {
+    data->clear();
+  }
+}
+
+// 按内容计算ETag，同样的内容在哪台机器上打包都一样
+string ContentEtag(const string& data) {
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%llx-%zx\"",
+           static_cast<unsigned long long>(BundleHash(data)), data.size());
+  return etag;
+}
+
+// 按8字节对齐追加数据，返回它的位置
+BundleRef Append(string* blob, const string& data) {
+  if (data.empty()) return {0, 0};
+  blob->resize((blob->size() + 7) & ~static_cast<size_t>(7));
+  BundleRef ref = {blob->size(), data.size()};
+  blob->append(data);
+  return ref;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <resources_dir> <output>\n", argv[0]);
+    return 1;
+  }
+  string root = argv[1];
+  while (root.size() > 1 && root.back() == '/') root.pop_back();
+  const string output = argv[2];
+
+  vector<string> paths;
+  if (!ListFiles(root, "", &paths)) return 1;
+  sort(paths.begin(), paths.end());
+  const set<string> all(paths.begin(), paths.end());
+
+  vector<Asset> assets;
+  size_t compressed = 0;
+  for (const string& path : paths) {
+    // 已经有原文件的.gz/.br只作为它的压缩版本，不单独提供
+    const size_t dot = path.find_last_of('.');
+    if (dot != string::npos &&
+        (path.compare(dot, string::npos, ".gz") == 0 ||
+         path.compare(dot, string::npos, ".br") == 0) &&
+        all.count(path.substr(0, dot))) {
+      continue;
+    }
+    Asset asset;
+    asset.path = path;
+    if (stat((root + path).c_str(), &asset.st) < 0) continue;
+    // 其他用户不可读的文件在目录模式下是403，不能打包公开出去
+    if (!(asset.st.st_mode & S_IROTH)) {
+      fprintf(stderr, "skip %s: not world-readable\n", path.c_str());
+      continue;
+    }
+    if (!ReadFile(root + path, &asset.data)) {
+      fprintf(stderr, "read %s failed\n", path.c_str());
+      return 1;
+    }
+    LoadSibling(root, asset, ".br", &asset.br);
+    LoadSibling(root, asset, ".gz", &asset.gzip);
+    if (asset.gzip.empty() &&
+        FileCache::IsCompressible(FileCache::ContentType(path)) &&
+        asset.data.size() >= EncodedCache::MIN_COMPRESS_SIZE &&
+        asset.data.size() <= EncodedCache::MAX_COMPRESS_SIZE) {
+      if (Gzip(asset.data, &asset.gzip)) {
+        ++compressed;
+      } else {
+        asset.gzip.clear();
+      }
+    }
+    assets.push_back(std::move(asset));
+  }
+  if (assets.size() >= UINT32_MAX / 2) {
+    fprintf(stderr, "too many files\n");
+    return 1;
+  }
+
+  // 哈希表至少一半是空位，查找时探测次数很少
+  uint32_t num_slots = 2;
+  while (num_slots < 2 * assets.size()) num_slots <<= 1;
+  BundleHeader header = {};
+  memcpy(header.magic, AssetBundle::kMagic, sizeof(header.magic));
+  header.version = AssetBundle::kVersion;
+  header.num_entries = assets.size();
+  header.num_slots = num_slots;
+  header.entries_off = sizeof(BundleHeader);
+  header.slots_off = header.entries_off + assets.size() * sizeof(BundleEntry);
+
+  // 字符串和内容放在哈希表后面，entries最后再填回文件开头
+  vector<BundleEntry> entries(assets.size());
+  vector<uint32_t> slots(num_slots, 0);
+  string blob(header.slots_off + num_slots * sizeof(uint32_t), '\0');
+  for (size_t i = 0; i < assets.size(); ++i) {
+    const Asset& asset = assets[i];
+    BundleEntry& entry = entries[i];
+    entry.hash = BundleHash(asset.path);
+    entry.mtime = asset.st.st_mtime;
+    entry.path = Append(&blob, asset.path);
+    entry.data = Append(&blob, asset.data);
+    entry.gzip = Append(&blob, asset.gzip);
+    entry.br = Append(&blob, asset.br);
+    entry.content_type = Append(&blob, FileCache::ContentType(asset.path));
+    entry.etag = Append(&blob, ContentEtag(asset.data));
+    entry.last_modified =
+        Append(&blob, FileCache::HttpDate(asset.st.st_mtime));
+    entry.cache_control = Append(&blob, FileCache::CacheControl(asset.path));
+    uint32_t slot = entry.hash & (num_slots - 1);
+    while (slots[slot] != 0) slot = (slot + 1) & (num_slots - 1);
+    slots[slot] = i + 1;
+  }
+  header.file_size = blob.size();
+  memcpy(&blob[0], &header, sizeof(header));
+  if (!entries.empty()) {
+    memcpy(&blob[header.entries_off], entries.data(),
+           entries.size() * sizeof(BundleEntry));
+  }
+  memcpy(&blob[header.slots_off], slots.data(), num_slots * sizeof(uint32_t));
+
+  // 先写临时文件再rename，正在运行的服务器不会映射到写了一半的文件
+  const string tmp = output + ".tmp";
+  {
+    ofstream file(tmp, ios::binary | ios::trunc);
+    file.write(blob.data(), blob.size());
+    if (!file.flush()) {
+      fprintf(stderr, "write %s failed\n", tmp.c_str());
+      return 1;
+    }
+  }
+  if (rename(tmp.c_str(), output.c_str()) < 0) {
+    fprintf(stderr, "rename %s failed: %s\n", output.c_str(), strerror(errno));
+    return 1;
+  }
+  printf("Packed %zu files (%zu gzipped here) into %s, %zu bytes\n",
+         assets.size(), compressed, output.c_str(), blob.size());
+  return 0;
+}